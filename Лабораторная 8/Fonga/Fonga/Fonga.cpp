@@ -5,419 +5,6940 @@
 #include <limits>
 #include <omp.h>
 #include <fstream>
+#include <string>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <iterator>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FONGA_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC и Clang требуют явно разрешить AVX для отдельных функций; MSVC генерирует интринсики без флагов
+#if defined(FONGA_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FONGA_TARGET_AVX __attribute__((target("avx")))
+#else
+#define FONGA_TARGET_AVX
+#endif
+
+// Уровень сбора статистики: 0 - выключен, 1 - счетчики лучей и проверок (по умолчанию),
+// 2 - дополнительно время пересечений и шейдинга (два вызова часов на луч)
+#ifndef FONGA_STATS
+#define FONGA_STATS 1
+#endif
+
+#if FONGA_STATS
+#define FONGA_COUNT(statement) statement
+#else
+#define FONGA_COUNT(statement)
+#endif
 
 // Вектор в 3D пространстве
-struct Vector3 {
-    double x, y, z;
+template <typename Real>
+struct Vector3T {
+    Real x, y, z;
+
+    Vector3T(Real x = 0, Real y = 0, Real z = 0) : x(x), y(y), z(z) {}
 
-    Vector3(double x = 0, double y = 0, double z = 0) : x(x), y(y), z(z) {}
+    // Преобразование из другой точности
+    template <typename Other>
+    explicit Vector3T(const Vector3T<Other>& v)
+        : x(static_cast<Real>(v.x)), y(static_cast<Real>(v.y)), z(static_cast<Real>(v.z)) {}
 
-    Vector3 operator+(const Vector3& other) const {
-        return Vector3(x + other.x, y + other.y, z + other.z);
+    Vector3T operator+(const Vector3T& other) const {
+        return Vector3T(x + other.x, y + other.y, z + other.z);
     }
 
-    Vector3 operator-(const Vector3& other) const {
-        return Vector3(x - other.x, y - other.y, z - other.z);
+    Vector3T operator-(const Vector3T& other) const {
+        return Vector3T(x - other.x, y - other.y, z - other.z);
     }
 
-    Vector3 operator*(double scalar) const {
-        return Vector3(x * scalar, y * scalar, z * scalar);
+    Vector3T operator*(Real scalar) const {
+        return Vector3T(x * scalar, y * scalar, z * scalar);
     }
 
-    double dot(const Vector3& other) const {
+    Real dot(const Vector3T& other) const {
         return x * other.x + y * other.y + z * other.z;
     }
 
-    Vector3 cross(const Vector3& other) const {
-        return Vector3(
+    Vector3T cross(const Vector3T& other) const {
+        return Vector3T(
             y * other.z - z * other.y,
             z * other.x - x * other.z,
             x * other.y - y * other.x
         );
     }
 
-    double length() const {
+    Real length() const {
         return std::sqrt(x * x + y * y + z * z);
     }
 
-    Vector3 normalize() const {
-        double len = length();
+    Vector3T normalize() const {
+        Real len = length();
         if (len == 0) return *this;
-        return Vector3(x / len, y / len, z / len);
+        return Vector3T(x / len, y / len, z / len);
     }
 };
 
 // Цвет (RGB)
-struct Color {
-    double r, g, b;
+template <typename Real>
+struct ColorT {
+    Real r, g, b;
 
-    Color(double r = 0, double g = 0, double b = 0) : r(r), g(g), b(b) {}
+    ColorT(Real r = 0, Real g = 0, Real b = 0) : r(r), g(g), b(b) {}
 
-    Color operator+(const Color& other) const {
-        return Color(r + other.r, g + other.g, b + other.b);
+    template <typename Other>
+    explicit ColorT(const ColorT<Other>& c)
+        : r(static_cast<Real>(c.r)), g(static_cast<Real>(c.g)), b(static_cast<Real>(c.b)) {}
+
+    ColorT operator+(const ColorT& other) const {
+        return ColorT(r + other.r, g + other.g, b + other.b);
     }
 
-    Color operator*(double scalar) const {
-        return Color(r * scalar, g * scalar, b * scalar);
+    ColorT operator*(Real scalar) const {
+        return ColorT(r * scalar, g * scalar, b * scalar);
     }
 
-    Color operator*(const Color& other) const {
-        return Color(r * other.r, g * other.g, b * other.b);
+    ColorT operator*(const ColorT& other) const {
+        return ColorT(r * other.r, g * other.g, b * other.b);
     }
 
     // Ограничение значений цвета до [0, 1]
-    Color clamp() const {
-        return Color(
-            std::max(0.0, std::min(1.0, r)),
-            std::max(0.0, std::min(1.0, g)),
-            std::max(0.0, std::min(1.0, b))
+    ColorT clamp() const {
+        return ColorT(
+            std::max(Real(0), std::min(Real(1), r)),
+            std::max(Real(0), std::min(Real(1), g)),
+            std::max(Real(0), std::min(Real(1), b))
         );
     }
 };
 
 // Материал поверхности
-struct Material {
-    Color diffuse;      // Цвет диффузного отражения
-    Color specular;     // Цвет зеркального отражения
-    Color ambient;      // Цвет фонового отражения
-    double shininess;   // Степень зеркального блеска
+template <typename Real>
+struct MaterialT {
+    ColorT<Real> diffuse;      // Цвет диффузного отражения
+    ColorT<Real> specular;     // Цвет зеркального отражения
+    ColorT<Real> ambient;      // Цвет фонового отражения
+    Real shininess;            // Степень зеркального блеска
+    Real reflectivity = 0;     // Доля отраженного луча
+    Real transparency = 0;     // Доля преломленного луча (делится с отраженным по Френелю)
+    Real refractiveIndex = 1;  // Показатель преломления
 
     // Конструктор по умолчанию
-    Material() : diffuse(Color(0.5, 0.5, 0.5)), specular(Color(1.0, 1.0, 1.0)),
-        ambient(Color(0.1, 0.1, 0.1)), shininess(32.0) {}
+    MaterialT() : diffuse(ColorT<Real>(Real(0.5), Real(0.5), Real(0.5))), specular(ColorT<Real>(1, 1, 1)),
+        ambient(ColorT<Real>(Real(0.1), Real(0.1), Real(0.1))), shininess(32) {}
 
     // Конструктор с параметрами
-    Material(const Color& diff, const Color& spec, const Color& amb, double shine)
+    MaterialT(const ColorT<Real>& diff, const ColorT<Real>& spec, const ColorT<Real>& amb, Real shine)
         : diffuse(diff), specular(spec), ambient(amb), shininess(shine) {}
+
+    template <typename Other>
+    explicit MaterialT(const MaterialT<Other>& m)
+        : diffuse(m.diffuse), specular(m.specular), ambient(m.ambient), shininess(static_cast<Real>(m.shininess)),
+        reflectivity(static_cast<Real>(m.reflectivity)), transparency(static_cast<Real>(m.transparency)),
+        refractiveIndex(static_cast<Real>(m.refractiveIndex)) {}
+
+    // Порождает ли материал вторичные лучи
+    bool isTracing() const {
+        return reflectivity > 0 || transparency > 0;
+    }
+
+    // Показатель зеркальной степени быстрого затенения. Для модели Фонга - блеск. Блик
+    // Блинна-Фонга cos^(4 * shininess) с полувектором близок по ширине к блику Фонга, а в степень
+    // возводится квадрат косинуса, поэтому для него - 2 * shininess.
+    Real getSpecularExponent(bool blinn) const {
+        return (blinn ? 2 : 1) * shininess;
+    }
+
+    // Тот же показатель, если он целый и не больше MAX_FAST_EXPONENT (степень считается двоичным
+    // возведением), иначе -1: дробный показатель не округляется, а остается std::pow
+    static const int MAX_FAST_EXPONENT = 4095;
+
+    int getFastExponent(bool blinn) const {
+        Real exponent = getSpecularExponent(blinn);
+        if (!(exponent >= 0 && exponent <= MAX_FAST_EXPONENT) || exponent != std::floor(exponent)) return -1;
+        return static_cast<int>(exponent);
+    }
 };
 
 // Источник света
-struct Light {
-    Vector3 position;
-    Color diffuse;      // Цвет диффузного излучения
-    Color specular;     // Цвет зеркального излучения
-    Color ambient;      // Цвет фонового излучения
+template <typename Real>
+struct LightT {
+    Vector3T<Real> position;
+    ColorT<Real> diffuse;      // Цвет диффузного излучения
+    ColorT<Real> specular;     // Цвет зеркального излучения
+    ColorT<Real> ambient;      // Цвет фонового излучения
+    Real range = 0;            // Радиус влияния; 0 - освещает всю сцену без ослабления
 
-    Light(const Vector3& pos, const Color& diff, const Color& spec, const Color& amb)
+    LightT(const Vector3T<Real>& pos, const ColorT<Real>& diff, const ColorT<Real>& spec, const ColorT<Real>& amb)
         : position(pos), diffuse(diff), specular(spec), ambient(amb) {}
+
+    template <typename Other>
+    explicit LightT(const LightT<Other>& l)
+        : position(l.position), diffuse(l.diffuse), specular(l.specular), ambient(l.ambient),
+        range(static_cast<Real>(l.range)) {}
+
+    // Освещает ли источник точку на расстоянии distance
+    bool reaches(Real distance) const {
+        return range <= 0 || distance < range;
+    }
+
+    // Ослабление диффузной и зеркальной составляющих: окно (1 - (d / range)^2)^2 плавно
+    // спадает до нуля на границе радиуса влияния; без радиуса - ровно 1
+    Real attenuation(Real distance) const {
+        if (range <= 0) return 1;
+        Real x = distance / range;
+        Real window = 1 - x * x;
+        return window > 0 ? window * window : 0;
+    }
 };
 
 // Луч (для проверки пересечений)
-struct Ray {
-    Vector3 origin;
-    Vector3 direction;
+template <typename Real>
+struct RayT {
+    Vector3T<Real> origin;
+    Vector3T<Real> direction;
 
-    Ray(const Vector3& orig, const Vector3& dir) : origin(orig), direction(dir.normalize()) {}
+    RayT(const Vector3T<Real>& orig, const Vector3T<Real>& dir) : origin(orig), direction(dir.normalize()) {}
+
+    // Луч с уже нормированным направлением (без повторного sqrt)
+    static RayT withUnitDirection(const Vector3T<Real>& orig, const Vector3T<Real>& unitDir) {
+        RayT ray;
+        ray.origin = orig;
+        ray.direction = unitDir;
+        return ray;
+    }
+
+    // Луч с ненормированным направлением: луч, переведенный в пространство объекта,
+    // сохраняет мировой параметр t
+    static RayT withDirection(const Vector3T<Real>& orig, const Vector3T<Real>& dir) {
+        return withUnitDirection(orig, dir);
+    }
 
-    Vector3 pointAt(double t) const {
+    Vector3T<Real> pointAt(Real t) const {
         return origin + direction * t;
     }
+
+private:
+    RayT() {}
+};
+
+// Ограничивающий параллелепипед, выровненный по осям (AABB)
+template <typename Real>
+struct AABBT {
+    Vector3T<Real> min;
+    Vector3T<Real> max;
+
+    AABBT()
+        : min(std::numeric_limits<Real>::max(), std::numeric_limits<Real>::max(), std::numeric_limits<Real>::max()),
+        max(-std::numeric_limits<Real>::max(), -std::numeric_limits<Real>::max(), -std::numeric_limits<Real>::max()) {}
+
+    AABBT(const Vector3T<Real>& mn, const Vector3T<Real>& mx) : min(mn), max(mx) {}
+
+    void expand(const Vector3T<Real>& p) {
+        min = Vector3T<Real>(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vector3T<Real>(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    // Объединение с другим параллелепипедом (пустой, с min > max, ничего не меняет)
+    void expand(const AABBT& box) {
+        min = Vector3T<Real>(std::min(min.x, box.min.x), std::min(min.y, box.min.y), std::min(min.z, box.min.z));
+        max = Vector3T<Real>(std::max(max.x, box.max.x), std::max(max.y, box.max.y), std::max(max.z, box.max.z));
+    }
+
+    Vector3T<Real> centroid() const {
+        return (min + max) * Real(0.5);
+    }
+
+    Real axis(const Vector3T<Real>& v, int a) const {
+        return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+    }
+
+    // Площадь поверхности (для эвристики SAH)
+    Real surfaceArea() const {
+        Vector3T<Real> d = max - min;
+        if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // Пересечение луча с параллелепипедом (метод плит), invDir = 1 / direction
+    bool intersect(const Vector3T<Real>& origin, const Vector3T<Real>& invDir, Real tMax, Real& tEntry) const {
+        Real tx1 = (min.x - origin.x) * invDir.x;
+        Real tx2 = (max.x - origin.x) * invDir.x;
+        Real tNear = std::min(tx1, tx2);
+        Real tFar = std::max(tx1, tx2);
+
+        Real ty1 = (min.y - origin.y) * invDir.y;
+        Real ty2 = (max.y - origin.y) * invDir.y;
+        tNear = std::max(tNear, std::min(ty1, ty2));
+        tFar = std::min(tFar, std::max(ty1, ty2));
+
+        Real tz1 = (min.z - origin.z) * invDir.z;
+        Real tz2 = (max.z - origin.z) * invDir.z;
+        tNear = std::max(tNear, std::min(tz1, tz2));
+        tFar = std::min(tFar, std::max(tz1, tz2));
+
+        // Выход расширяется на погрешность округления (Ize, 2013): иначе луч, проходящий через
+        // вершину или ребро на границе параллелепипеда, может его пропустить
+        tFar *= 1 + 4 * std::numeric_limits<Real>::epsilon();
+
+        tEntry = tNear;
+        return tFar >= tNear && tFar > 0 && tNear < tMax;
+    }
+};
+
+// Аффинное преобразование: линейная часть 3x3 и перенос, m[i][3] - компонента переноса
+template <typename Real>
+struct AffineT {
+    Real m[3][4];
+
+    AffineT() {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) m[i][j] = i == j ? Real(1) : Real(0);
+        }
+    }
+
+    template <typename Other>
+    explicit AffineT(const AffineT<Other>& a) {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) m[i][j] = static_cast<Real>(a.m[i][j]);
+        }
+    }
+
+    // Поворот вокруг оси y, затем равномерный масштаб и перенос
+    static AffineT placement(const Vector3T<Real>& offset, Real scale, Real angleY) {
+        AffineT a;
+        Real c = std::cos(angleY) * scale, s = std::sin(angleY) * scale;
+        a.m[0][0] = c;  a.m[0][1] = 0;     a.m[0][2] = s;  a.m[0][3] = offset.x;
+        a.m[1][0] = 0;  a.m[1][1] = scale; a.m[1][2] = 0;  a.m[1][3] = offset.y;
+        a.m[2][0] = -s; a.m[2][1] = 0;     a.m[2][2] = c;  a.m[2][3] = offset.z;
+        return a;
+    }
+
+    Vector3T<Real> transformVector(const Vector3T<Real>& v) const {
+        return Vector3T<Real>(
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    Vector3T<Real> transformPoint(const Vector3T<Real>& p) const {
+        return transformVector(p) + Vector3T<Real>(m[0][3], m[1][3], m[2][3]);
+    }
+
+    // Умножение на транспонированную линейную часть: для обратного преобразования дает
+    // нормаль в мировом пространстве (без нормировки)
+    Vector3T<Real> transformNormalTransposed(const Vector3T<Real>& n) const {
+        return Vector3T<Real>(
+            m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+            m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+            m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+    }
+
+    // Определитель линейной части
+    Real determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+            - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+            + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // Обратное преобразование (линейная часть должна быть невырожденной, см. finishInstances)
+    AffineT inverse() const {
+        AffineT r;
+        Real invDet = 1 / determinant();
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+        Vector3T<Real> t = r.transformVector(Vector3T<Real>(m[0][3], m[1][3], m[2][3]));
+        r.m[0][3] = -t.x;
+        r.m[1][3] = -t.y;
+        r.m[2][3] = -t.z;
+        return r;
+    }
+
+    // Параллелепипед, содержащий преобразованный (Arvo, 1990)
+    AABBT<Real> transformBox(const AABBT<Real>& box) const {
+        Real lo[3], hi[3];
+        const Real boxMin[3] = { box.min.x, box.min.y, box.min.z };
+        const Real boxMax[3] = { box.max.x, box.max.y, box.max.z };
+        for (int i = 0; i < 3; ++i) {
+            lo[i] = hi[i] = m[i][3];
+            for (int j = 0; j < 3; ++j) {
+                Real a = m[i][j] * boxMin[j], b = m[i][j] * boxMax[j];
+                lo[i] += std::min(a, b);
+                hi[i] += std::max(a, b);
+            }
+        }
+        return AABBT<Real>(Vector3T<Real>(lo[0], lo[1], lo[2]), Vector3T<Real>(hi[0], hi[1], hi[2]));
+    }
 };
 
 // Поверхность (сфера для примера)
-struct Sphere {
-    Vector3 center;
-    double radius;
-    Material material;
+template <typename Real>
+struct SphereT {
+    Vector3T<Real> center;
+    Real radius;
+    int materialIndex;          // Индекс в таблице материалов сцены
 
-    Sphere(const Vector3& c, double r, const Material& mat) : center(c), radius(r), material(mat) {}
+    SphereT(const Vector3T<Real>& c, Real r, int material) : center(c), radius(r), materialIndex(material) {}
+
+    template <typename Other>
+    explicit SphereT(const SphereT<Other>& s)
+        : center(s.center), radius(static_cast<Real>(s.radius)), materialIndex(s.materialIndex) {}
 
     // Проверка пересечения луча со сферой
-    bool intersect(const Ray& ray, double& t) const {
-        Vector3 oc = ray.origin - center;
-        double a = ray.direction.dot(ray.direction);
-        double b = 2.0 * oc.dot(ray.direction);
-        double c = oc.dot(oc) - radius * radius;
-        double discriminant = b * b - 4 * a * c;
+    bool intersect(const RayT<Real>& ray, Real& t) const {
+        Vector3T<Real> oc = ray.origin - center;
+        Real a = ray.direction.dot(ray.direction);
+        Real b = 2 * oc.dot(ray.direction);
+        Real c = oc.dot(oc) - radius * radius;
+        Real discriminant = b * b - 4 * a * c;
 
         if (discriminant < 0) return false;
 
-        double sqrtDisc = std::sqrt(discriminant);
-        double t1 = (-b - sqrtDisc) / (2.0 * a);
-        double t2 = (-b + sqrtDisc) / (2.0 * a);
+        Real sqrtDisc = std::sqrt(discriminant);
+        Real t1 = (-b - sqrtDisc) / (2 * a);
+        Real t2 = (-b + sqrtDisc) / (2 * a);
 
         t = (t1 > 0) ? t1 : t2;
         return t > 0;
     }
 
     // Получение нормали в точке на поверхности
-    Vector3 getNormal(const Vector3& point) const {
+    Vector3T<Real> getNormal(const Vector3T<Real>& point) const {
         return (point - center).normalize();
     }
+
+    // Ограничивающий параллелепипед
+    AABBT<Real> bounds() const {
+        Vector3T<Real> r(radius, radius, radius);
+        return AABBT<Real>(center - r, center + r);
+    }
 };
 
-// Сцена
-class Scene {
+// Типы двойной точности: описание сцены и эталонный рендер
+typedef Vector3T<double> Vector3;
+typedef ColorT<double> Color;
+typedef MaterialT<double> Material;
+typedef LightT<double> Light;
+typedef RayT<double> Ray;
+typedef AABBT<double> AABB;
+typedef SphereT<double> Sphere;
+typedef AffineT<double> Affine;
+
+// Узел BVH: для внутреннего узла leftFirst - индекс левого потомка (правый идет следом),
+// для листа - индекс первого примитива в primIndices
+template <typename Real>
+struct BVHNodeT {
+    AABBT<Real> bounds;
+    int leftFirst;
+    int count;      // Количество примитивов в листе (0 - внутренний узел)
+
+    bool isLeaf() const { return count > 0; }
+};
+
+// Иерархия ограничивающих объемов, строится по бинированной эвристике площади поверхности (binned SAH)
+template <typename Real>
+class BVHT {
 private:
-    std::vector<Sphere> objects;
-    std::vector<Light> lights;
+    static const int BIN_COUNT = 16;
+    static const int MAX_LEAF_SIZE = 4;
+    static const int MAX_DEPTH = 64;
 
-public:
-    void addObject(const Sphere& object) {
-        objects.push_back(object);
-    }
+    typedef AABBT<Real> Box;
+    typedef BVHNodeT<Real> Node;
+
+    std::vector<Node> nodes;
+    std::vector<int> primIndices;
+    std::vector<Box> primBounds;
+    std::vector<Vector3T<Real>> primCentroids;
+    int leafCount = 0;
+    int maxDepth = 0;
+    double buildTime = 0.0;
+    double refitTime = 0.0;
 
-    void addLight(const Light& light) {
-        lights.push_back(light);
+    struct Bin {
+        Box bounds;
+        int count = 0;
+    };
+
+    void updateBounds(int nodeIndex) {
+        Node& node = nodes[nodeIndex];
+        node.bounds = Box();
+        for (int i = 0; i < node.count; ++i) {
+            node.bounds.expand(primBounds[primIndices[node.leftFirst + i]]);
+        }
     }
 
-    // Проверка, находится ли точка в тени относительно источника света
-    bool isInShadow(const Vector3& point, const Light& light) const {
-        Vector3 lightDir = (light.position - point).normalize();
-        Ray shadowRay(point + lightDir * 0.001, lightDir); // Смещение для избежания самопересечения
+    // Поиск лучшего разбиения по всем трем осям; возвращает стоимость SAH
+    Real findBestSplit(const Node& node, int& bestAxis, Real& bestPos) const {
+        Box centroidBounds;
+        for (int i = 0; i < node.count; ++i) {
+            centroidBounds.expand(primCentroids[primIndices[node.leftFirst + i]]);
+        }
 
-        for (const auto& obj : objects) {
-            double t;
-            if (obj.intersect(shadowRay, t)) {
-                double distanceToLight = (light.position - point).length();
-                if (t < distanceToLight) {
-                    return true; // Есть препятствие на пути к свету
+        Real bestCost = std::numeric_limits<Real>::max();
+        for (int a = 0; a < 3; ++a) {
+            Real lo = centroidBounds.axis(centroidBounds.min, a);
+            Real hi = centroidBounds.axis(centroidBounds.max, a);
+            if (hi <= lo) continue;
+
+            Bin bins[BIN_COUNT];
+            Real scale = BIN_COUNT / (hi - lo);
+            for (int i = 0; i < node.count; ++i) {
+                int prim = primIndices[node.leftFirst + i];
+                int b = std::min(BIN_COUNT - 1, static_cast<int>((centroidBounds.axis(primCentroids[prim], a) - lo) * scale));
+                bins[b].count++;
+                bins[b].bounds.expand(primBounds[prim]);
+            }
+
+            // Префиксные и суффиксные суммы площадей и количеств
+            Real leftArea[BIN_COUNT - 1], rightArea[BIN_COUNT - 1];
+            int leftCount[BIN_COUNT - 1], rightCount[BIN_COUNT - 1];
+            Box leftBox, rightBox;
+            int leftSum = 0, rightSum = 0;
+            for (int i = 0; i < BIN_COUNT - 1; ++i) {
+                leftSum += bins[i].count;
+                leftCount[i] = leftSum;
+                leftBox.expand(bins[i].bounds);
+                leftArea[i] = leftBox.surfaceArea();
+
+                rightSum += bins[BIN_COUNT - 1 - i].count;
+                rightCount[BIN_COUNT - 2 - i] = rightSum;
+                rightBox.expand(bins[BIN_COUNT - 1 - i].bounds);
+                rightArea[BIN_COUNT - 2 - i] = rightBox.surfaceArea();
+            }
+
+            Real binWidth = (hi - lo) / BIN_COUNT;
+            for (int i = 0; i < BIN_COUNT - 1; ++i) {
+                if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+                Real cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestPos = lo + binWidth * (i + 1);
                 }
             }
         }
-        return false;
+        return bestCost;
     }
 
-    // Расчет цвета в точке с учетом освещения Фонга и теней
-    Color calculateColor(const Vector3& point, const Vector3& normal, const Vector3& viewDir, const Material& material) const {
-        Color result(0, 0, 0);
-
-        for (const auto& light : lights) {
-            Vector3 lightDir = (light.position - point).normalize();
+    void subdivide(int nodeIndex, int depth) {
+        maxDepth = std::max(maxDepth, depth);
+        Node& node = nodes[nodeIndex];
+        if (node.count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH) {
+            leafCount++;
+            return;
+        }
 
-            // Фоновая составляющая (всегда присутствует)
-            Color ambient = material.ambient * light.ambient;
-            result = result + ambient;
+        int axis = 0;
+        Real splitPos = 0;
+        Real splitCost = findBestSplit(node, axis, splitPos);
+        Real leafCost = node.count * node.bounds.surfaceArea();
 
-            // Проверка на наличие тени
-            if (isInShadow(point, light)) {
-                continue; // Пропускаем диффузную и зеркальную составляющие для этого источника
+        int first = node.leftFirst;
+        int last = first + node.count;
+        int mid;
+        if (splitCost < leafCost) {
+            int* splitPoint = std::partition(primIndices.data() + first, primIndices.data() + last, [&](int prim) {
+                return node.bounds.axis(primCentroids[prim], axis) < splitPos;
+            });
+            mid = static_cast<int>(splitPoint - primIndices.data());
+            if (mid == first || mid == last) {
+                // Погрешность округления на границе бина - делим пополам
+                mid = first + node.count / 2;
             }
+        }
+        else if (splitCost == std::numeric_limits<Real>::max() && node.count > 4 * MAX_LEAF_SIZE) {
+            // Все центры совпадают - делим пополам, чтобы листья не разрастались
+            mid = first + node.count / 2;
+        }
+        else {
+            leafCount++;
+            return;
+        }
+
+        int leftIndex = static_cast<int>(nodes.size());
+        Node left, right;
+        left.leftFirst = first;
+        left.count = mid - first;
+        right.leftFirst = mid;
+        right.count = last - mid;
+        nodes.push_back(left);
+        nodes.push_back(right);
+
+        // После push_back ссылка node может стать недействительной
+        nodes[nodeIndex].leftFirst = leftIndex;
+        nodes[nodeIndex].count = 0;
+
+        updateBounds(leftIndex);
+        updateBounds(leftIndex + 1);
+        subdivide(leftIndex, depth + 1);
+        subdivide(leftIndex + 1, depth + 1);
+    }
 
-            // Диффузная составляющая
-            double diff = std::max(0.0, normal.dot(lightDir));
-            Color diffuse = material.diffuse * light.diffuse * diff;
-            result = result + diffuse;
+public:
+    // Построение иерархии по списку ограничивающих объемов примитивов
+    void build(const std::vector<Box>& bounds) {
+        double startTime = omp_get_wtime();
 
-            // Зеркальная составляющая (модель Фонга)
-            Vector3 reflectDir = (lightDir * (-1.0) + normal * (2.0 * normal.dot(lightDir))).normalize();
-            double spec = std::pow(std::max(0.0, reflectDir.dot(viewDir)), material.shininess);
-            Color specular = material.specular * light.specular * spec;
-            result = result + specular;
+        int count = static_cast<int>(bounds.size());
+        primBounds = bounds;
+        primCentroids.resize(count);
+        primIndices.resize(count);
+        for (int i = 0; i < count; ++i) {
+            primCentroids[i] = bounds[i].centroid();
+            primIndices[i] = i;
         }
 
-        return result.clamp();
+        nodes.clear();
+        nodes.reserve(count > 0 ? 2 * count : 1);
+        leafCount = 0;
+        maxDepth = 0;
+
+        Node root;
+        root.leftFirst = 0;
+        root.count = count;
+        nodes.push_back(root);
+        if (count > 0) {
+            updateBounds(0);
+            subdivide(0, 0);
+        }
+        else {
+            nodes[0].bounds = Box();
+        }
+
+        // Временные данные построения больше не нужны
+        std::vector<Box>().swap(primBounds);
+        std::vector<Vector3T<Real>>().swap(primCentroids);
+
+        buildTime = omp_get_wtime() - startTime;
     }
 
-    // Поиск ближайшего пересечения луча с объектами сцены
-    bool findClosestIntersection(const Ray& ray, Vector3& hitPoint, Vector3& normal, Material& material) const {
-        double closestT = std::numeric_limits<double>::max();
+    // Обход иерархии: leafTest(first, count, tMax) проверяет примитивы листа с позициями
+    // [first, first + count) в порядке getPrimIndices(), возвращает true при попадании ближе tMax
+    // и при этом может уменьшить tMax. При anyHit обход прекращается на первом попадании.
+    template <typename LeafTest>
+    bool traverse(const RayT<Real>& ray, Real& tMax, bool anyHit, LeafTest leafTest) const {
+        if (primIndices.empty()) return false;
+
+        Vector3T<Real> invDir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+        int stack[MAX_DEPTH * 2 + 2];
+        int stackSize = 0;
         bool found = false;
 
-        for (const auto& obj : objects) {
-            double t;
-            if (obj.intersect(ray, t) && t < closestT) {
-                closestT = t;
-                hitPoint = ray.pointAt(t);
-                normal = obj.getNormal(hitPoint);
-                material = obj.material;
-                found = true;
+        Real tEntry;
+        if (!nodes[0].bounds.intersect(ray.origin, invDir, tMax, tEntry)) return false;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0) {
+            const Node& node = nodes[stack[--stackSize]];
+
+            if (node.isLeaf()) {
+                if (leafTest(node.leftFirst, node.count, tMax)) {
+                    found = true;
+                    if (anyHit) return true;
+                }
+                continue;
+            }
+
+            // Сначала посещаем ближайшего потомка: он кладется в стек последним
+            int leftIndex = node.leftFirst;
+            Real tLeft, tRight;
+            bool hitLeft = nodes[leftIndex].bounds.intersect(ray.origin, invDir, tMax, tLeft);
+            bool hitRight = nodes[leftIndex + 1].bounds.intersect(ray.origin, invDir, tMax, tRight);
+
+            if (hitLeft && hitRight) {
+                if (tLeft <= tRight) {
+                    stack[stackSize++] = leftIndex + 1;
+                    stack[stackSize++] = leftIndex;
+                }
+                else {
+                    stack[stackSize++] = leftIndex;
+                    stack[stackSize++] = leftIndex + 1;
+                }
+            }
+            else if (hitLeft) {
+                stack[stackSize++] = leftIndex;
+            }
+            else if (hitRight) {
+                stack[stackSize++] = leftIndex + 1;
             }
         }
 
         return found;
     }
+
+    // Обновление объемов узлов после перемещения примитивов без изменения топологии.
+    // leafBounds - объемы примитивов в порядке getPrimIndices(). Дети создаются после
+    // родителя, поэтому достаточно одного прохода по узлам с конца.
+    void refit(const std::vector<Box>& leafBounds) {
+        double startTime = omp_get_wtime();
+        for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; --i) {
+            Node& node = nodes[i];
+            Box box;
+            if (node.isLeaf()) {
+                for (int k = 0; k < node.count; ++k) box.expand(leafBounds[node.leftFirst + k]);
+            }
+            else {
+                box.expand(nodes[node.leftFirst].bounds);
+                box.expand(nodes[node.leftFirst + 1].bounds);
+            }
+            node.bounds = box;
+        }
+        refitTime = omp_get_wtime() - startTime;
+    }
+
+    // Стоимость обхода по SAH (узел и примитив стоят одинаково) без деления на площадь
+    // корня: разросшиеся после refit узлы увеличивают ее, даже когда растет и корень
+    Real getSAHCost() const {
+        Real cost = 0;
+        for (const auto& node : nodes) {
+            cost += node.bounds.surfaceArea() * (node.isLeaf() ? node.count : 1);
+        }
+        return cost;
+    }
+
+    // Порядок примитивов после построения: листья ссылаются на непрерывные диапазоны
+    const std::vector<int>& getPrimIndices() const { return primIndices; }
+
+    int getNodeCount() const { return static_cast<int>(nodes.size()); }
+    int getLeafCount() const { return leafCount; }
+    int getMaxDepth() const { return maxDepth; }
+    double getBuildTime() const { return buildTime; }
+    double getRefitTime() const { return refitTime; }
 };
 
-// Класс для рендеринга с использованием OpenMP
-class ParallelRaycaster {
-private:
-    Scene scene;
-    int width, height;
-    std::vector<Color> imageBuffer;
+// Набор инструкций для ядра пересечения
+enum class SimdLevel {
+    Scalar,
+    SSE2,
+    AVX
+};
 
-public:
-    ParallelRaycaster(int w, int h) : width(w), height(h) {
-        imageBuffer.resize(width * height);
-        setupScene();
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::AVX: return "AVX";
+    case SimdLevel::SSE2: return "SSE2";
+    default: return "scalar";
     }
+}
 
-    void setupScene() {
-        // Добавляем материалы
-        Material redMaterial(Color(0.8, 0.2, 0.2), Color(1.0, 1.0, 1.0), Color(0.1, 0.0, 0.0), 32.0);
-        Material greenMaterial(Color(0.2, 0.8, 0.2), Color(1.0, 1.0, 1.0), Color(0.0, 0.1, 0.0), 64.0);
-        Material blueMaterial(Color(0.2, 0.2, 0.8), Color(1.0, 1.0, 1.0), Color(0.0, 0.0, 0.1), 128.0);
-        Material floorMaterial(Color(0.7, 0.7, 0.7), Color(0.3, 0.3, 0.3), Color(0.05, 0.05, 0.05), 16.0);
+// Определение лучшего набора инструкций, доступного на процессоре во время выполнения
+SimdLevel detectSimdLevel() {
+#if defined(FONGA_X86)
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (osxsave && avx && (_xgetbv(0) & 0x6) == 0x6) return SimdLevel::AVX;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) return SimdLevel::AVX;
+#endif
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
 
-        // Добавляем объекты
-        scene.addObject(Sphere(Vector3(0, 0, -5), 1.0, redMaterial));
-        scene.addObject(Sphere(Vector3(-2, 0, -7), 1.5, greenMaterial));
-        scene.addObject(Sphere(Vector3(2, 0, -6), 1.2, blueMaterial));
-        scene.addObject(Sphere(Vector3(0, -1002, 0), 1000.0, floorMaterial)); // Пол
+#if defined(FONGA_X86)
+// Обертки над интринсиками: одно ядро пересечения на набор инструкций для обеих точностей.
+// select(mask, a, b) - покомпонентно mask ? a : b.
+template <typename Real> struct SseOps;
+template <typename Real> struct AvxOps;
 
-        // Добавляем источники света
-        Light mainLight(Vector3(3, 5, -3), Color(0.8, 0.8, 0.8), Color(1.0, 1.0, 1.0), Color(0.1, 0.1, 0.1));
-        Light fillLight(Vector3(-3, 2, -2), Color(0.4, 0.4, 0.4), Color(0.5, 0.5, 0.5), Color(0.05, 0.05, 0.05));
+template <>
+struct SseOps<double> {
+    typedef __m128d V;
+    static const int WIDTH = 2;
+    static V set1(double v) { return _mm_set1_pd(v); }
+    static V zero() { return _mm_setzero_pd(); }
+    static V load(const double* p) { return _mm_loadu_pd(p); }
+    static void store(double* p, V v) { _mm_storeu_pd(p, v); }
+    static V add(V a, V b) { return _mm_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+    static V div(V a, V b) { return _mm_div_pd(a, b); }
+    static V sqrt(V a) { return _mm_sqrt_pd(a); }
+    static V max(V a, V b) { return _mm_max_pd(a, b); }
+    static V cmpge(V a, V b) { return _mm_cmpge_pd(a, b); }
+    static V cmpgt(V a, V b) { return _mm_cmpgt_pd(a, b); }
+    static V bitAnd(V a, V b) { return _mm_and_pd(a, b); }
+    static V select(V mask, V a, V b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+    static int movemask(V v) { return _mm_movemask_pd(v); }
+};
+
+template <>
+struct SseOps<float> {
+    typedef __m128 V;
+    static const int WIDTH = 4;
+    static V set1(float v) { return _mm_set1_ps(v); }
+    static V zero() { return _mm_setzero_ps(); }
+    static V load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, V v) { _mm_storeu_ps(p, v); }
+    static V add(V a, V b) { return _mm_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+    static V div(V a, V b) { return _mm_div_ps(a, b); }
+    static V sqrt(V a) { return _mm_sqrt_ps(a); }
+    static V max(V a, V b) { return _mm_max_ps(a, b); }
+    static V cmpge(V a, V b) { return _mm_cmpge_ps(a, b); }
+    static V cmpgt(V a, V b) { return _mm_cmpgt_ps(a, b); }
+    static V bitAnd(V a, V b) { return _mm_and_ps(a, b); }
+    static V select(V mask, V a, V b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    static int movemask(V v) { return _mm_movemask_ps(v); }
+};
+
+template <>
+struct AvxOps<double> {
+    typedef __m256d V;
+    static const int WIDTH = 4;
+    FONGA_TARGET_AVX static V set1(double v) { return _mm256_set1_pd(v); }
+    FONGA_TARGET_AVX static V zero() { return _mm256_setzero_pd(); }
+    FONGA_TARGET_AVX static V load(const double* p) { return _mm256_loadu_pd(p); }
+    FONGA_TARGET_AVX static void store(double* p, V v) { _mm256_storeu_pd(p, v); }
+    FONGA_TARGET_AVX static V add(V a, V b) { return _mm256_add_pd(a, b); }
+    FONGA_TARGET_AVX static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+    FONGA_TARGET_AVX static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+    FONGA_TARGET_AVX static V div(V a, V b) { return _mm256_div_pd(a, b); }
+    FONGA_TARGET_AVX static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+    FONGA_TARGET_AVX static V max(V a, V b) { return _mm256_max_pd(a, b); }
+    FONGA_TARGET_AVX static V cmpge(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+    FONGA_TARGET_AVX static V cmpgt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    FONGA_TARGET_AVX static V bitAnd(V a, V b) { return _mm256_and_pd(a, b); }
+    FONGA_TARGET_AVX static V select(V mask, V a, V b) { return _mm256_blendv_pd(b, a, mask); }
+    FONGA_TARGET_AVX static int movemask(V v) { return _mm256_movemask_pd(v); }
+};
+
+template <>
+struct AvxOps<float> {
+    typedef __m256 V;
+    static const int WIDTH = 8;
+    FONGA_TARGET_AVX static V set1(float v) { return _mm256_set1_ps(v); }
+    FONGA_TARGET_AVX static V zero() { return _mm256_setzero_ps(); }
+    FONGA_TARGET_AVX static V load(const float* p) { return _mm256_loadu_ps(p); }
+    FONGA_TARGET_AVX static void store(float* p, V v) { _mm256_storeu_ps(p, v); }
+    FONGA_TARGET_AVX static V add(V a, V b) { return _mm256_add_ps(a, b); }
+    FONGA_TARGET_AVX static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    FONGA_TARGET_AVX static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    FONGA_TARGET_AVX static V div(V a, V b) { return _mm256_div_ps(a, b); }
+    FONGA_TARGET_AVX static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+    FONGA_TARGET_AVX static V max(V a, V b) { return _mm256_max_ps(a, b); }
+    FONGA_TARGET_AVX static V cmpge(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    FONGA_TARGET_AVX static V cmpgt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    FONGA_TARGET_AVX static V bitAnd(V a, V b) { return _mm256_and_ps(a, b); }
+    FONGA_TARGET_AVX static V select(V mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+    FONGA_TARGET_AVX static int movemask(V v) { return _mm256_movemask_ps(v); }
+};
+#endif
 
-        scene.addLight(mainLight);
-        scene.addLight(fillLight);
+// Модель зеркальной составляющей: точная (Фонг, std::pow), быстрая (Фонг с целой степенью
+// без нормирования отраженного вектора) или Блинн-Фонг (полувектор, целая степень)
+enum class ShadingModel {
+    Exact,
+    Fast,
+    Blinn
+};
+
+const char* shadingModelName(ShadingModel model) {
+    switch (model) {
+    case ShadingModel::Fast: return "fast";
+    case ShadingModel::Blinn: return "Blinn-Phong";
+    default: return "exact";
     }
+}
 
-    // Трассировка луча для каждого пикселя
-    Color traceRay(int x, int y) {
-        // Преобразование координат пикселя в нормализованные координаты сцены
-        double ndcX = (x + 0.5) / width * 2.0 - 1.0;
-        double ndcY = 1.0 - (y + 0.5) / height * 2.0;
+// Число двоичных разрядов неотрицательного показателя
+inline int exponentBits(int exponent) {
+    int bits = 0;
+    while (exponent >> bits) bits++;
+    return bits;
+}
 
-        // Положение камеры
-        Vector3 cameraPos(0, 0, 0);
-        Vector3 rayDir(ndcX, ndcY, -1);
-        Ray ray(cameraPos, rayDir);
+// Степень с целым показателем двоичным возведением слева направо: на каждый разряд показателя,
+// начиная со старшего, - возведение в квадрат и умножение на base, если разряд единичный.
+// Пакетные варианты ниже выполняют те же умножения в том же порядке (лишние старшие разряды
+// только возводят в квадрат единицу), поэтому результаты совпадают до бита.
+template <typename Real>
+inline Real powInteger(Real base, int exponent) {
+    Real result = 1;
+    for (int bit = exponentBits(exponent) - 1; bit >= 0; --bit) {
+        result = result * result;
+        if (exponent & (1 << bit)) result = result * base;
+    }
+    return result;
+}
 
-        Vector3 hitPoint, normal;
-        Material material;
+#if defined(FONGA_X86)
+// Тело пакетного возведения в степень: Ops::WIDTH оснований со своими показателями (хранятся
+// в Real) за инструкцию. Разряд показателя выделяется сравнением с 2^bit и вычитанием.
+#define FONGA_POWER_KERNEL_BODY(Ops)                                                                \
+    typedef typename Ops::V V;                                                                      \
+    int i = 0;                                                                                      \
+    for (; i + Ops::WIDTH <= count; i += Ops::WIDTH) {                                              \
+        V x = Ops::load(base + i);                                                                  \
+        V e = Ops::load(exponent + i);                                                              \
+        V r = Ops::set1(Real(1));                                                                   \
+        for (int bit = bits - 1; bit >= 0; --bit) {                                                 \
+            V place = Ops::set1(static_cast<Real>(1 << bit));                                       \
+            V set = Ops::cmpge(e, place);                                                           \
+            r = Ops::mul(r, r);                                                                     \
+            r = Ops::select(set, Ops::mul(r, x), r);                                                \
+            e = Ops::select(set, Ops::sub(e, place), e);                                            \
+        }                                                                                           \
+        Ops::store(result + i, r);                                                                  \
+    }                                                                                               \
+    for (; i < count; ++i) result[i] = powInteger(base[i], static_cast<int>(exponent[i]));
 
-        if (scene.findClosestIntersection(ray, hitPoint, normal, material)) {
-            Vector3 viewDir = (cameraPos - hitPoint).normalize();
-            return scene.calculateColor(hitPoint, normal, viewDir, material);
-        }
+template <typename Real>
+void powIntegerBatchSSE2(const Real* base, const Real* exponent, int count, int bits, Real* result) {
+    FONGA_POWER_KERNEL_BODY(SseOps<Real>)
+}
 
-        // Цвет фона, если пересечений нет
-        return Color(0.1, 0.1, 0.3);
+template <typename Real>
+FONGA_TARGET_AVX
+void powIntegerBatchAVX(const Real* base, const Real* exponent, int count, int bits, Real* result) {
+    FONGA_POWER_KERNEL_BODY(AvxOps<Real>)
+}
+#undef FONGA_POWER_KERNEL_BODY
+#endif
+
+// result[i] = base[i]^exponent[i] для count элементов; bits - разрядов в наибольшем показателе
+template <typename Real>
+void powIntegerBatch(SimdLevel level, const Real* base, const Real* exponent, int count, int bits, Real* result) {
+#if defined(FONGA_X86)
+    if (level == SimdLevel::AVX) {
+        powIntegerBatchAVX(base, exponent, count, bits, result);
+        return;
+    }
+    if (level == SimdLevel::SSE2) {
+        powIntegerBatchSSE2(base, exponent, count, bits, result);
+        return;
     }
+#else
+    (void)level;
+    (void)bits;
+#endif
+    for (int i = 0; i < count; ++i) result[i] = powInteger(base[i], static_cast<int>(exponent[i]));
+}
 
-    // Параллельный рендеринг сцены с использованием OpenMP
-    void renderParallel() {
-        double startTime = omp_get_wtime();
+// Хранилище сфер в виде структуры массивов (SoA) для векторного ядра пересечения.
+// Сферы лежат в порядке листьев BVH, массивы дополнены на SIMD_PADDING элементов,
+// чтобы самая широкая загрузка (8 float для AVX) не выходила за границу.
+template <typename Real>
+struct SphereSoAT {
+    static const int SIMD_PADDING = 8;
 
-        std::cout << "Starting parallel render with " << omp_get_max_threads() << " threads..." << std::endl;
+    std::vector<Real> centerX, centerY, centerZ;
+    std::vector<Real> radius2;          // Квадрат радиуса
+    std::vector<int> objectIndex;       // Индекс исходного объекта сцены (для материала и нормали)
+    int count = 0;
 
-#pragma omp parallel for schedule(dynamic)
-        for (int i = 0; i < width * height; ++i) {
-            int x = i % width;
-            int y = i / width;
-            imageBuffer[i] = traceRay(x, y);
+    void resize(int n) {
+        count = n;
+        int padded = n + SIMD_PADDING;
+        // Дополнение: сферы, в которые невозможно попасть (маскируются по count в ядрах)
+        centerX.assign(padded, Real(0));
+        centerY.assign(padded, Real(0));
+        centerZ.assign(padded, Real(0));
+        radius2.assign(padded, Real(0));
+        objectIndex.assign(padded, -1);
+    }
 
-            // Вывод прогресса
-            if (i % (width * 10) == 0) {
-#pragma omp critical
-                {
-                    double progress = (i * 100.0) / (width * height);
-                    std::cout << "Progress: " << progress << "%" << std::endl;
-                }
+    void set(int i, const Vector3T<Real>& c, Real r, int object) {
+        centerX[i] = c.x;
+        centerY[i] = c.y;
+        centerZ[i] = c.z;
+        radius2[i] = r * r;
+        objectIndex[i] = object;
+    }
+
+    // Скалярная проверка одной сферы; порядок операций совпадает с SphereT::intersect
+    bool intersect(int i, const RayT<Real>& ray, Real a, Real& t) const {
+        Real ocx = ray.origin.x - centerX[i];
+        Real ocy = ray.origin.y - centerY[i];
+        Real ocz = ray.origin.z - centerZ[i];
+        Real b = 2 * (ocx * ray.direction.x + ocy * ray.direction.y + ocz * ray.direction.z);
+        Real c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius2[i];
+        Real discriminant = b * b - 4 * a * c;
+
+        if (discriminant < 0) return false;
+
+        Real sqrtDisc = std::sqrt(discriminant);
+        Real t1 = (-b - sqrtDisc) / (2 * a);
+        Real t2 = (-b + sqrtDisc) / (2 * a);
+
+        t = (t1 > 0) ? t1 : t2;
+        return t > 0;
+    }
+
+    // Проверка диапазона [first, first + n): возвращает позицию ближайшего попадания с t < tMax или -1
+    int intersectRangeScalar(int first, int n, const RayT<Real>& ray, Real tMax, Real& tHit) const {
+        Real a = ray.direction.dot(ray.direction);
+        int hit = -1;
+        for (int i = first; i < first + n; ++i) {
+            Real t;
+            if (intersect(i, ray, a, t) && t < tMax) {
+                tMax = t;
+                tHit = t;
+                hit = i;
             }
         }
+        return hit;
+    }
 
-        double endTime = omp_get_wtime();
-        std::cout << "Render completed in " << (endTime - startTime) << " seconds" << std::endl;
+#if defined(FONGA_X86)
+    // Тело векторного ядра: один луч против Ops::WIDTH сфер за инструкцию.
+    // FMA намеренно не используется, чтобы результат совпадал со скалярной версией до бита.
+#define FONGA_SPHERE_KERNEL_BODY(Ops)                                                               \
+    typedef typename Ops::V V;                                                                      \
+    Real a = ray.direction.dot(ray.direction);                                                      \
+    const V ox = Ops::set1(ray.origin.x), oy = Ops::set1(ray.origin.y), oz = Ops::set1(ray.origin.z); \
+    const V dx = Ops::set1(ray.direction.x), dy = Ops::set1(ray.direction.y), dz = Ops::set1(ray.direction.z); \
+    const V fourA = Ops::set1(4 * a), twoA = Ops::set1(2 * a);                                      \
+    const V two = Ops::set1(Real(2)), zero = Ops::zero();                                           \
+                                                                                                    \
+    int hit = -1;                                                                                   \
+    for (int base = first; base < first + n; base += Ops::WIDTH) {                                  \
+        V ocx = Ops::sub(ox, Ops::load(&centerX[base]));                                            \
+        V ocy = Ops::sub(oy, Ops::load(&centerY[base]));                                            \
+        V ocz = Ops::sub(oz, Ops::load(&centerZ[base]));                                            \
+        V b = Ops::mul(two, Ops::add(Ops::add(Ops::mul(ocx, dx), Ops::mul(ocy, dy)), Ops::mul(ocz, dz))); \
+        V c = Ops::sub(Ops::add(Ops::add(Ops::mul(ocx, ocx), Ops::mul(ocy, ocy)), Ops::mul(ocz, ocz)), \
+            Ops::load(&radius2[base]));                                                             \
+        V disc = Ops::sub(Ops::mul(b, b), Ops::mul(fourA, c));                                      \
+        V valid = Ops::cmpge(disc, zero);                                                           \
+        if (Ops::movemask(valid) == 0) continue;                                                    \
+                                                                                                    \
+        V sqrtDisc = Ops::sqrt(Ops::max(disc, zero));                                               \
+        V negB = Ops::sub(zero, b);                                                                 \
+        V t1 = Ops::div(Ops::sub(negB, sqrtDisc), twoA);                                            \
+        V t2 = Ops::div(Ops::add(negB, sqrtDisc), twoA);                                            \
+        V t = Ops::select(Ops::cmpgt(t1, zero), t1, t2);                                            \
+        valid = Ops::bitAnd(valid, Ops::cmpgt(t, zero));                                            \
+                                                                                                    \
+        int mask = Ops::movemask(valid);                                                            \
+        if (mask == 0) continue;                                                                    \
+                                                                                                    \
+        Real lanes[Ops::WIDTH];                                                                     \
+        Ops::store(lanes, t);                                                                       \
+        for (int lane = 0; lane < Ops::WIDTH && base + lane < first + n; ++lane) {                  \
+            if ((mask & (1 << lane)) && lanes[lane] < tMax) {                                       \
+                tMax = lanes[lane];                                                                 \
+                tHit = lanes[lane];                                                                 \
+                hit = base + lane;                                                                  \
+            }                                                                                       \
+        }                                                                                           \
+    }                                                                                               \
+    return hit;
+
+    // SSE2 есть на любом x64: 2 double или 4 float за инструкцию
+    int intersectRangeSSE2(int first, int n, const RayT<Real>& ray, Real tMax, Real& tHit) const {
+        FONGA_SPHERE_KERNEL_BODY(SseOps<Real>)
     }
 
-    // Сохранение изображения в формате PPM
-    void saveToPPM(const std::string& filename) {
-        std::ofstream file(filename);
-        if (!file) {
-            std::cerr << "Cannot open file: " << filename << std::endl;
-            return;
-        }
+    // AVX: 4 double или 8 float за инструкцию. Тело разворачивается макросом, а не общим
+    // шаблоном, потому что GCC не встраивает AVX-интринсики в функцию без target("avx").
+    FONGA_TARGET_AVX
+    int intersectRangeAVX(int first, int n, const RayT<Real>& ray, Real tMax, Real& tHit) const {
+        FONGA_SPHERE_KERNEL_BODY(AvxOps<Real>)
+    }
+#undef FONGA_SPHERE_KERNEL_BODY
+#endif
 
-        // Заголовок PPM
-        file << "P3\n" << width << " " << height << "\n255\n";
+    // Диспетчеризация по выбранному набору инструкций
+    int intersectRange(SimdLevel level, int first, int n, const RayT<Real>& ray, Real tMax, Real& tHit) const {
+#if defined(FONGA_X86)
+        if (level == SimdLevel::AVX) return intersectRangeAVX(first, n, ray, tMax, tHit);
+        if (level == SimdLevel::SSE2) return intersectRangeSSE2(first, n, ray, tMax, tHit);
+#endif
+        return intersectRangeScalar(first, n, ray, tMax, tHit);
+    }
+};
 
-        // Данные изображения
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                const Color& color = imageBuffer[y * width + x];
-                int r = static_cast<int>(color.r * 255);
-                int g = static_cast<int>(color.g * 255);
-                int b = static_cast<int>(color.b * 255);
+// Файл, отображенный в память только для чтения
+class MappedFile {
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
 
-                file << r << " " << g << " " << b << " ";
-            }
-            file << "\n";
-        }
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-        file.close();
-        std::cout << "Image saved to: " << filename << std::endl;
+    ~MappedFile() {
+        close();
     }
 
-    // Сохранение изображения в формате BMP (простая реализация)
-    void saveToBMP(const std::string& filename) {
-        std::ofstream file(filename, std::ios::binary);
-        if (!file) {
-            std::cerr << "Cannot open file: " << filename << std::endl;
-            return;
+    bool open(const std::string& filename) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            close();
+            return false;
+        }
+        size = static_cast<size_t>(fileSize.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) {
+            close();
+            return false;
+        }
+        data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        descriptor = ::open(filename.c_str(), O_RDONLY);
+        if (descriptor < 0) return false;
+        struct stat info;
+        if (fstat(descriptor, &info) != 0 || info.st_size == 0) {
+            close();
+            return false;
+        }
+        size = static_cast<size_t>(info.st_size);
+        void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        data = address == MAP_FAILED ? nullptr : static_cast<const unsigned char*>(address);
+#endif
+        if (data == nullptr) {
+            close();
+            return false;
         }
+        return true;
+    }
 
-        // Заголовок BMP
-        const int fileSize = 54 + 3 * width * height;
-        const int dataOffset = 54;
+    void close() {
+#ifdef _WIN32
+        if (data != nullptr) UnmapViewOfFile(data);
+        if (mapping != nullptr) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr) munmap(const_cast<unsigned char*>(data), size);
+        if (descriptor >= 0) ::close(descriptor);
+        descriptor = -1;
+#endif
+        data = nullptr;
+        size = 0;
+    }
 
-        // BITMAPFILEHEADER
-        unsigned char fileHeader[14] = {
-            'B', 'M',           // Сигнатура
-            fileSize & 0xFF, (fileSize >> 8) & 0xFF, (fileSize >> 16) & 0xFF, (fileSize >> 24) & 0xFF, // Размер файла
-            0, 0, 0, 0,         // Зарезервировано
-            dataOffset & 0xFF, (dataOffset >> 8) & 0xFF, 0, 0 // Смещение данных
-        };
+    const unsigned char* getData() const { return data; }
+    size_t getSize() const { return size; }
+};
 
-        // BITMAPINFOHEADER
-        unsigned char infoHeader[40] = {
-            40, 0, 0, 0,        // Размер заголовка
-            width & 0xFF, (width >> 8) & 0xFF, (width >> 16) & 0xFF, (width >> 24) & 0xFF, // Ширина
-            height & 0xFF, (height >> 8) & 0xFF, (height >> 16) & 0xFF, (height >> 24) & 0xFF, // Высота
-            1, 0,               // Количество плоскостей
-            24, 0,              // Бит на пиксель
-            0, 0, 0, 0,         // Сжатие
-            0, 0, 0, 0,         // Размер изображения
-            0, 0, 0, 0,         // Разрешение по горизонтали
-            0, 0, 0, 0,         // Разрешение по вертикали
-            0, 0, 0, 0,         // Количество цветов в палитре
-            0, 0, 0, 0          // Количество важных цветов
-        };
+// Сферы описания сцены в виде структуры массивов
+struct SphereArrays {
+    size_t count = 0;
+    const double* centerX = nullptr;
+    const double* centerY = nullptr;
+    const double* centerZ = nullptr;
+    const double* radius = nullptr;
+    const uint32_t* material = nullptr;     // Индекс в таблице материалов
+};
 
-        file.write(reinterpret_cast<char*>(fileHeader), 14);
-        file.write(reinterpret_cast<char*>(infoHeader), 40);
+// Индексированная треугольная сетка описания сцены: общий буфер вершин и нормалей,
+// по три индекса на треугольник
+struct MeshDescription {
+    std::vector<Vector3> vertices;
+    std::vector<Vector3> normals;       // По одной на вершину
+    std::vector<uint32_t> indices;
+    uint32_t material = 0;
 
-        // Данные изображения (BGR)
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                const Color& color = imageBuffer[y * width + x];
-                unsigned char b = static_cast<unsigned char>(color.b * 255);
-                unsigned char g = static_cast<unsigned char>(color.g * 255);
-                unsigned char r = static_cast<unsigned char>(color.r * 255);
+    size_t getTriangleCount() const {
+        return indices.size() / 3;
+    }
+};
+
+// Экземпляр сетки: одна геометрия может быть размещена в сцене многократно
+struct InstanceDescription {
+    uint32_t mesh = 0;
+    uint32_t material = 0;
+    Affine transform;                   // Из пространства сетки в мировое
+};
+
+// Параметрические поверхности из лабораторных работ 4 и 7 (лента Мебиуса, гиперболический
+// параболоид, тор), разбитые на сетку segmentsU x segmentsV четырехугольников по два треугольника
+class ParametricSurface {
+private:
+    std::string kind;
+
+    // Точка поверхности для параметров u, v из [0, 1]
+    Vector3 evaluate(double u, double v) const {
+        const double pi = 3.14159265358979323846;
+        if (kind == "mobius") {
+            // Лабораторная 4: u из [0, 2pi], v из [-1, 1]
+            double a = 2 * pi * u, b = 2 * v - 1;
+            return Vector3((1 + b / 2 * std::cos(a / 2)) * std::cos(a), (1 + b / 2 * std::cos(a / 2)) * std::sin(a), b / 2 * std::sin(a / 2));
+        }
+        if (kind == "paraboloid") {
+            // Лабораторная 4: z = x^2 / a^2 - y^2 / b^2 на квадрате [-range, range];
+            // высота откладывается по оси y сцены
+            const double a = 0.5, b = 0.25, range = 1.0;
+            double x = (2 * u - 1) * range, y = (2 * v - 1) * range;
+            return Vector3(x, x * x / (a * a) - y * y / (b * b), y);
+        }
+        // Лабораторная 7: тор с радиусами R = 1.5 и r = 0.5
+        const double R = 1.5, r = 0.5;
+        double theta = 2 * pi * u, phi = 2 * pi * v;
+        return Vector3((R + r * std::cos(phi)) * std::cos(theta), r * std::sin(phi), (R + r * std::cos(phi)) * std::sin(theta));
+    }
+
+public:
+    explicit ParametricSurface(const std::string& name) : kind(name) {}
+
+    static bool isKnown(const std::string& name) {
+        return name == "mobius" || name == "paraboloid" || name == "torus";
+    }
+
+    // Сетка с вершинами P(u, v) в пространстве объекта. На швах замкнутых направлений (u у тора
+    // и ленты, v у тора) вершины последнего столбца или строки - точные копии первых, поэтому
+    // соседние треугольники имеют общие ребра и сетка не имеет щелей. У ленты Мебиуса шов
+    // соединяет v с 1 - v, а нормали на нем противоположны.
+    MeshDescription tessellate(int segmentsU, int segmentsV, uint32_t material) const {
+        int rows = segmentsV + 1;
+        MeshDescription mesh;
+        mesh.material = material;
+        mesh.vertices.reserve(static_cast<size_t>(segmentsU + 1) * rows);
+        mesh.normals.reserve(static_cast<size_t>(segmentsU + 1) * rows);
+
+        const double h = 1e-5;
+        for (int i = 0; i <= segmentsU; ++i) {
+            for (int j = 0; j <= segmentsV; ++j) {
+                double u = static_cast<double>(i) / segmentsU, v = static_cast<double>(j) / segmentsV;
+                Vector3 p = evaluate(u, v);
+                // Нормаль - векторное произведение частных производных (центральные разности)
+                Vector3 du = evaluate(u + h, v) - evaluate(u - h, v);
+                Vector3 dv = evaluate(u, v + h) - evaluate(u, v - h);
+                mesh.vertices.push_back(p);
+                mesh.normals.push_back(du.cross(dv).normalize());
+            }
+        }
 
-                file.put(b);
-                file.put(g);
-                file.put(r);
+        if (kind == "torus") {
+            for (int i = 0; i <= segmentsU; ++i) {
+                mesh.vertices[i * rows + segmentsV] = mesh.vertices[i * rows];
             }
-            // Выравнивание до 4 байт
-            for (int i = 0; i < (4 - (width * 3) % 4) % 4; ++i) {
-                file.put(0);
+        }
+        if (kind != "paraboloid") {
+            for (int j = 0; j <= segmentsV; ++j) {
+                int source = kind == "mobius" ? segmentsV - j : j;
+                mesh.vertices[segmentsU * rows + j] = mesh.vertices[source];
             }
         }
 
-        file.close();
-        std::cout << "BMP image saved to: " << filename << std::endl;
+        mesh.indices.reserve(6 * static_cast<size_t>(segmentsU) * segmentsV);
+        for (int i = 0; i < segmentsU; ++i) {
+            for (int j = 0; j < segmentsV; ++j) {
+                uint32_t a = i * rows + j, b = (i + 1) * rows + j;
+                uint32_t quad[6] = { a, b, b + 1, a, b + 1, a + 1 };
+                mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+            }
+        }
+        return mesh;
     }
 };
 
-int main() {
-    std::cout << "Raycaster with Phong Lighting and Shadows" << std::endl;
-    std::cout << "=========================================" << std::endl;
+// Заголовок двоичного файла сцены. За ним идут (все little-endian, смещения кратны 8):
+// материалы (по 13 double: diffuse, specular, ambient, shininess, reflectivity, transparency,
+// refractiveIndex; до версии 3 - только первые 10), источники
+// (по 13 double: position, diffuse, specular, ambient, range; до версии 4 - без range), затем массивы сфер
+// centerX[n], centerY[n], centerZ[n], radius[n] (double) и material[n] (uint32), затем
+// сетки: заголовок из четырех uint32 (vertexCount, triangleCount, material, 0), вершины
+// и нормали (по 3 double) и индексы (по 3 uint32 на треугольник), затем (с версии 2)
+// число экземпляров и 0 (uint32), по экземпляру - mesh и material (uint32) и матрица 3x4
+// (12 double по строкам). Каждая секция дополняется нулями до кратной 8 длины.
+struct BinarySceneHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t materialCount;
+    uint32_t lightCount;
+    uint32_t meshCount;                 // В файлах без сеток - 0
+    uint64_t sphereCount;
+};
 
-    // Настройка размеров изображения
-    int width = 800;
-    int height = 600;
+static const char BINARY_SCENE_MAGIC[8] = { 'F', 'O', 'N', 'G', 'A', 'S', 'C', 'N' };
 
-    // Создаем рейкастер
-    ParallelRaycaster raycaster(width, height);
+// Описание сцены в двойной точности, не зависящее от точности рендера.
+// Сферы встроенной и текстовой сцены хранятся в собственных массивах, сферы двоичной -
+// читаются прямо из отображенного в память файла или буфера, без копирования и выделений на объект.
+class SceneDescription {
+private:
+    std::vector<double> centerX, centerY, centerZ, radius;
+    std::vector<uint32_t> sphereMaterial;
+    std::unique_ptr<MappedFile> mapping;
+    SphereArrays mappedSpheres;
+    bool borrowedSpheres = false;       // Сферы - массивы mappedSpheres внутри двоичного описания
 
-    // Рендерим сцену
-    raycaster.renderParallel();
+    void clear() {
+        materials.clear();
+        lights.clear();
+        centerX.clear();
+        centerY.clear();
+        centerZ.clear();
+        radius.clear();
+        sphereMaterial.clear();
+        meshes.clear();
+        instances.clear();
+        mapping.reset();
+        mappedSpheres = SphereArrays();
+        borrowedSpheres = false;
+    }
 
-    // Сохраняем результат
-    raycaster.saveToPPM("output.ppm");
-    raycaster.saveToBMP("output.bmp");
+    // Общая проверка сфер текстового и двоичного формата: конечный центр, положительный конечный радиус
+    static bool isValidSphere(double x, double y, double z, double r) {
+        return std::isfinite(x) && std::isfinite(y) && std::isfinite(z) && r > 0 && std::isfinite(r);
+    }
+
+    // Общая проверка материалов обоих форматов: неотрицательные коэффициенты отражения
+    // и прозрачности с суммой не больше 1, положительный показатель преломления
+    static bool hasValidCoefficients(const Material& m) {
+        return m.reflectivity >= 0 && m.transparency >= 0 && m.reflectivity + m.transparency <= 1 && m.refractiveIndex > 0;
+    }
+
+    static std::string materialName(size_t index) {
+        return "m" + std::to_string(index);
+    }
+
+    // Проверка ссылок и преобразований экземпляров (вырожденное не обращается);
+    // сетки без экземпляров размещаются один раз как есть
+    bool finishInstances(const std::string& filename) {
+        const double minDeterminant = 1e-12;
+        std::vector<char> referenced(meshes.size(), 0);
+        for (size_t i = 0; i < instances.size(); ++i) {
+            const InstanceDescription& instance = instances[i];
+            if (instance.mesh >= meshes.size() || instance.material >= materials.size()) {
+                std::cerr << "Instance references missing mesh " << instance.mesh << " or material "
+                    << instance.material << ": " << filename << std::endl;
+                return false;
+            }
+            if (!(std::fabs(instance.transform.determinant()) > minDeterminant)) {
+                std::cerr << "Instance " << i << " has a singular transform: " << filename << std::endl;
+                return false;
+            }
+            referenced[instance.mesh] = 1;
+        }
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            if (!referenced[i]) {
+                InstanceDescription instance;
+                instance.mesh = static_cast<uint32_t>(i);
+                instance.material = meshes[i].material;
+                instances.push_back(instance);
+            }
+        }
+        return true;
+    }
+
+public:
+    std::vector<Material> materials;
+    std::vector<Light> lights;
+    std::vector<MeshDescription> meshes;        // Геометрия в пространстве объекта
+    std::vector<InstanceDescription> instances;
+
+    void addSphere(const Vector3& center, double r, uint32_t material) {
+        centerX.push_back(center.x);
+        centerY.push_back(center.y);
+        centerZ.push_back(center.z);
+        radius.push_back(r);
+        sphereMaterial.push_back(material);
+    }
+
+    SphereArrays getSpheres() const {
+        if (borrowedSpheres) return mappedSpheres;
+        SphereArrays arrays;
+        arrays.count = centerX.size();
+        arrays.centerX = centerX.data();
+        arrays.centerY = centerY.data();
+        arrays.centerZ = centerZ.data();
+        arrays.radius = radius.data();
+        arrays.material = sphereMaterial.data();
+        return arrays;
+    }
+
+    // Встроенная демонстрационная сцена
+    static SceneDescription createDefault() {
+        SceneDescription scene;
+
+        // Добавляем материалы
+        scene.materials.push_back(Material(Color(0.8, 0.2, 0.2), Color(1.0, 1.0, 1.0), Color(0.1, 0.0, 0.0), 32.0));     // Красный
+        scene.materials.push_back(Material(Color(0.2, 0.8, 0.2), Color(1.0, 1.0, 1.0), Color(0.0, 0.1, 0.0), 64.0));     // Зеленый
+        scene.materials.push_back(Material(Color(0.2, 0.2, 0.8), Color(1.0, 1.0, 1.0), Color(0.0, 0.0, 0.1), 128.0));    // Синий
+        scene.materials.push_back(Material(Color(0.7, 0.7, 0.7), Color(0.3, 0.3, 0.3), Color(0.05, 0.05, 0.05), 16.0));  // Пол
+
+        // Добавляем объекты
+        scene.addSphere(Vector3(0, 0, -5), 1.0, 0);
+        scene.addSphere(Vector3(-2, 0, -7), 1.5, 1);
+        scene.addSphere(Vector3(2, 0, -6), 1.2, 2);
+        scene.addSphere(Vector3(0, -1002, 0), 1000.0, 3); // Пол
+
+        // Добавляем источники света
+        scene.lights.push_back(Light(Vector3(3, 5, -3), Color(0.8, 0.8, 0.8), Color(1.0, 1.0, 1.0), Color(0.1, 0.1, 0.1)));
+        scene.lights.push_back(Light(Vector3(-3, 2, -2), Color(0.4, 0.4, 0.4), Color(0.5, 0.5, 0.5), Color(0.05, 0.05, 0.05)));
+
+        return scene;
+    }
+
+    // Синтетическая сцена для замеров производительности: sphereCount сфер над полом в поле
+    // зрения камеры и lightCount источников над ними. Доля occlusion сфер поднята в слой между
+    // источниками и остальной сценой и отбрасывает тени. Генератор детерминирован по seed.
+    static SceneDescription createRandom(int sphereCount, int lightCount, double occlusion, uint32_t seed) {
+        SceneDescription scene = createDefault();
+        scene.centerX.clear();
+        scene.centerY.clear();
+        scene.centerZ.clear();
+        scene.radius.clear();
+        scene.sphereMaterial.clear();
+        scene.lights.clear();
+
+        // Равномерное число из [0, 1) без std::uniform_real_distribution, чья реализация
+        // различается между стандартными библиотеками
+        std::mt19937 rng(seed);
+        auto uniform = [&rng]() { return rng() / 4294967296.0; };
+
+        // Размер сфер уменьшается с их числом, чтобы плотность заполнения оставалась сравнимой
+        double radiusScale = 3.0 / std::cbrt(static_cast<double>(std::max(1, sphereCount)));
+        for (int i = 0; i < sphereCount; ++i) {
+            double z = -6 - 24 * uniform();
+            double x = (2 * uniform() - 1) * 0.8 * -z;
+            bool occluder = uniform() < occlusion;
+            double y = occluder ? 4 + 2 * uniform() : -2 + 4 * uniform();
+            scene.addSphere(Vector3(x, y, z), radiusScale * (0.5 + 0.5 * uniform()), static_cast<uint32_t>(i % 3));
+        }
+        scene.addSphere(Vector3(0, -1002, 0), 1000.0, 3); // Пол
+
+        // Источники по окружности над сценой; суммарная яркость не зависит от их числа
+        double intensity = 1.0 / std::max(1, lightCount);
+        for (int i = 0; i < lightCount; ++i) {
+            double angle = 2 * 3.14159265358979323846 * i / std::max(1, lightCount);
+            Vector3 position(10 * std::cos(angle), 12, -18 + 10 * std::sin(angle));
+            scene.lights.push_back(Light(position, Color(intensity, intensity, intensity),
+                Color(intensity, intensity, intensity), Color(0.1 * intensity, 0.1 * intensity, 0.1 * intensity)));
+        }
+
+        return scene;
+    }
+
+    // Загрузка текстового описания. Строки:
+    //   material <имя> dr dg db  sr sg sb  ar ag ab  shininess [reflectivity transparency refractiveIndex]
+    //   sphere x y z radius <имя материала>
+    //   light x y z  dr dg db  sr sg sb  ar ag ab [range]
+    //     (range - радиус влияния, за которым источник не освещает; по умолчанию без ограничения)
+    //   surface <mobius|paraboloid|torus> segmentsU segmentsV <имя материала> x y z scale
+    //     (сетка и ее экземпляр со сдвигом x y z и масштабом scale)
+    //   mesh <имя материала> vertexCount triangleCount, затем vertexCount строк
+    //     "v x y z nx ny nz" и triangleCount строк "f a b c" (индексы вершин с нуля)
+    //   instance meshIndex <имя материала> m00 m01 m02 m03  m10 m11 m12 m13  m20 m21 m22 m23
+    //     (сетки нумеруются с нуля в порядке mesh и surface, m*3 - перенос)
+    // Пустые строки и строки, начинающиеся с '#', пропускаются.
+    // Сетка, на которую не ссылается ни один instance, размещается один раз как есть.
+    bool loadText(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file) {
+            std::cerr << "Cannot open scene: " << filename << std::endl;
+            return false;
+        }
+        return parseText(file, filename);
+    }
+
+    // Разбор текстового описания из потока; filename - только для сообщений об ошибках
+    bool parseText(std::istream& file, const std::string& filename) {
+        clear();
+
+        std::vector<std::string> names;
+        std::string line;
+        int lineNumber = 0;
+        auto findMaterial = [&](const std::string& name, uint32_t& index) {
+            std::vector<std::string>::const_iterator it = std::find(names.begin(), names.end(), name);
+            if (it == names.end()) {
+                std::cerr << filename << ":" << lineNumber << ": unknown material " << name << std::endl;
+                return false;
+            }
+            index = static_cast<uint32_t>(it - names.begin());
+            return true;
+        };
+
+        while (std::getline(file, line)) {
+            lineNumber++;
+            std::istringstream in(line);
+            std::string keyword;
+            if (!(in >> keyword) || keyword[0] == '#') continue;
+
+            bool ok = false;
+            if (keyword == "material") {
+                std::string name;
+                Material m;
+                ok = static_cast<bool>(in >> name >> m.diffuse.r >> m.diffuse.g >> m.diffuse.b
+                    >> m.specular.r >> m.specular.g >> m.specular.b
+                    >> m.ambient.r >> m.ambient.g >> m.ambient.b >> m.shininess);
+                // Необязательные параметры вторичных лучей: либо все три, либо ни одного
+                if (ok && in >> m.reflectivity) {
+                    ok = static_cast<bool>(in >> m.transparency >> m.refractiveIndex);
+                }
+                if (ok && !hasValidCoefficients(m)) {
+                    std::cerr << filename << ":" << lineNumber << ": reflectivity and transparency must be non-negative"
+                        << " with a sum of at most 1, refractive index positive" << std::endl;
+                    return false;
+                }
+                if (ok) {
+                    names.push_back(name);
+                    materials.push_back(m);
+                }
+            }
+            else if (keyword == "sphere") {
+                Vector3 c;
+                double r;
+                std::string name;
+                ok = static_cast<bool>(in >> c.x >> c.y >> c.z >> r >> name);
+                if (ok && !isValidSphere(c.x, c.y, c.z, r)) {
+                    std::cerr << filename << ":" << lineNumber << ": sphere needs a finite center and a positive finite radius" << std::endl;
+                    return false;
+                }
+                if (ok) {
+                    uint32_t material;
+                    if (!findMaterial(name, material)) return false;
+                    addSphere(c, r, material);
+                }
+            }
+            else if (keyword == "surface") {
+                std::string kind, name;
+                int segmentsU, segmentsV;
+                Vector3 offset;
+                double scale;
+                ok = static_cast<bool>(in >> kind >> segmentsU >> segmentsV >> name >> offset.x >> offset.y >> offset.z >> scale)
+                    && ParametricSurface::isKnown(kind) && segmentsU > 0 && segmentsV > 0 && scale != 0;
+                if (ok) {
+                    InstanceDescription instance;
+                    if (!findMaterial(name, instance.material)) return false;
+                    instance.mesh = static_cast<uint32_t>(meshes.size());
+                    instance.transform = Affine::placement(offset, scale, 0);
+                    meshes.push_back(ParametricSurface(kind).tessellate(segmentsU, segmentsV, instance.material));
+                    instances.push_back(instance);
+                }
+            }
+            else if (keyword == "instance") {
+                InstanceDescription instance;
+                std::string name;
+                ok = static_cast<bool>(in >> instance.mesh >> name);
+                for (int i = 0; ok && i < 12; ++i) {
+                    ok = static_cast<bool>(in >> instance.transform.m[i / 4][i % 4]);
+                }
+                if (ok) {
+                    // Сетка может быть описана и после экземпляра; индекс проверяется в конце
+                    if (!findMaterial(name, instance.material)) return false;
+                    instances.push_back(instance);
+                }
+            }
+            else if (keyword == "mesh") {
+                std::string name;
+                size_t vertexCount, triangleCount;
+                ok = static_cast<bool>(in >> name >> vertexCount >> triangleCount)
+                    && vertexCount <= std::numeric_limits<uint32_t>::max() && triangleCount <= std::numeric_limits<uint32_t>::max();
+                if (ok) {
+                    MeshDescription mesh;
+                    if (!findMaterial(name, mesh.material)) return false;
+                    // Счетчики из заголовка не подтверждены строками, поэтому заранее резервируется
+                    // не больше maxReserve элементов: неверный счетчик дает ошибку разбора
+                    // в конце входа, а не выделение памяти под несуществующие вершины
+                    const size_t maxReserve = 1 << 20;
+                    mesh.vertices.reserve(std::min(vertexCount, maxReserve));
+                    mesh.normals.reserve(std::min(vertexCount, maxReserve));
+                    mesh.indices.reserve(3 * std::min(triangleCount, maxReserve));
+                    for (size_t i = 0; ok && i < vertexCount + triangleCount; ++i) {
+                        ok = static_cast<bool>(std::getline(file, line));
+                        lineNumber++;
+                        std::istringstream item(line);
+                        std::string tag;
+                        if (i < vertexCount) {
+                            Vector3 v, n;
+                            ok = ok && (item >> tag >> v.x >> v.y >> v.z >> n.x >> n.y >> n.z) && tag == "v";
+                            mesh.vertices.push_back(v);
+                            mesh.normals.push_back(n);
+                        }
+                        else {
+                            uint32_t f[3];
+                            ok = ok && (item >> tag >> f[0] >> f[1] >> f[2]) && tag == "f"
+                                && f[0] < vertexCount && f[1] < vertexCount && f[2] < vertexCount;
+                            if (ok) mesh.indices.insert(mesh.indices.end(), f, f + 3);
+                        }
+                    }
+                    if (ok) meshes.push_back(mesh);
+                }
+            }
+            else if (keyword == "light") {
+                Vector3 p;
+                Color d, s, a;
+                ok = static_cast<bool>(in >> p.x >> p.y >> p.z >> d.r >> d.g >> d.b >> s.r >> s.g >> s.b >> a.r >> a.g >> a.b);
+                Light light(p, d, s, a);
+                if (ok && in >> light.range) {
+                    ok = light.range >= 0;
+                }
+                if (ok) lights.push_back(light);
+            }
+
+            if (!ok) {
+                std::cerr << filename << ":" << lineNumber << ": invalid line: " << line << std::endl;
+                return false;
+            }
+        }
+        return finishInstances(filename);
+    }
+
+    // Загрузка двоичного описания через отображение файла в память
+    bool loadBinary(const std::string& filename) {
+        clear();
+        std::unique_ptr<MappedFile> file(new MappedFile());
+        if (!file->open(filename)) {
+            std::cerr << "Cannot map scene: " << filename << std::endl;
+            return false;
+        }
+
+        if (!parseBinary(file->getData(), file->getSize(), filename)) {
+            return false;
+        }
+        mapping = std::move(file);
+        return true;
+    }
+
+    // Разбор двоичного описания в памяти. Массивы сфер не копируются: data должен жить,
+    // пока используется описание (для файла его держит отображение mapping)
+    bool parseBinary(const unsigned char* data, size_t size, const std::string& filename) {
+        clear();
+        BinarySceneHeader header;
+        if (size < sizeof(header)) {
+            std::cerr << "Scene file is truncated: " << filename << std::endl;
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, BINARY_SCENE_MAGIC, sizeof(header.magic)) != 0 || header.version < 1 || header.version > 4) {
+            std::cerr << "Not a binary scene file: " << filename << std::endl;
+            return false;
+        }
+
+        uint64_t n = header.sphereCount;
+        size_t materialDoubles = header.version >= 3 ? 13 : 10;
+        uint64_t materialBytes = static_cast<uint64_t>(header.materialCount) * materialDoubles * sizeof(double);
+        size_t lightDoubles = header.version >= 4 ? 13 : 12;
+        uint64_t lightBytes = static_cast<uint64_t>(header.lightCount) * lightDoubles * sizeof(double);
+        uint64_t sphereBytes = n * (4 * sizeof(double) + sizeof(uint32_t));
+        if (n > size || sizeof(header) + materialBytes + lightBytes + sphereBytes > size) {
+            std::cerr << "Scene file is truncated: " << filename << std::endl;
+            return false;
+        }
+
+        const unsigned char* cursor = data + sizeof(header);
+        materials.reserve(header.materialCount);
+        for (uint32_t i = 0; i < header.materialCount; ++i, cursor += materialDoubles * sizeof(double)) {
+            double v[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+            std::memcpy(v, cursor, materialDoubles * sizeof(double));
+            Material m(Color(v[0], v[1], v[2]), Color(v[3], v[4], v[5]), Color(v[6], v[7], v[8]), v[9]);
+            m.reflectivity = v[10];
+            m.transparency = v[11];
+            m.refractiveIndex = v[12];
+            if (!hasValidCoefficients(m)) {
+                std::cerr << "Material " << i << " needs non-negative reflectivity and transparency with a sum of at most 1"
+                    << " and a positive refractive index in scene file: " << filename << std::endl;
+                return false;
+            }
+            materials.push_back(m);
+        }
+        lights.reserve(header.lightCount);
+        for (uint32_t i = 0; i < header.lightCount; ++i, cursor += lightDoubles * sizeof(double)) {
+            double v[13] = {};
+            std::memcpy(v, cursor, lightDoubles * sizeof(double));
+            lights.push_back(Light(Vector3(v[0], v[1], v[2]), Color(v[3], v[4], v[5]), Color(v[6], v[7], v[8]), Color(v[9], v[10], v[11])));
+            lights.back().range = std::max(0.0, v[12]);
+        }
+
+        // Массивы сфер используются на месте: смещения кратны 8, отображение выровнено по странице
+        size_t count = static_cast<size_t>(n);
+        mappedSpheres.count = count;
+        mappedSpheres.centerX = reinterpret_cast<const double*>(cursor);
+        mappedSpheres.centerY = mappedSpheres.centerX + count;
+        mappedSpheres.centerZ = mappedSpheres.centerY + count;
+        mappedSpheres.radius = mappedSpheres.centerZ + count;
+        mappedSpheres.material = reinterpret_cast<const uint32_t*>(mappedSpheres.radius + count);
+        borrowedSpheres = true;
+
+        for (size_t i = 0; i < count; ++i) {
+            if (mappedSpheres.material[i] >= materials.size()) {
+                std::cerr << "Sphere " << i << " references missing material " << mappedSpheres.material[i] << std::endl;
+                mappedSpheres = SphereArrays();
+                return false;
+            }
+            if (!isValidSphere(mappedSpheres.centerX[i], mappedSpheres.centerY[i], mappedSpheres.centerZ[i], mappedSpheres.radius[i])) {
+                std::cerr << "Sphere " << i << " needs a finite center and a positive finite radius in scene file: " << filename << std::endl;
+                mappedSpheres = SphereArrays();
+                return false;
+            }
+        }
+
+        // Сетки копируются: их немного, а вершины все равно приводятся к точности рендера
+        cursor += sphereBytes + count % 2 * sizeof(uint32_t);
+        const unsigned char* end = data + size;
+        for (uint32_t m = 0; m < header.meshCount; ++m) {
+            uint32_t counts[4];
+            bool valid = end - cursor >= static_cast<ptrdiff_t>(sizeof(counts));
+            if (valid) {
+                std::memcpy(counts, cursor, sizeof(counts));
+                cursor += sizeof(counts);
+                uint64_t indexCount = 3 * static_cast<uint64_t>(counts[1]);
+                uint64_t bytes = 6 * static_cast<uint64_t>(counts[0]) * sizeof(double) + (indexCount + indexCount % 2) * sizeof(uint32_t);
+                valid = bytes <= static_cast<uint64_t>(end - cursor) && counts[2] < materials.size();
+            }
+            if (!valid) {
+                std::cerr << "Invalid mesh " << m << " in scene file: " << filename << std::endl;
+                mappedSpheres = SphereArrays();
+                meshes.clear();
+                return false;
+            }
+
+            MeshDescription mesh;
+            mesh.material = counts[2];
+            mesh.vertices.resize(counts[0]);
+            mesh.normals.resize(counts[0]);
+            mesh.indices.resize(3 * static_cast<size_t>(counts[1]));
+            for (auto* target : { &mesh.vertices, &mesh.normals }) {
+                for (auto& v : *target) {
+                    double xyz[3];
+                    std::memcpy(xyz, cursor, sizeof(xyz));
+                    v = Vector3(xyz[0], xyz[1], xyz[2]);
+                    cursor += sizeof(xyz);
+                }
+            }
+            std::memcpy(mesh.indices.data(), cursor, mesh.indices.size() * sizeof(uint32_t));
+            cursor += (mesh.indices.size() + mesh.indices.size() % 2) * sizeof(uint32_t);
+            for (uint32_t index : mesh.indices) {
+                if (index >= counts[0]) {
+                    std::cerr << "Invalid mesh " << m << " in scene file: " << filename << std::endl;
+                    mappedSpheres = SphereArrays();
+                    meshes.clear();
+                    return false;
+                }
+            }
+            meshes.push_back(std::move(mesh));
+        }
+
+        // Экземпляры появились во второй версии формата
+        uint32_t instanceCount = 0;
+        if (header.version >= 2) {
+            uint32_t counts[2] = {};
+            bool valid = end - cursor >= static_cast<ptrdiff_t>(sizeof(counts));
+            if (valid) {
+                std::memcpy(counts, cursor, sizeof(counts));
+                cursor += sizeof(counts);
+                instanceCount = counts[0];
+                valid = static_cast<uint64_t>(instanceCount) * (2 * sizeof(uint32_t) + 12 * sizeof(double)) <= static_cast<uint64_t>(end - cursor);
+            }
+            if (!valid) {
+                std::cerr << "Invalid instance section in scene file: " << filename << std::endl;
+                mappedSpheres = SphereArrays();
+                meshes.clear();
+                return false;
+            }
+        }
+        instances.resize(instanceCount);
+        for (auto& instance : instances) {
+            uint32_t ids[2];
+            std::memcpy(ids, cursor, sizeof(ids));
+            std::memcpy(instance.transform.m, cursor + sizeof(ids), 12 * sizeof(double));
+            instance.mesh = ids[0];
+            instance.material = ids[1];
+            cursor += sizeof(ids) + 12 * sizeof(double);
+        }
+        if (!finishInstances(filename)) {
+            mappedSpheres = SphereArrays();
+            meshes.clear();
+            instances.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Загрузка из буфера в памяти (текст или двоичный формат по сигнатуре); для двоичного
+    // формата data должен жить, пока используется описание
+    bool loadFromMemory(const unsigned char* data, size_t size, const std::string& name) {
+        if (size >= sizeof(BINARY_SCENE_MAGIC) && std::memcmp(data, BINARY_SCENE_MAGIC, sizeof(BINARY_SCENE_MAGIC)) == 0) {
+            return parseBinary(data, size, name);
+        }
+        std::istringstream in(std::string(reinterpret_cast<const char*>(data), size));
+        return parseText(in, name);
+    }
+
+    // Загрузка с определением формата по сигнатуре
+    bool load(const std::string& filename) {
+        char magic[sizeof(BINARY_SCENE_MAGIC)] = {};
+        std::ifstream probe(filename, std::ios::binary);
+        probe.read(magic, sizeof(magic));
+        bool binary = probe.gcount() == sizeof(magic) && std::memcmp(magic, BINARY_SCENE_MAGIC, sizeof(magic)) == 0;
+        probe.close();
+        return binary ? loadBinary(filename) : loadText(filename);
+    }
+
+    bool saveText(const std::string& filename) const {
+        std::ofstream file(filename);
+        if (!file) {
+            std::cerr << "Cannot open file: " << filename << std::endl;
+            return false;
+        }
+        file.precision(17);
+
+        file << "# Fonga scene: " << materials.size() << " materials, " << getSpheres().count << " spheres, "
+            << meshes.size() << " meshes, " << instances.size() << " instances, " << lights.size() << " lights\n";
+        for (size_t i = 0; i < materials.size(); ++i) {
+            const Material& m = materials[i];
+            file << "material " << materialName(i) << " " << m.diffuse.r << " " << m.diffuse.g << " " << m.diffuse.b << "  "
+                << m.specular.r << " " << m.specular.g << " " << m.specular.b << "  "
+                << m.ambient.r << " " << m.ambient.g << " " << m.ambient.b << "  " << m.shininess;
+            if (m.isTracing()) {
+                file << "  " << m.reflectivity << " " << m.transparency << " " << m.refractiveIndex;
+            }
+            file << "\n";
+        }
+        SphereArrays s = getSpheres();
+        for (size_t i = 0; i < s.count; ++i) {
+            file << "sphere " << s.centerX[i] << " " << s.centerY[i] << " " << s.centerZ[i] << " " << s.radius[i]
+                << " " << materialName(s.material[i]) << "\n";
+        }
+        for (const auto& mesh : meshes) {
+            file << "mesh " << materialName(mesh.material) << " " << mesh.vertices.size() << " " << mesh.getTriangleCount() << "\n";
+            for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+                const Vector3& v = mesh.vertices[i];
+                const Vector3& n = mesh.normals[i];
+                file << "v " << v.x << " " << v.y << " " << v.z << "  " << n.x << " " << n.y << " " << n.z << "\n";
+            }
+            for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+                file << "f " << mesh.indices[i] << " " << mesh.indices[i + 1] << " " << mesh.indices[i + 2] << "\n";
+            }
+        }
+        for (const auto& instance : instances) {
+            file << "instance " << instance.mesh << " " << materialName(instance.material);
+            for (int i = 0; i < 12; ++i) {
+                file << (i % 4 == 0 ? "  " : " ") << instance.transform.m[i / 4][i % 4];
+            }
+            file << "\n";
+        }
+        for (const auto& l : lights) {
+            file << "light " << l.position.x << " " << l.position.y << " " << l.position.z << "  "
+                << l.diffuse.r << " " << l.diffuse.g << " " << l.diffuse.b << "  "
+                << l.specular.r << " " << l.specular.g << " " << l.specular.b << "  "
+                << l.ambient.r << " " << l.ambient.g << " " << l.ambient.b;
+            if (l.range > 0) file << "  " << l.range;
+            file << "\n";
+        }
+        return static_cast<bool>(file);
+    }
+
+    bool saveBinary(const std::string& filename) const {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open file: " << filename << std::endl;
+            return false;
+        }
+        return writeBinary(file);
+    }
+
+    // Двоичное описание в поток (в файл или в буфер запроса к серверу)
+    bool writeBinary(std::ostream& file) const {
+        SphereArrays s = getSpheres();
+        BinarySceneHeader header;
+        std::memcpy(header.magic, BINARY_SCENE_MAGIC, sizeof(header.magic));
+        header.version = 4;
+        header.materialCount = static_cast<uint32_t>(materials.size());
+        header.lightCount = static_cast<uint32_t>(lights.size());
+        header.meshCount = static_cast<uint32_t>(meshes.size());
+        header.sphereCount = s.count;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        for (const auto& m : materials) {
+            double v[13] = { m.diffuse.r, m.diffuse.g, m.diffuse.b, m.specular.r, m.specular.g, m.specular.b,
+                m.ambient.r, m.ambient.g, m.ambient.b, m.shininess, m.reflectivity, m.transparency, m.refractiveIndex };
+            file.write(reinterpret_cast<const char*>(v), sizeof(v));
+        }
+        for (const auto& l : lights) {
+            double v[13] = { l.position.x, l.position.y, l.position.z, l.diffuse.r, l.diffuse.g, l.diffuse.b,
+                l.specular.r, l.specular.g, l.specular.b, l.ambient.r, l.ambient.g, l.ambient.b, l.range };
+            file.write(reinterpret_cast<const char*>(v), sizeof(v));
+        }
+
+        std::streamsize arrayBytes = static_cast<std::streamsize>(s.count * sizeof(double));
+        file.write(reinterpret_cast<const char*>(s.centerX), arrayBytes);
+        file.write(reinterpret_cast<const char*>(s.centerY), arrayBytes);
+        file.write(reinterpret_cast<const char*>(s.centerZ), arrayBytes);
+        file.write(reinterpret_cast<const char*>(s.radius), arrayBytes);
+        file.write(reinterpret_cast<const char*>(s.material), static_cast<std::streamsize>(s.count * sizeof(uint32_t)));
+
+        const char zeros[8] = {};
+        file.write(zeros, static_cast<std::streamsize>(s.count % 2 * sizeof(uint32_t)));
+        for (const auto& mesh : meshes) {
+            uint32_t counts[4] = { static_cast<uint32_t>(mesh.vertices.size()), static_cast<uint32_t>(mesh.getTriangleCount()), mesh.material, 0 };
+            file.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+            for (const auto& v : mesh.vertices) {
+                double xyz[3] = { v.x, v.y, v.z };
+                file.write(reinterpret_cast<const char*>(xyz), sizeof(xyz));
+            }
+            for (const auto& n : mesh.normals) {
+                double xyz[3] = { n.x, n.y, n.z };
+                file.write(reinterpret_cast<const char*>(xyz), sizeof(xyz));
+            }
+            file.write(reinterpret_cast<const char*>(mesh.indices.data()), static_cast<std::streamsize>(mesh.indices.size() * sizeof(uint32_t)));
+            file.write(zeros, static_cast<std::streamsize>(mesh.indices.size() % 2 * sizeof(uint32_t)));
+        }
+
+        uint32_t instanceCounts[2] = { static_cast<uint32_t>(instances.size()), 0 };
+        file.write(reinterpret_cast<const char*>(instanceCounts), sizeof(instanceCounts));
+        for (const auto& instance : instances) {
+            uint32_t ids[2] = { instance.mesh, instance.material };
+            file.write(reinterpret_cast<const char*>(ids), sizeof(ids));
+            file.write(reinterpret_cast<const char*>(instance.transform.m), 12 * sizeof(double));
+        }
+        return static_cast<bool>(file);
+    }
+
+    // Сохранение в формате по расширению: .txt - текст, иначе двоичный
+    bool save(const std::string& filename) const {
+        bool text = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".txt") == 0;
+        return text ? saveText(filename) : saveBinary(filename);
+    }
+};
+
+// Анимация: ключевые кадры позиций сфер, источников и камеры. Между ключами позиции
+// интерполируются линейно, до первого и после последнего ключа остаются постоянными.
+class AnimationDescription {
+public:
+    enum class Target {
+        Sphere,
+        Light,
+        Camera
+    };
+
+    struct Key {
+        int frame;
+        Vector3 position;
+        Vector3 lookAt;                 // Только для камеры: точка, на которую она направлена
+    };
+
+    // Дорожка - ключи одного объекта, упорядоченные по кадрам
+    struct Track {
+        Target target;
+        uint32_t index;                 // Индекс сферы или источника в описании сцены
+        std::vector<Key> keys;
+    };
+
+    int frameCount = 1;
+    std::vector<Track> tracks;
+
+    // Загрузка текстового описания. Строки:
+    //   frames N
+    //   sphere <индекс> <кадр> x y z
+    //   light <индекс> <кадр> x y z
+    //   camera <кадр> x y z  tx ty tz (положение и точка, на которую смотрит камера)
+    // Пустые строки и строки, начинающиеся с '#', пропускаются.
+    bool load(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file) {
+            std::cerr << "Cannot open animation: " << filename << std::endl;
+            return false;
+        }
+        frameCount = 1;
+        tracks.clear();
+
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(file, line)) {
+            lineNumber++;
+            std::istringstream in(line);
+            std::string keyword;
+            if (!(in >> keyword) || keyword[0] == '#') continue;
+
+            bool ok = false;
+            Key key;
+            uint32_t index = 0;
+            if (keyword == "frames") {
+                ok = static_cast<bool>(in >> frameCount) && frameCount > 0;
+            }
+            else if (keyword == "sphere" || keyword == "light") {
+                ok = static_cast<bool>(in >> index >> key.frame >> key.position.x >> key.position.y >> key.position.z);
+                if (ok) addKey(keyword == "sphere" ? Target::Sphere : Target::Light, index, key);
+            }
+            else if (keyword == "camera") {
+                ok = static_cast<bool>(in >> key.frame >> key.position.x >> key.position.y >> key.position.z
+                    >> key.lookAt.x >> key.lookAt.y >> key.lookAt.z);
+                if (ok) addKey(Target::Camera, 0, key);
+            }
+
+            if (!ok) {
+                std::cerr << filename << ":" << lineNumber << ": invalid line: " << line << std::endl;
+                return false;
+            }
+        }
+
+        for (auto& track : tracks) {
+            std::stable_sort(track.keys.begin(), track.keys.end(), [](const Key& a, const Key& b) {
+                return a.frame < b.frame;
+            });
+        }
+        return true;
+    }
+
+    // Облет камеры вокруг точки center по окружности радиуса radius на высоте height над ней
+    static AnimationDescription createTurntable(int frames, const Vector3& center, double radius, double height) {
+        AnimationDescription animation;
+        animation.frameCount = frames;
+        const double pi = 3.14159265358979323846;
+        const int keysPerTurn = 64;     // Хорды окружности короче 0.1 радиуса
+        for (int i = 0; i <= keysPerTurn; ++i) {
+            double angle = 2 * pi * i / keysPerTurn;
+            Key key;
+            key.frame = frames * i / keysPerTurn;
+            key.position = center + Vector3(radius * std::sin(angle), height, radius * std::cos(angle));
+            key.lookAt = center;
+            animation.addKey(Target::Camera, 0, key);
+        }
+        return animation;
+    }
+
+    // Ссылаются ли дорожки только на существующие сферы и источники
+    bool validate(const SceneDescription& scene) const {
+        for (const auto& track : tracks) {
+            if ((track.target == Target::Sphere && track.index >= scene.getSpheres().count)
+                || (track.target == Target::Light && track.index >= scene.lights.size())) {
+                std::cerr << "Animation references missing " << (track.target == Target::Sphere ? "sphere " : "light ")
+                    << track.index << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Ключ дорожки в кадре frame (позиция и точка взгляда интерполированы)
+    static Key sample(const Track& track, int frame) {
+        const std::vector<Key>& keys = track.keys;
+        if (frame <= keys.front().frame) return keys.front();
+        if (frame >= keys.back().frame) return keys.back();
+
+        size_t next = 1;
+        while (keys[next].frame < frame) ++next;
+        const Key& a = keys[next - 1];
+        const Key& b = keys[next];
+        double t = static_cast<double>(frame - a.frame) / (b.frame - a.frame);
+        Key key;
+        key.frame = frame;
+        key.position = a.position + (b.position - a.position) * t;
+        key.lookAt = a.lookAt + (b.lookAt - a.lookAt) * t;
+        return key;
+    }
+
+private:
+    void addKey(Target target, uint32_t index, const Key& key) {
+        for (auto& track : tracks) {
+            if (track.target == target && track.index == index) {
+                track.keys.push_back(key);
+                return;
+            }
+        }
+        Track track;
+        track.target = target;
+        track.index = index;
+        track.keys.push_back(key);
+        tracks.push_back(track);
+    }
+};
+
+// Кэш теневых лучей одного потока: для каждого источника - последний заслонивший его
+// примитив (позиция в SoA). Соседние пиксели обычно заслоняет тот же объект,
+// поэтому он проверяется первым, до обхода BVH.
+// Массивы потоков выделяются друг за другом и пишутся при каждом заслоненном луче, поэтому
+// слоты окружены строкой кэша дополнения с каждой стороны: строки, в которые пишет поток,
+// не содержат данных других потоков.
+struct ShadowCache {
+    static const int PADDING = 16;      // 64 байта
+    std::vector<int> slots;
+    long long cacheHits = 0;
+
+    void reset(int lightCount) {
+        slots.assign(lightCount + 2 * PADDING, -1);
+        cacheHits = 0;
+    }
+
+    int& lastOccluder(int lightIndex) {
+        return slots[PADDING + lightIndex];
+    }
+};
+
+// Наибольшая допустимая глубина вторичных лучей
+const int MAX_TRACE_DEPTH = 16;
+
+// Счетчики работы одного потока; заполняются при FONGA_STATS >= 1, время - при FONGA_STATS >= 2
+struct RayCounters {
+    long long primaryRays = 0;
+    long long secondaryRays = 0;        // Отраженные и преломленные лучи
+    long long depthRays[MAX_TRACE_DEPTH + 1] = {};     // Вторичные лучи по глубине (с 1)
+    long long rouletteTerminated = 0;   // Вторичные лучи, отброшенные русской рулеткой
+    long long shadowRays = 0;
+    long long sphereTests = 0;          // Проверки луч-сфера, включая проверки кэша теней
+    long long triangleTests = 0;
+    long long hits = 0;                 // Первичные лучи, попавшие в объект
+    long long intersectionNs = 0;       // Поиск ближайшего пересечения первичных и вторичных лучей
+    long long shadowNs = 0;             // Теневые лучи
+    long long shadingNs = 0;            // Расчет освещения вместе с теневыми лучами
+    long long outputNs = 0;             // Запись пикселей в буфер кадра и квантование в 8 бит
+
+    void add(const RayCounters& other) {
+        primaryRays += other.primaryRays;
+        secondaryRays += other.secondaryRays;
+        for (int depth = 0; depth <= MAX_TRACE_DEPTH; ++depth) depthRays[depth] += other.depthRays[depth];
+        rouletteTerminated += other.rouletteTerminated;
+        shadowRays += other.shadowRays;
+        sphereTests += other.sphereTests;
+        triangleTests += other.triangleTests;
+        hits += other.hits;
+        intersectionNs += other.intersectionNs;
+        shadowNs += other.shadowNs;
+        shadingNs += other.shadingNs;
+        outputNs += other.outputNs;
+    }
+};
+
+#if FONGA_STATS >= 2
+long long statsClockNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+// Прибавляет к total время жизни объекта в наносекундах; без FONGA_STATS >= 2 ничего не делает
+class StatsTimer {
+#if FONGA_STATS >= 2
+private:
+    long long& total;
+    long long start;
+
+public:
+    explicit StatsTimer(long long& counter) : total(counter), start(statsClockNs()) {}
+    ~StatsTimer() { total += statsClockNs() - start; }
+#else
+public:
+    explicit StatsTimer(long long&) {}
+#endif
+    StatsTimer(const StatsTimer&) = delete;
+    StatsTimer& operator=(const StatsTimer&) = delete;
+};
+
+// Перемешивание (хэш PCG): случайные числа лучей зависят только от пикселя и пути луча,
+// поэтому изображение не зависит от числа потоков и порядка обработки тайлов
+uint32_t hashSeed(uint32_t seed, uint32_t value) {
+    uint32_t state = (seed ^ (value * 0x9E3779B9u)) * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+    return (word >> 22) ^ word;
+}
+
+// Равномерное число в [0, 1) из 24 старших бит
+template <typename Real>
+Real randomUnit(uint32_t seed) {
+    return static_cast<Real>((seed >> 8) * (1.0 / 16777216.0));
+}
+
+// Источники, отобранные для группы точек (тайла или всей сцены), с накопленной интенсивностью
+// для выборки источника с вероятностью, пропорциональной его интенсивности
+struct LightList {
+    std::vector<int> indices;
+    std::vector<double> cdf;            // cdf[k] - суммарная интенсивность indices[0..k]
+    long long builds = 0;               // Статистика построений списка и их длин
+    long long totalLength = 0;
+
+    void clear() {
+        indices.clear();
+        cdf.clear();
+    }
+
+    void add(int index, double intensity) {
+        indices.push_back(index);
+        cdf.push_back((cdf.empty() ? 0.0 : cdf.back()) + intensity);
+    }
+
+    int size() const {
+        return static_cast<int>(indices.size());
+    }
+};
+
+// Состояние потока рендеринга
+struct ThreadContext {
+    ShadowCache shadowCache;
+    LightList tileLights;               // Источники текущего тайла при отсечении
+    RayCounters counters;
+    char padding[64];                   // Счетчики соседних потоков в разных строках кэша
+
+    void reset(int lightCount) {
+        shadowCache.reset(lightCount);
+        tileLights.clear();
+        tileLights.builds = tileLights.totalLength = 0;
+        counters = RayCounters();
+    }
+};
+
+// Луч, подготовленный для водонепроницаемого теста пересечения с треугольником
+// (Woop, Benthin, Wald, 2013): ось с наибольшей компонентой направления становится осью z,
+// а сдвиг переводит направление в (0, 0, 1). Ребро, общее для двух треугольников,
+// вычисляется для обоих одинаково, поэтому луч не проходит между ними.
+template <typename Real>
+struct WatertightRayT {
+    Vector3T<Real> origin;
+    int kx, ky, kz;
+    Real sx, sy, sz;
+
+    static Real component(const Vector3T<Real>& v, int k) {
+        return k == 0 ? v.x : (k == 1 ? v.y : v.z);
+    }
+
+    explicit WatertightRayT(const RayT<Real>& ray) : origin(ray.origin) {
+        const Vector3T<Real>& d = ray.direction;
+        Real ax = std::abs(d.x), ay = std::abs(d.y), az = std::abs(d.z);
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // Сохраняем ориентацию треугольников при отрицательном направлении
+        if (component(d, kz) < 0) std::swap(kx, ky);
+
+        Real dz = component(d, kz);
+        sx = component(d, kx) / dz;
+        sy = component(d, ky) / dz;
+        sz = 1 / dz;
+    }
+};
+
+// Индексированная треугольная сетка: общий буфер вершин с нормалями и тройки индексов,
+// переупорядоченные по листьям собственной BVH, которая обходится так же, как BVH сфер
+template <typename Real>
+class TriangleMeshT {
+private:
+    typedef Vector3T<Real> Vec;
+    typedef WatertightRayT<Real> WRay;
+
+    std::vector<Vec> vertices;
+    std::vector<Vec> normals;
+    std::vector<uint32_t> indices;      // По три на треугольник, в порядке листьев BVH
+    AABBT<Real> bounds;                 // В пространстве объекта
+    BVHT<Real> bvh;
+
+    // Ребровая функция в двойной точности: для float нулевое значение может быть ошибкой
+    // округления, и тогда его знак уточняется, иначе луч может пройти через ребро
+    static Real edge(Real ax, Real ay, Real bx, Real by) {
+        Real e = ax * by - ay * bx;
+        if (sizeof(Real) < sizeof(double) && e == 0) {
+            e = static_cast<Real>(static_cast<double>(ax) * by - static_cast<double>(ay) * bx);
+        }
+        return e;
+    }
+
+public:
+    // Материал задается экземпляром: одна сетка может быть размещена с разными материалами
+    explicit TriangleMeshT(const MeshDescription& mesh) : indices(mesh.indices) {
+        vertices.reserve(mesh.vertices.size());
+        normals.reserve(mesh.normals.size());
+        for (const auto& v : mesh.vertices) {
+            vertices.push_back(Vec(v));
+            bounds.expand(vertices.back());
+        }
+        for (const auto& n : mesh.normals) normals.push_back(Vec(n));
+    }
+
+    // Построение BVH по треугольникам и перестановка индексов в порядок ее листьев
+    void buildAcceleration() {
+        std::vector<AABBT<Real>> bounds;
+        bounds.reserve(indices.size() / 3);
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            AABBT<Real> box;
+            for (int k = 0; k < 3; ++k) box.expand(vertices[indices[i + k]]);
+            bounds.push_back(box);
+        }
+        bvh.build(bounds);
+
+        const std::vector<int>& order = bvh.getPrimIndices();
+        std::vector<uint32_t> sorted(indices.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (int k = 0; k < 3; ++k) sorted[3 * i + k] = indices[3 * static_cast<size_t>(order[i]) + k];
+        }
+        indices.swap(sorted);
+    }
+
+    const AABBT<Real>& getBounds() const { return bounds; }
+    int getTriangleCount() const { return static_cast<int>(indices.size() / 3); }
+    const BVHT<Real>& getBVH() const { return bvh; }
+
+    // Пересечение с треугольником (позиция в порядке листьев) ближе tMax;
+    // b1, b2 - барицентрические координаты второй и третьей вершин
+    bool intersectTriangle(const WRay& ray, int triangle, Real tMax, Real& t, Real& b1, Real& b2) const {
+        const uint32_t* tri = &indices[3 * static_cast<size_t>(triangle)];
+        Vec a = vertices[tri[0]] - ray.origin;
+        Vec b = vertices[tri[1]] - ray.origin;
+        Vec c = vertices[tri[2]] - ray.origin;
+
+        Real az = WRay::component(a, ray.kz), bz = WRay::component(b, ray.kz), cz = WRay::component(c, ray.kz);
+        Real ax = WRay::component(a, ray.kx) - ray.sx * az, ay = WRay::component(a, ray.ky) - ray.sy * az;
+        Real bx = WRay::component(b, ray.kx) - ray.sx * bz, by = WRay::component(b, ray.ky) - ray.sy * bz;
+        Real cx = WRay::component(c, ray.kx) - ray.sx * cz, cy = WRay::component(c, ray.ky) - ray.sy * cz;
+
+        Real u = edge(cx, cy, bx, by);
+        Real v = edge(ax, ay, cx, cy);
+        Real w = edge(bx, by, ax, ay);
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+
+        Real det = u + v + w;
+        if (det == 0) return false;
+
+        // Расстояние, умноженное на det: деление только для найденного пересечения
+        Real tScaled = ray.sz * (u * az + v * bz + w * cz);
+        if (det > 0 ? (tScaled <= 0 || tScaled > tMax * det) : (tScaled >= 0 || tScaled < tMax * det)) return false;
+
+        Real invDet = 1 / det;
+        t = tScaled * invDet;
+        b1 = v * invDet;
+        b2 = w * invDet;
+        return true;
+    }
+
+    // Поиск пересечения ближе tMax (при anyHit - любого); tMax уменьшается до найденного
+    bool intersect(const RayT<Real>& ray, const WRay& wray, Real& tMax, bool anyHit,
+        int& triangle, Real& b1, Real& b2, RayCounters& counters) const {
+        (void)counters;
+        return bvh.traverse(ray, tMax, anyHit, [&](int first, int count, Real& tLimit) {
+            FONGA_COUNT(counters.triangleTests += count);
+            bool found = false;
+            for (int i = first; i < first + count; ++i) {
+                Real t, u, v;
+                if (intersectTriangle(wray, i, tLimit, t, u, v)) {
+                    tLimit = t;
+                    triangle = i;
+                    b1 = u;
+                    b2 = v;
+                    found = true;
+                    if (anyHit) break;
+                }
+            }
+            return found;
+        });
+    }
+
+    // Интерполированная нормаль в точке треугольника
+    Vec getNormal(int triangle, Real b1, Real b2) const {
+        const uint32_t* tri = &indices[3 * static_cast<size_t>(triangle)];
+        return (normals[tri[0]] * (1 - b1 - b2) + normals[tri[1]] * b1 + normals[tri[2]] * b2).normalize();
+    }
+};
+
+// Размещение сетки в сцене. Луч переводится в пространство сетки, поэтому геометрия
+// и BVH сетки хранятся один раз для всех экземпляров.
+template <typename Real>
+struct InstanceT {
+    AffineT<Real> objectToWorld;
+    AffineT<Real> worldToObject;
+    int mesh;
+    int materialIndex;
+};
+
+// Результат поиска пересечения: только примитив и параметр луча. Точка, нормаль
+// и материал вычисляются один раз после обхода, а не для каждого более близкого кандидата.
+template <typename Real>
+struct HitRecordT {
+    Real t;
+    int object = -1;            // Индекс в Scene::objects или -1 для треугольника
+    int instance = -1;          // Индекс экземпляра сетки, треугольник и барицентрические координаты
+    int triangle = -1;
+    Real b1 = 0, b2 = 0;
+};
+
+// Сцена
+template <typename Real>
+class SceneT {
+private:
+    typedef Vector3T<Real> Vec;
+    typedef ColorT<Real> Col;
+    typedef MaterialT<Real> Mat;
+    typedef LightT<Real> Lgt;
+    typedef RayT<Real> RayR;
+    typedef SphereT<Real> Sph;
+    typedef HitRecordT<Real> Hit;
+
+    std::vector<Mat> materials;                 // Общая таблица, объекты ссылаются по индексу
+    std::vector<Sph> objects;
+    std::vector<TriangleMeshT<Real>> meshes;
+    std::vector<InstanceT<Real>> instances;     // В порядке листьев instanceBVH
+    std::vector<Lgt> lights;
+    BVHT<Real> bvh;
+    BVHT<Real> instanceBVH;                     // Верхний уровень: по экземплярам сеток
+    std::vector<int> sphereSlots;               // Позиция сферы в порядке листьев BVH
+    Real builtSAHCost = 0;                      // Стоимость BVH сфер сразу после построения
+    SphereSoAT<Real> spheres;
+    SimdLevel simdLevel = detectSimdLevel();
+    Col totalAmbient;                           // Сумма фоновых составляющих всех источников
+    int lightSamples = 0;                       // Источников на точку при выборке; 0 - все
+    ShadingModel shadingModel = ShadingModel::Exact;
+    int specularBits = 1;                       // Разрядов в наибольшем показателе быстрого пути (не меньше 1)
+
+    // Значение для hashSeed, отличное от индексов дочерних лучей и точек линзы
+    static const uint32_t LIGHT_SEED = 0x4C474854u;
+
+public:
+    // Материалы, объекты и источники могут быть заданы в любой точности и приводятся к Real.
+    // addMaterial возвращает индекс материала для объектов.
+    template <typename Other>
+    int addMaterial(const MaterialT<Other>& material) {
+        materials.push_back(Mat(material));
+        const Mat& added = materials.back();
+        specularBits = std::max(specularBits, exponentBits(std::max(0, std::max(added.getFastExponent(false), added.getFastExponent(true)))));
+        return static_cast<int>(materials.size()) - 1;
+    }
+
+    template <typename Other>
+    void addObject(const SphereT<Other>& object) {
+        objects.push_back(Sph(object));
+    }
+
+    template <typename Other>
+    void addLight(const LightT<Other>& light) {
+        lights.push_back(Lgt(light));
+        totalAmbient = totalAmbient + lights.back().ambient;
+    }
+
+    // Заполнение из описания: сферы добавляются одним проходом по массивам описания
+    void load(const SceneDescription& description) {
+        int firstMaterial = static_cast<int>(materials.size());
+        materials.reserve(materials.size() + description.materials.size());
+        for (const auto& m : description.materials) {
+            addMaterial(m);
+        }
+
+        SphereArrays s = description.getSpheres();
+        objects.reserve(objects.size() + s.count);
+        for (size_t i = 0; i < s.count; ++i) {
+            Vec center(static_cast<Real>(s.centerX[i]), static_cast<Real>(s.centerY[i]), static_cast<Real>(s.centerZ[i]));
+            objects.push_back(Sph(center, static_cast<Real>(s.radius[i]), firstMaterial + static_cast<int>(s.material[i])));
+        }
+
+        int firstMesh = static_cast<int>(meshes.size());
+        meshes.reserve(meshes.size() + description.meshes.size());
+        for (const auto& mesh : description.meshes) {
+            meshes.push_back(TriangleMeshT<Real>(mesh));
+        }
+
+        instances.reserve(instances.size() + description.instances.size());
+        for (const auto& instance : description.instances) {
+            InstanceT<Real> inst;
+            inst.objectToWorld = AffineT<Real>(instance.transform);
+            inst.worldToObject = AffineT<Real>(instance.transform.inverse());
+            inst.mesh = firstMesh + static_cast<int>(instance.mesh);
+            inst.materialIndex = firstMaterial + static_cast<int>(instance.material);
+            instances.push_back(inst);
+        }
+
+        for (const auto& light : description.lights) {
+            addLight(light);
+        }
+    }
+
+    // Построение BVH сфер и раскладка сфер в порядке ее листьев
+    void buildSphereAcceleration() {
+        std::vector<AABBT<Real>> bounds;
+        bounds.reserve(objects.size());
+        for (const auto& obj : objects) {
+            bounds.push_back(obj.bounds());
+        }
+        bvh.build(bounds);
+
+        const std::vector<int>& order = bvh.getPrimIndices();
+        spheres.resize(static_cast<int>(order.size()));
+        sphereSlots.resize(order.size());
+        for (int i = 0; i < static_cast<int>(order.size()); ++i) {
+            const Sph& obj = objects[order[i]];
+            spheres.set(i, obj.center, obj.radius, order[i]);
+            sphereSlots[order[i]] = i;
+        }
+        builtSAHCost = bvh.getSAHCost();
+    }
+
+    // Построение ускоряющей структуры; вызывается один раз после заполнения сцены
+    void buildAcceleration() {
+        buildSphereAcceleration();
+
+        for (auto& mesh : meshes) {
+            mesh.buildAcceleration();
+        }
+
+        // Верхний уровень строится по мировым параллелепипедам готовых сеток
+        std::vector<AABBT<Real>> bounds;
+        bounds.reserve(instances.size());
+        for (const auto& inst : instances) {
+            bounds.push_back(inst.objectToWorld.transformBox(meshes[inst.mesh].getBounds()));
+        }
+        instanceBVH.build(bounds);
+
+        const std::vector<int>& instanceOrder = instanceBVH.getPrimIndices();
+        std::vector<InstanceT<Real>> sorted;
+        sorted.reserve(instances.size());
+        for (int index : instanceOrder) sorted.push_back(instances[index]);
+        instances.swap(sorted);
+    }
+
+    // Перемещение сферы (индекс в порядке добавления); BVH обновляется в updateAcceleration
+    void setSpherePosition(int object, const Vec& center) {
+        Sph& obj = objects[object];
+        obj.center = center;
+        spheres.set(sphereSlots[object], center, obj.radius, object);
+    }
+
+    void setLightPosition(int index, const Vec& position) {
+        lights[index].position = position;
+    }
+
+    // Обновление BVH сфер после перемещений: объемы узлов пересчитываются без изменения
+    // топологии, а если стоимость SAH выросла больше чем вдвое от построенной (сферы
+    // разошлись далеко от исходных мест) - иерархия строится заново. Возвращает true
+    // при перестроении.
+    bool updateAcceleration() {
+        std::vector<AABBT<Real>> leafBounds;
+        leafBounds.reserve(objects.size());
+        for (int index : bvh.getPrimIndices()) {
+            leafBounds.push_back(objects[index].bounds());
+        }
+        bvh.refit(leafBounds);
+        if (bvh.getSAHCost() <= 2 * builtSAHCost) return false;
+        buildSphereAcceleration();
+        return true;
+    }
+
+    // Пересечение с экземплярами в листе instanceBVH; луч переводится в пространство сетки,
+    // направление не нормируется, поэтому параметр t остается мировым
+    bool intersectInstances(const RayR& ray, int first, int count, Real& tLimit, bool anyHit,
+        Hit& hit, RayCounters& counters) const {
+        bool found = false;
+        for (int i = first; i < first + count; ++i) {
+            const InstanceT<Real>& inst = instances[i];
+            RayR local = RayR::withDirection(inst.worldToObject.transformPoint(ray.origin),
+                inst.worldToObject.transformVector(ray.direction));
+            WatertightRayT<Real> wray(local);
+            if (meshes[inst.mesh].intersect(local, wray, tLimit, anyHit, hit.triangle, hit.b1, hit.b2, counters)) {
+                hit.instance = i;
+                found = true;
+                if (anyHit) break;
+            }
+        }
+        return found;
+    }
+
+    void setSimdLevel(SimdLevel level) {
+        simdLevel = level;
+    }
+
+    SimdLevel getSimdLevel() const {
+        return simdLevel;
+    }
+
+    const BVHT<Real>& getBVH() const {
+        return bvh;
+    }
+
+    int getObjectCount() const {
+        return static_cast<int>(objects.size());
+    }
+
+    int getLightCount() const {
+        return static_cast<int>(lights.size());
+    }
+
+    const Lgt& getLight(int index) const {
+        return lights[index];
+    }
+
+    // Интенсивность источника для выборки: сумма каналов диффузного и зеркального излучения
+    double getLightIntensity(int index) const {
+        const Lgt& light = lights[index];
+        return static_cast<double>(light.diffuse.r + light.diffuse.g + light.diffuse.b
+            + light.specular.r + light.specular.g + light.specular.b);
+    }
+
+    // Стохастическая выборка источников: samples источников на точку вместо всех
+    void setLightSamples(int samples) {
+        lightSamples = std::max(0, samples);
+    }
+
+    int getLightSamples() const {
+        return lightSamples;
+    }
+
+    void setShadingModel(ShadingModel model) {
+        shadingModel = model;
+    }
+
+    ShadingModel getShadingModel() const {
+        return shadingModel;
+    }
+
+    int getSpecularBits() const {
+        return specularBits;
+    }
+
+    // Проверка, находится ли точка в тени относительно источника света lightIndex.
+    // lightDir - нормированное направление на источник, distanceToLight - расстояние до него.
+    bool isInShadow(const Vec& point, const Vec& lightDir, Real distanceToLight, int lightIndex, ThreadContext& context) const {
+        RayR shadowRay = RayR::withUnitDirection(point + lightDir * Real(0.001), lightDir); // Смещение для избежания самопересечения
+        RayCounters& counters = context.counters;
+        StatsTimer timer(counters.shadowNs);
+        FONGA_COUNT(counters.shadowRays++);
+
+        // Сначала - объект, заслонивший этот источник для предыдущего пикселя
+        int& lastOccluder = context.shadowCache.lastOccluder(lightIndex);
+        Real t;
+        Real a = shadowRay.direction.dot(shadowRay.direction);
+        if (lastOccluder >= 0) {
+            FONGA_COUNT(counters.sphereTests++);
+            if (spheres.intersect(lastOccluder, shadowRay, a, t) && t < distanceToLight) {
+                FONGA_COUNT(context.shadowCache.cacheHits++);
+                return true;
+            }
+        }
+
+        // Достаточно найти любое препятствие ближе источника света
+        Real tMax = distanceToLight;
+        int occluder = -1;
+        bool blocked = bvh.traverse(shadowRay, tMax, true, [&](int first, int count, Real& tLimit) {
+            FONGA_COUNT(counters.sphereTests += count);
+            occluder = spheres.intersectRange(simdLevel, first, count, shadowRay, tLimit, t);
+            return occluder >= 0;
+        });
+        if (blocked) {
+            lastOccluder = occluder;
+            return true;
+        }
+
+        // Кэш хранит только сферы: заслонившая сетка его сбрасывает
+        if (!instances.empty()) {
+            Hit hit;
+            if (instanceBVH.traverse(shadowRay, tMax, true, [&](int first, int count, Real& tLimit) {
+                return intersectInstances(shadowRay, first, count, tLimit, true, hit, counters);
+            })) {
+                lastOccluder = -1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Нормированное направление и расстояние от точки до источника lightIndex
+    void getLightDirection(const Vec& point, int lightIndex, Vec& lightDir, Real& distanceToLight) const {
+        Vec toLight = lights[lightIndex].position - point;
+        distanceToLight = toLight.length();
+        lightDir = distanceToLight == 0 ? toLight
+            : Vec(toLight.x / distanceToLight, toLight.y / distanceToLight, toLight.z / distanceToLight);
+    }
+
+    // Фоновая составляющая источника (всегда присутствует)
+    void addAmbient(Col& result, const Mat& material, int lightIndex) const {
+        Col ambient = material.ambient * lights[lightIndex].ambient;
+        result = result + ambient;
+    }
+
+    // Фоновые составляющие всех источников сразу (при отборе источников фон не отсекается)
+    void addTotalAmbient(Col& result, const Mat& material) const {
+        result = result + material.ambient * totalAmbient;
+    }
+
+    // Основание степени быстрых моделей без корней. Фонг: косинус между отраженным вектором и
+    // направлением на наблюдателя (отражение единичного вектора от единичной нормали уже
+    // единичное, нормирование лишнее). Блинн-Фонг: квадрат косинуса между нормалью и
+    // полувектором L + V, который не нормируется, а делится на свою длину в квадрате.
+    Real specularBase(const Vec& normal, const Vec& viewDir, const Vec& lightDir) const {
+        if (shadingModel == ShadingModel::Blinn) {
+            Vec half = lightDir + viewDir;
+            Real cosine = normal.dot(half);
+            Real length2 = half.dot(half);
+            return cosine > 0 && length2 > 0 ? cosine * cosine / length2 : Real(0);
+        }
+        Vec reflectDir = lightDir * Real(-1) + normal * (2 * normal.dot(lightDir));
+        return std::max(Real(0), reflectDir.dot(viewDir));
+    }
+
+    // Степень основания быстрой модели: двоичным возведением при целом показателе, иначе std::pow
+    Real specularPower(Real base, const Mat& material) const {
+        bool blinn = shadingModel == ShadingModel::Blinn;
+        int exponent = material.getFastExponent(blinn);
+        return exponent >= 0 ? powInteger(base, exponent) : std::pow(base, material.getSpecularExponent(blinn));
+    }
+
+    // Зеркальный множитель источника. Расхождение с точной моделью на встроенной сцене
+    // (--compare-shading, 800x600, целый блеск): быстрая - не больше 1/255 в канале (нет
+    // нормирования отраженного вектора), Блинн-Фонг - другая форма блика: до 56/255 на краях
+    // вытянутых бликов пола при скользящих углах, в среднем 0.05/255
+    Real specularFactor(const Vec& normal, const Vec& viewDir, const Vec& lightDir, const Mat& material) const {
+        if (shadingModel != ShadingModel::Exact) {
+            return specularPower(specularBase(normal, viewDir, lightDir), material);
+        }
+        Vec reflectDir = (lightDir * Real(-1) + normal * (2 * normal.dot(lightDir))).normalize();
+        return std::pow(std::max(Real(0), reflectDir.dot(viewDir)), material.shininess);
+    }
+
+    // Диффузная и зеркальная (с множителем spec) составляющие незатененного источника; scale -
+    // ослабление и вес выборки (при 1 умножения нет, и результат совпадает с прежним побитово)
+    void addDirectSpecular(Col& result, const Vec& normal, const Vec& lightDir, const Mat& material, int lightIndex,
+        Real spec, Real scale) const {
+        const Lgt& light = lights[lightIndex];
+
+        // Диффузная составляющая
+        Real diff = std::max(Real(0), normal.dot(lightDir));
+        Col diffuse = material.diffuse * light.diffuse * diff;
+        if (scale != 1) diffuse = diffuse * scale;
+        result = result + diffuse;
+
+        // Зеркальная составляющая
+        Col specular = material.specular * light.specular * spec;
+        if (scale != 1) specular = specular * scale;
+        result = result + specular;
+    }
+
+    void addDirect(Col& result, const Vec& normal, const Vec& viewDir, const Vec& lightDir, const Mat& material, int lightIndex,
+        Real scale = 1) const {
+        addDirectSpecular(result, normal, lightDir, material, lightIndex, specularFactor(normal, viewDir, lightDir, material), scale);
+    }
+
+    // Обход источников списка, освещающих точку: visit(lightIndex, lightDir, distance, scale).
+    // Без выборки (или если кандидатов не больше lightSamples) - все источники списка;
+    // иначе lightSamples источников с возвращением, с вероятностью p по интенсивности и
+    // весом 1 / (lightSamples * p), так что среднее не меняется. Источники, до которых
+    // дальше радиуса влияния, пропускаются; scale включает их ослабление.
+    template <typename LightVisitor>
+    void forEachSelectedLight(const Vec& point, const LightList& list, uint32_t seed, LightVisitor visit) const {
+        auto visitLight = [&](int lightIndex, Real weight) {
+            Vec lightDir;
+            Real distanceToLight;
+            getLightDirection(point, lightIndex, lightDir, distanceToLight);
+            const Lgt& light = lights[lightIndex];
+            if (!light.reaches(distanceToLight)) return;
+            Real attenuation = light.attenuation(distanceToLight);
+            visit(lightIndex, lightDir, distanceToLight, weight == 1 ? attenuation : weight * attenuation);
+        };
+
+        int candidates = list.size();
+        if (lightSamples == 0 || candidates <= lightSamples) {
+            for (int k = 0; k < candidates; ++k) visitLight(list.indices[k], 1);
+            return;
+        }
+        double total = list.cdf.back();
+        if (total <= 0) return;
+        for (int s = 0; s < lightSamples; ++s) {
+            double u = randomUnit<double>(hashSeed(seed, LIGHT_SEED + static_cast<uint32_t>(s))) * total;
+            int k = static_cast<int>(std::upper_bound(list.cdf.begin(), list.cdf.end(), u) - list.cdf.begin());
+            k = std::min(k, candidates - 1);
+            double probability = (list.cdf[k] - (k > 0 ? list.cdf[k - 1] : 0.0)) / total;
+            visitLight(list.indices[k], static_cast<Real>(1.0 / (lightSamples * probability)));
+        }
+    }
+
+    // Расчет цвета в точке с учетом освещения Фонга и теней. Без списка lights освещают все
+    // источники; со списком - отобранные forEachSelectedLight (seed - для выборки), а фон
+    // берется от всех источников сразу.
+    Col calculateColor(const Vec& point, const Vec& normal, const Vec& viewDir, const Mat& material, ThreadContext& context,
+        const LightList* lightList = nullptr, uint32_t seed = 0) const {
+        Col result(0, 0, 0);
+
+        if (lightList) {
+            addTotalAmbient(result, material);
+            forEachSelectedLight(point, *lightList, seed, [&](int lightIndex, const Vec& lightDir, Real distanceToLight, Real scale) {
+                if (!isInShadow(point, lightDir, distanceToLight, lightIndex, context)) {
+                    addDirect(result, normal, viewDir, lightDir, material, lightIndex, scale);
+                }
+            });
+            return result.clamp();
+        }
+
+        for (int lightIndex = 0; lightIndex < static_cast<int>(lights.size()); ++lightIndex) {
+            Vec lightDir;
+            Real distanceToLight;
+            getLightDirection(point, lightIndex, lightDir, distanceToLight);
+            addAmbient(result, material, lightIndex);
+
+            // Источник не достает до точки или она в тени: только фоновая составляющая
+            const Lgt& light = lights[lightIndex];
+            if (!light.reaches(distanceToLight) || isInShadow(point, lightDir, distanceToLight, lightIndex, context)) {
+                continue;
+            }
+            addDirect(result, normal, viewDir, lightDir, material, lightIndex, light.attenuation(distanceToLight));
+        }
+
+        return result.clamp();
+    }
+
+    // Вторичные лучи в точке попадания: отражение с весом reflectivity и преломление с весом
+    // transparency, поделенным с отражением по Френелю (приближение Шлика); при полном
+    // внутреннем отражении весь transparency уходит в отражение. Возвращает число лучей (до двух),
+    // localWeight - вес локального освещения. Тени от прозрачных объектов остаются полными.
+    int scatter(const RayR& ray, const Vec& point, const Vec& normal, const Mat& material,
+        Vec origins[2], Vec directions[2], Real weights[2], Real& localWeight) const {
+        localWeight = 1;
+        if (!material.isTracing()) return 0;
+        localWeight = 1 - material.reflectivity - material.transparency;
+
+        // Нормаль навстречу лучу; луч изнутри сферы выходит из материала
+        Real cosIncident = -normal.dot(ray.direction);
+        bool entering = cosIncident > 0;
+        Vec n = entering ? normal : normal * Real(-1);
+        cosIncident = std::abs(cosIncident);
+
+        Real reflectWeight = material.reflectivity;
+        int count = 0;
+        if (material.transparency > 0) {
+            Real eta = entering ? 1 / material.refractiveIndex : material.refractiveIndex;
+            Real k = 1 - eta * eta * (1 - cosIncident * cosIncident);
+            if (k < 0) {
+                reflectWeight += material.transparency;
+            }
+            else {
+                Real cosRefracted = std::sqrt(k);
+                Real r0 = (1 - material.refractiveIndex) / (1 + material.refractiveIndex);
+                r0 = r0 * r0;
+                // Шлик берет косинус угла в оптически менее плотной среде
+                Real c = 1 - (entering ? cosIncident : cosRefracted);
+                Real fresnel = r0 + (1 - r0) * c * c * c * c * c;
+                reflectWeight += material.transparency * fresnel;
+
+                Vec refracted = (ray.direction * eta + n * (eta * cosIncident - cosRefracted)).normalize();
+                directions[count] = refracted;
+                weights[count] = material.transparency * (1 - fresnel);
+                count++;
+            }
+        }
+        if (reflectWeight > 0) {
+            // Отраженный луч всегда первый
+            if (count == 1) {
+                directions[1] = directions[0];
+                weights[1] = weights[0];
+            }
+            directions[0] = (ray.direction + n * (2 * cosIncident)).normalize();
+            weights[0] = reflectWeight;
+            count++;
+        }
+        for (int i = 0; i < count; ++i) {
+            origins[i] = point + directions[i] * Real(0.001);   // Смещение, как у теневых лучей
+        }
+        return count;
+    }
+
+    // Поиск ближайшего пересечения луча с объектами сцены
+    bool findClosestIntersection(const RayR& ray, Hit& hit, RayCounters& counters) const {
+        Real closestT = std::numeric_limits<Real>::max();
+        int closestIndex = -1;
+        StatsTimer timer(counters.intersectionNs);
+
+        bvh.traverse(ray, closestT, false, [&](int first, int count, Real& tLimit) {
+            FONGA_COUNT(counters.sphereTests += count);
+            int found = spheres.intersectRange(simdLevel, first, count, ray, tLimit, tLimit);
+            if (found < 0) return false;
+            closestIndex = spheres.objectIndex[found];
+            return true;
+        });
+
+        hit.object = closestIndex;
+        hit.instance = -1;
+
+        // Сетки проверяются с уже найденным расстоянием до ближайшей сферы
+        if (!instances.empty() && instanceBVH.traverse(ray, closestT, false, [&](int first, int count, Real& tLimit) {
+            return intersectInstances(ray, first, count, tLimit, false, hit, counters);
+        })) {
+            hit.object = -1;
+        }
+
+        hit.t = closestT;
+        return hit.object >= 0 || hit.instance >= 0;
+    }
+
+    // Точка и нормаль для найденного пересечения. Сетки могут быть открытыми поверхностями,
+    // поэтому их нормаль разворачивается навстречу лучу.
+    void resolveHit(const RayR& ray, const Hit& hit, Vec& hitPoint, Vec& normal) const {
+        hitPoint = ray.pointAt(hit.t);
+        if (hit.instance < 0) {
+            normal = objects[hit.object].getNormal(hitPoint);
+            return;
+        }
+        // Нормаль переводится обратной транспонированной матрицей
+        const InstanceT<Real>& inst = instances[hit.instance];
+        normal = inst.worldToObject.transformNormalTransposed(meshes[inst.mesh].getNormal(hit.triangle, hit.b1, hit.b2)).normalize();
+        if (normal.dot(ray.direction) > 0) normal = normal * Real(-1);
+    }
+
+    const Mat& getMaterial(const Hit& hit) const {
+        int material = hit.instance < 0 ? objects[hit.object].materialIndex : instances[hit.instance].materialIndex;
+        return materials[material];
+    }
+
+    int getMeshCount() const {
+        return static_cast<int>(meshes.size());
+    }
+
+    int getInstanceCount() const {
+        return static_cast<int>(instances.size());
+    }
+
+    // Число уникальных треугольников (в памяти) и размещенных в сцене
+    int getTriangleCount() const {
+        int count = 0;
+        for (const auto& mesh : meshes) count += mesh.getTriangleCount();
+        return count;
+    }
+
+    long long getInstancedTriangleCount() const {
+        long long count = 0;
+        for (const auto& inst : instances) count += meshes[inst.mesh].getTriangleCount();
+        return count;
+    }
+
+    const TriangleMeshT<Real>& getMesh(int index) const {
+        return meshes[index];
+    }
+
+    const BVHT<Real>& getInstanceBVH() const {
+        return instanceBVH;
+    }
+};
+
+// Прямоугольный блок изображения [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Чередование битов координат для кода Мортона (Z-порядок)
+uint32_t mortonCode(uint32_t x, uint32_t y) {
+    uint32_t code = 0;
+    for (int bit = 0; bit < 16; ++bit) {
+        code |= ((x >> bit) & 1u) << (2 * bit);
+        code |= ((y >> bit) & 1u) << (2 * bit + 1);
+    }
+    return code;
+}
+
+// Планировщик тайлов с очередями на поток и кражей работы.
+// Тайлы упорядочены по кривой Мортона и поровну разделены между потоками.
+// Очередь потока - диапазон [head, tail) в одном 64-битном атомике: владелец берет
+// тайлы с головы, остальные потоки крадут половину остатка с хвоста; все через CAS, без блокировок.
+class TileScheduler {
+private:
+    // Дополнение до строки кэша, чтобы очереди соседних потоков не делили одну линию
+    // (alignas для new[] гарантирован только с C++17)
+    struct WorkQueue {
+        std::atomic<uint64_t> range;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::vector<Tile> tiles;
+    std::unique_ptr<WorkQueue[]> queues;
+    int queueCount = 0;
+    char padding[64];
+    std::atomic<int> completed;
+    std::atomic<int> steals;
+
+    static uint64_t pack(uint32_t head, uint32_t tail) {
+        return (static_cast<uint64_t>(head) << 32) | tail;
+    }
+
+    static uint32_t headOf(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+    static uint32_t tailOf(uint64_t range) { return static_cast<uint32_t>(range); }
+
+    // Взять тайл из головы собственной очереди
+    bool pop(int thread, int& tileIndex) {
+        std::atomic<uint64_t>& range = queues[thread].range;
+        uint64_t current = range.load(std::memory_order_acquire);
+        while (headOf(current) < tailOf(current)) {
+            if (range.compare_exchange_weak(current, pack(headOf(current) + 1, tailOf(current)), std::memory_order_acq_rel)) {
+                tileIndex = static_cast<int>(headOf(current));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Украсть половину оставшихся тайлов у другого потока и переложить их в свою очередь
+    bool steal(int thread) {
+        for (int offset = 1; offset < queueCount; ++offset) {
+            std::atomic<uint64_t>& victim = queues[(thread + offset) % queueCount].range;
+            uint64_t current = victim.load(std::memory_order_acquire);
+            while (headOf(current) < tailOf(current)) {
+                uint32_t head = headOf(current);
+                uint32_t tail = tailOf(current);
+                uint32_t take = (tail - head + 1) / 2;
+                if (victim.compare_exchange_weak(current, pack(head, tail - take), std::memory_order_acq_rel)) {
+                    // Своя очередь пуста, и пустую очередь никто не изменяет - достаточно записи
+                    queues[thread].range.store(pack(tail - take, tail), std::memory_order_release);
+                    steals.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+public:
+    // Тайлы покрывают строки [y0, y1) изображения шириной width
+    TileScheduler(int width, int y0, int y1, int tileSize, int threadCount) : completed(0), steals(0) {
+        int tilesX = (width + tileSize - 1) / tileSize;
+        int tilesY = (y1 - y0 + tileSize - 1) / tileSize;
+
+        std::vector<std::pair<uint32_t, Tile>> ordered;
+        ordered.reserve(static_cast<size_t>(tilesX) * tilesY);
+        for (int ty = 0; ty < tilesY; ++ty) {
+            for (int tx = 0; tx < tilesX; ++tx) {
+                Tile tile = { tx * tileSize, y0 + ty * tileSize,
+                    std::min(width, (tx + 1) * tileSize), std::min(y1, y0 + (ty + 1) * tileSize) };
+                ordered.push_back(std::make_pair(mortonCode(tx, ty), tile));
+            }
+        }
+        std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint32_t, Tile>& a, const std::pair<uint32_t, Tile>& b) {
+            return a.first < b.first;
+        });
+
+        tiles.reserve(ordered.size());
+        for (const auto& entry : ordered) {
+            tiles.push_back(entry.second);
+        }
+
+        // Каждому потоку - непрерывный участок кривой, соседние тайлы остаются в одном потоке
+        queueCount = std::max(1, threadCount);
+        queues.reset(new WorkQueue[queueCount]);
+        int tileCount = static_cast<int>(tiles.size());
+        for (int t = 0; t < queueCount; ++t) {
+            uint32_t head = static_cast<uint32_t>(static_cast<int64_t>(tileCount) * t / queueCount);
+            uint32_t tail = static_cast<uint32_t>(static_cast<int64_t>(tileCount) * (t + 1) / queueCount);
+            queues[t].range.store(pack(head, tail), std::memory_order_relaxed);
+        }
+    }
+
+    // Получить следующий тайл для потока; false - работа закончилась
+    bool next(int thread, Tile& tile) {
+        int tileIndex;
+        while (true) {
+            if (pop(thread, tileIndex)) {
+                tile = tiles[tileIndex];
+                return true;
+            }
+            if (!steal(thread)) return false;
+        }
+    }
+
+    // Отметить тайл выполненным; возвращает общее число выполненных тайлов
+    int complete() {
+        return completed.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    int getTileCount() const { return static_cast<int>(tiles.size()); }
+    int getQueueCount() const { return queueCount; }
+    int getStealCount() const { return steals.load(std::memory_order_relaxed); }
+};
+
+// Запись 32-битного числа в little-endian порядке
+void writeLE32(unsigned char* dst, uint32_t value) {
+    dst[0] = static_cast<unsigned char>(value & 0xFF);
+    dst[1] = static_cast<unsigned char>((value >> 8) & 0xFF);
+    dst[2] = static_cast<unsigned char>((value >> 16) & 0xFF);
+    dst[3] = static_cast<unsigned char>((value >> 24) & 0xFF);
+}
+
+// Заголовки BMP: BITMAPFILEHEADER (14 байт) + BITMAPINFOHEADER (40 байт).
+// Положительная высота - строки в файле идут снизу вверх.
+void writeBMPHeader(unsigned char* header, int width, int height, size_t rowStride) {
+    const uint32_t dataOffset = 54;
+    const uint32_t imageSize = static_cast<uint32_t>(rowStride * height);
+    std::memset(header, 0, 54);
+
+    // BITMAPFILEHEADER
+    header[0] = 'B';
+    header[1] = 'M';                                   // Сигнатура
+    writeLE32(header + 2, dataOffset + imageSize);     // Размер файла
+    writeLE32(header + 10, dataOffset);                // Смещение данных
+
+    // BITMAPINFOHEADER
+    writeLE32(header + 14, 40);                        // Размер заголовка
+    writeLE32(header + 18, static_cast<uint32_t>(width));
+    writeLE32(header + 22, static_cast<uint32_t>(height));
+    header[26] = 1;                                    // Количество плоскостей
+    header[28] = 24;                                   // Бит на пиксель
+    writeLE32(header + 34, imageSize);                 // Размер изображения
+    writeLE32(header + 38, 2835);                      // Разрешение по горизонтали (72 dpi)
+    writeLE32(header + 42, 2835);                      // Разрешение по вертикали
+}
+
+// Счетчики планировщика за один или несколько проходов рендеринга
+struct TileStats {
+    int tiles = 0;
+    int steals = 0;
+};
+
+// Формат выходного файла для потоковой записи
+enum class ImageFormat {
+    PPM,
+    BMP
+};
+
+// Файл изображения, заполняемый полосами строк: заголовок пишется при открытии,
+// каждая готовая полоса - одной записью на свое место в файле
+class BandImageFile {
+private:
+    std::ofstream file;
+    std::string name;
+    ImageFormat format;
+    int height = 0;
+    size_t rowStride = 0;
+    std::streamoff dataOffset = 0;
+
+public:
+    bool open(const std::string& filename, ImageFormat fileFormat, int width, int imageHeight) {
+        name = filename;
+        format = fileFormat;
+        height = imageHeight;
+        file.open(filename, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open file: " << filename << std::endl;
+            return false;
+        }
+
+        if (format == ImageFormat::PPM) {
+            rowStride = 3 * static_cast<size_t>(width);
+            file << "P6\n" << width << " " << height << "\n255\n";
+            dataOffset = file.tellp();
+        }
+        else {
+            rowStride = (3 * static_cast<size_t>(width) + 3) & ~static_cast<size_t>(3);
+            if (rowStride * height > 0xFFFFFFFFull - 54) {
+                std::cerr << "Image too large for BMP: " << filename << std::endl;
+                file.close();
+                return false;
+            }
+            unsigned char header[54];
+            writeBMPHeader(header, width, height, rowStride);
+            file.write(reinterpret_cast<const char*>(header), sizeof(header));
+            dataOffset = sizeof(header);
+        }
+        return true;
+    }
+
+    bool isOpen() const { return file.is_open(); }
+    const std::string& getName() const { return name; }
+    ImageFormat getFormat() const { return format; }
+    size_t getRowStride() const { return rowStride; }
+
+    // Запись строк [y0, y0 + rows), уже уложенных в порядке файла (для BMP - снизу вверх)
+    void writeBand(int y0, int rows, const unsigned char* data) {
+        int firstFileRow = format == ImageFormat::PPM ? y0 : height - (y0 + rows);
+        file.seekp(dataOffset + static_cast<std::streamoff>(rowStride) * firstFileRow);
+        file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(rowStride * rows));
+    }
+
+    void close() {
+        file.close();
+    }
+};
+
+// Хранение кадра. Full - цвет в точности рендеринга (эталонный вывод, 24 байта на пиксель
+// в double); остальные форматы компактные: Float - 12 байт, Half - 6 байт (ошибка до
+// половины шага 2^-11 на [0.5, 1], на квантование влияет только у границ уровней),
+// RGBA8 - 4 байта, уже ограниченный [0, 1] и квантованный так же, как при сохранении.
+enum class FramebufferFormat {
+    Full,
+    Float,
+    Half,
+    RGBA8
+};
+
+const char* framebufferFormatName(FramebufferFormat format) {
+    switch (format) {
+    case FramebufferFormat::Float: return "float RGB";
+    case FramebufferFormat::Half: return "half RGB";
+    case FramebufferFormat::RGBA8: return "RGBA8";
+    default: return "full";
+    }
+}
+
+// float -> IEEE 754 half с округлением к ближайшему четному (переполнение дает бесконечность)
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    bits &= 0x7FFFFFFFu;
+
+    uint32_t half;
+    if (bits >= 0x47800000u) {
+        // Бесконечность, NaN или число не меньше 2^16
+        half = bits > 0x7F800000u ? 0x7E00u : 0x7C00u;
+    }
+    else if (bits < 0x38800000u) {
+        // Денормализованное half или ноль: сложение с 0.5 выравнивает 10 бит мантиссы по
+        // младшим разрядам float, округление делает само сложение
+        const uint32_t magicBits = (127 - 15 + 23 - 10 + 1) << 23;
+        float magic, aligned;
+        std::memcpy(&magic, &magicBits, sizeof(magic));
+        std::memcpy(&aligned, &bits, sizeof(aligned));
+        aligned += magic;
+        std::memcpy(&half, &aligned, sizeof(half));
+        half -= magicBits;
+    }
+    else {
+        // Смена смещения порядка и округление отбрасываемых 13 бит к четному
+        uint32_t odd = (bits >> 13) & 1u;
+        bits += (static_cast<uint32_t>(15 - 127) << 23) + 0xFFFu + odd;
+        half = bits >> 13;
+    }
+    return static_cast<uint16_t>(half | sign);
+}
+
+inline float halfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+    uint32_t exponent = (half >> 10) & 0x1Fu;
+    uint32_t mantissa = half & 0x3FFu;
+    uint32_t bits;
+    if (exponent == 0) {
+        float value = mantissa * (1.0f / 16777216.0f);     // 2^-24
+        std::memcpy(&bits, &value, sizeof(bits));
+        bits |= sign;
+    }
+    else if (exponent == 31) {
+        bits = sign | 0x7F800000u | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Квантование count значений в [0, 255] с отбрасыванием дробной части (как static_cast при
+// сохранении), значения вне [0, 1] и NaN ограничиваются. SSE2 обрабатывает 16 значений за шаг.
+inline void quantizeFloats(const float* src, size_t count, bool simd, unsigned char* dst) {
+    size_t i = 0;
+#if defined(FONGA_X86)
+    if (simd) {
+        const __m128 scale = _mm_set1_ps(255.0f);
+        const __m128 zero = _mm_setzero_ps();
+        for (; i + 16 <= count; i += 16) {
+            __m128i q[4];
+            for (int k = 0; k < 4; ++k) {
+                __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i + 4 * k), scale);
+                q[k] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, zero), scale));
+            }
+            __m128i packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+        }
+    }
+#else
+    (void)simd;
+#endif
+    for (; i < count; ++i) {
+        float v = src[i] * 255.0f;
+        dst[i] = static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, v)));
+    }
+}
+
+// Компактный буфер кадра (форматы Float, Half, RGBA8). Пиксели адресуются по индексу
+// и переносятся участками строк: рендеринг пишет тайл через буфер потока в точности Real.
+class CompactFramebuffer {
+private:
+    FramebufferFormat format = FramebufferFormat::Float;
+    std::vector<float> floats;          // Float: r, g, b
+    std::vector<uint16_t> halves;       // Half: r, g, b
+    std::vector<uint32_t> packed;       // RGBA8: r в младшем байте, альфа 255
+
+    static const size_t CHUNK = 256;    // Пикселей на промежуточный float-буфер при квантовании
+
+public:
+    void assign(FramebufferFormat bufferFormat, size_t pixels) {
+        format = bufferFormat;
+        std::vector<float>().swap(floats);
+        std::vector<uint16_t>().swap(halves);
+        std::vector<uint32_t>().swap(packed);
+        if (format == FramebufferFormat::Float) floats.assign(3 * pixels, 0.0f);
+        else if (format == FramebufferFormat::Half) halves.assign(3 * pixels, 0);
+        else packed.assign(pixels, 0xFF000000u);
+    }
+
+    void release() {
+        assign(format, 0);
+    }
+
+    size_t getBytes() const {
+        return floats.size() * sizeof(float) + halves.size() * sizeof(uint16_t) + packed.size() * sizeof(uint32_t);
+    }
+
+    // Запись count пикселей начиная с index
+    template <typename Real>
+    void store(size_t index, const ColorT<Real>* src, int count) {
+        for (int i = 0; i < count; ++i) {
+            const ColorT<Real>& c = src[i];
+            size_t p = index + i;
+            if (format == FramebufferFormat::Float) {
+                floats[3 * p + 0] = static_cast<float>(c.r);
+                floats[3 * p + 1] = static_cast<float>(c.g);
+                floats[3 * p + 2] = static_cast<float>(c.b);
+            }
+            else if (format == FramebufferFormat::Half) {
+                halves[3 * p + 0] = floatToHalf(static_cast<float>(c.r));
+                halves[3 * p + 1] = floatToHalf(static_cast<float>(c.g));
+                halves[3 * p + 2] = floatToHalf(static_cast<float>(c.b));
+            }
+            else {
+                // Тон-маппинг - ограничение [0, 1], квантование - как при сохранении из Full
+                ColorT<Real> t = c.clamp();
+                uint32_t r = static_cast<uint32_t>(t.r * 255);
+                uint32_t g = static_cast<uint32_t>(t.g * 255);
+                uint32_t b = static_cast<uint32_t>(t.b * 255);
+                packed[p] = r | (g << 8) | (b << 16) | 0xFF000000u;
+            }
+        }
+    }
+
+    // Чтение count пикселей начиная с index. RGBA8 восстанавливается в середину уровня,
+    // чтобы повторная запись прочитанного цвета давала те же байты.
+    template <typename Real>
+    void load(size_t index, ColorT<Real>* dst, int count) const {
+        for (int i = 0; i < count; ++i) {
+            size_t p = index + i;
+            if (format == FramebufferFormat::Float) {
+                dst[i] = ColorT<Real>(floats[3 * p], floats[3 * p + 1], floats[3 * p + 2]);
+            }
+            else if (format == FramebufferFormat::Half) {
+                dst[i] = ColorT<Real>(halfToFloat(halves[3 * p]), halfToFloat(halves[3 * p + 1]), halfToFloat(halves[3 * p + 2]));
+            }
+            else {
+                uint32_t v = packed[p];
+                dst[i] = ColorT<Real>(((v & 0xFF) + Real(0.5)) / 255, (((v >> 8) & 0xFF) + Real(0.5)) / 255,
+                    (((v >> 16) & 0xFF) + Real(0.5)) / 255);
+            }
+        }
+    }
+
+    // 8-битные каналы count пикселей начиная с index; bgr - порядок каналов BMP
+    void quantize(size_t index, int count, bool bgr, bool simd, unsigned char* dst) const {
+        if (format == FramebufferFormat::RGBA8) {
+            for (int i = 0; i < count; ++i) {
+                uint32_t v = packed[index + i];
+                dst[3 * i + 0] = static_cast<unsigned char>(bgr ? v >> 16 : v);
+                dst[3 * i + 1] = static_cast<unsigned char>(v >> 8);
+                dst[3 * i + 2] = static_cast<unsigned char>(bgr ? v : v >> 16);
+            }
+            return;
+        }
+
+        if (format == FramebufferFormat::Float) {
+            quantizeFloats(&floats[3 * index], 3 * static_cast<size_t>(count), simd, dst);
+        }
+        else {
+            float chunk[3 * CHUNK];
+            for (int first = 0; first < count; first += static_cast<int>(CHUNK)) {
+                int n = std::min(count - first, static_cast<int>(CHUNK));
+                const uint16_t* src = &halves[3 * (index + first)];
+                for (int k = 0; k < 3 * n; ++k) chunk[k] = halfToFloat(src[k]);
+                quantizeFloats(chunk, 3 * static_cast<size_t>(n), simd, dst + 3 * first);
+            }
+        }
+        if (bgr) {
+            for (int i = 0; i < count; ++i) std::swap(dst[3 * i], dst[3 * i + 2]);
+        }
+    }
+};
+
+// Размещение пикселей кадра в памяти
+enum class FramebufferLayout {
+    Linear,                             // Строками изображения
+    Tiled                               // Блоками тайлов в порядке Мортона
+};
+
+const char* framebufferLayoutName(FramebufferLayout layout) {
+    return layout == FramebufferLayout::Tiled ? "tiled" : "linear";
+}
+
+// Отображение пикселя буфера кадра в индекс хранения. В раскладке Tiled каждый тайл сетки
+// занимает непрерывный блок tileSize x tileSize (строки тайла подряд, краевые блоки дополнены),
+// а блоки идут в порядке кривой Мортона - том же, в котором планировщик раздает тайлы потокам.
+// Тайлы разных потоков тогда не делят строки кэша (если размер блока кратен 64 байтам),
+// тайл занимает одну-две страницы вместо страницы на строку, а соседние тайлы потока лежат
+// рядом. В линейный порядок кадр переводится отрезками строк один раз - при выводе.
+class FramebufferTiling {
+private:
+    FramebufferLayout layout = FramebufferLayout::Linear;
+    int width = 0;
+    int tileSize = 1;
+    int tilesX = 0;
+    size_t pixelCount = 0;
+    std::vector<uint32_t> blocks;       // Номер блока тайла ty * tilesX + tx
+
+public:
+    // Буфер из rows строк ширины width; сетка тайлов отсчитывается от его первой строки
+    void configure(FramebufferLayout bufferLayout, int bufferWidth, int rows, int size) {
+        layout = bufferLayout;
+        width = bufferWidth;
+        tileSize = std::max(1, size);
+        tilesX = (width + tileSize - 1) / tileSize;
+        blocks.clear();
+        if (layout == FramebufferLayout::Linear) {
+            pixelCount = static_cast<size_t>(width) * rows;
+            return;
+        }
+
+        int tilesY = (rows + tileSize - 1) / tileSize;
+        std::vector<std::pair<uint32_t, uint32_t>> ordered;
+        ordered.reserve(static_cast<size_t>(tilesX) * tilesY);
+        for (int ty = 0; ty < tilesY; ++ty) {
+            for (int tx = 0; tx < tilesX; ++tx) {
+                ordered.push_back(std::make_pair(mortonCode(tx, ty), static_cast<uint32_t>(ty * tilesX + tx)));
+            }
+        }
+        std::sort(ordered.begin(), ordered.end());
+        blocks.resize(ordered.size());
+        for (size_t i = 0; i < ordered.size(); ++i) {
+            blocks[ordered[i].second] = static_cast<uint32_t>(i);
+        }
+        pixelCount = ordered.size() * tileSize * tileSize;
+    }
+
+    FramebufferLayout getLayout() const {
+        return layout;
+    }
+
+    // Размер буфера в пикселях вместе с дополнением краевых блоков
+    size_t getPixelCount() const {
+        return pixelCount;
+    }
+
+    // Индекс пикселя (x, y); y отсчитывается от первой строки буфера
+    size_t index(int x, int y) const {
+        if (layout == FramebufferLayout::Linear) return static_cast<size_t>(y) * width + x;
+        int tx = x / tileSize, ty = y / tileSize;
+        size_t block = blocks[static_cast<size_t>(ty) * tilesX + tx];
+        return (block * tileSize + (y - ty * tileSize)) * tileSize + (x - tx * tileSize);
+    }
+
+    // Шаг между строками тайла, начинающегося со строки y буфера; 0 - тайл пересекает
+    // границу блоков и строки нужно адресовать по отдельности
+    size_t tileStride(int y) const {
+        if (layout == FramebufferLayout::Linear) return static_cast<size_t>(width);
+        return y % tileSize == 0 ? static_cast<size_t>(tileSize) : 0;
+    }
+
+    // Строк в ряду блоков: полосы такой высоты переводятся в линейный порядок независимо
+    int getBandRows() const {
+        return layout == FramebufferLayout::Linear ? 1 : tileSize;
+    }
+
+    // Обход строк [y0, y1) буфера непрерывными в памяти отрезками: visit(y, x0, x1, индекс пикселя x0).
+    // В раскладке Tiled отрезки идут по блокам, чтобы блок в пределах ряда читался подряд.
+    template <typename SegmentVisitor>
+    void forEachSegment(int y0, int y1, SegmentVisitor visit) const {
+        if (layout == FramebufferLayout::Linear) {
+            for (int y = y0; y < y1; ++y) visit(y, 0, width, static_cast<size_t>(y) * width);
+            return;
+        }
+        for (int x0 = 0; x0 < width; x0 += tileSize) {
+            for (int y = y0; y < y1; ++y) visit(y, x0, std::min(width, x0 + tileSize), index(x0, y));
+        }
+    }
+};
+
+// Что потребовалось BVH сфер после перемещения объектов
+enum class BVHUpdate {
+    None,
+    Refit,                              // Пересчет объемов узлов
+    Rebuild                             // Построение заново
+};
+
+// Камера: положение, ортонормированный базис и объектив. По умолчанию стоит в начале
+// координат и смотрит вдоль -z с вертикальным углом обзора 90 градусов; горизонтальный
+// угол следует из соотношения сторон кадра, поэтому пиксели квадратные при любом размере.
+// Тонкая линза (aperture > 0) размывает все, что не лежит на расстоянии focusDistance.
+template <typename Real>
+struct CameraT {
+    Vector3T<Real> position;
+    Vector3T<Real> right = Vector3T<Real>(1, 0, 0);
+    Vector3T<Real> up = Vector3T<Real>(0, 1, 0);
+    Vector3T<Real> forward = Vector3T<Real>(0, 0, -1);
+    Real verticalFov = 90;              // Угол обзора по вертикали, в градусах
+    Real aperture = 0;                  // Радиус линзы; 0 - точечная камера
+    Real focusDistance = 1;             // Расстояние до плоскости резкости вдоль forward
+
+    // Камера в точке position, направленная на target; вертикаль мира - ось y
+    static CameraT lookAt(const Vector3T<Real>& position, const Vector3T<Real>& target) {
+        CameraT camera;
+        camera.setPose(position, target);
+        return camera;
+    }
+
+    // Положение и направление без изменения объектива. Если камера смотрит вертикально,
+    // горизонталью кадра остается ось x.
+    void setPose(const Vector3T<Real>& from, const Vector3T<Real>& target) {
+        position = from;
+        forward = (target - from).normalize();
+        right = forward.cross(Vector3T<Real>(0, 1, 0)).normalize();
+        if (right.dot(right) == 0) right = Vector3T<Real>(1, 0, 0);
+        up = right.cross(forward);
+    }
+
+    // Половина высоты плоскости изображения на расстоянии 1
+    Real getHalfHeight() const {
+        return static_cast<Real>(std::tan(static_cast<double>(verticalFov) * 3.14159265358979323846 / 360.0));
+    }
+
+    // Луч через точку плоскости изображения direction (ненормированную, с единичной проекцией
+    // на forward). Для линзы начало луча - точка диска линзы из seed, а направление проходит
+    // через ту же точку плоскости резкости, что и луч из центра.
+    RayT<Real> generateRay(const Vector3T<Real>& direction, uint32_t seed) const {
+        if (aperture <= 0) return RayT<Real>(position, direction);
+        Real radius = aperture * std::sqrt(randomUnit<Real>(hashSeed(seed, LENS_SEED_U)));
+        Real angle = randomUnit<Real>(hashSeed(seed, LENS_SEED_V)) * Real(2 * 3.14159265358979323846);
+        Vector3T<Real> origin = position + right * (radius * std::cos(angle)) + up * (radius * std::sin(angle));
+        Vector3T<Real> focus = position + direction * focusDistance;
+        return RayT<Real>(origin, focus - origin);
+    }
+
+private:
+    // Значения для hashSeed, отличные от индексов дочерних лучей tracePath
+    static const uint32_t LENS_SEED_U = 0x4C454E53u;
+    static const uint32_t LENS_SEED_V = 0x4C454E54u;
+};
+
+// Волна лучей одной глубины: луч, пиксель тайла, вес пути и зерно случайных чисел
+template <typename Real>
+struct RayWaveT {
+    std::vector<RayT<Real>> rays;
+    std::vector<int> pixels;
+    std::vector<Real> weights;
+    std::vector<uint32_t> seeds;
+
+    int size() const {
+        return static_cast<int>(rays.size());
+    }
+
+    void clear() {
+        rays.clear();
+        pixels.clear();
+        weights.clear();
+        seeds.clear();
+    }
+
+    void push(const RayT<Real>& ray, int pixel, Real weight, uint32_t seed) {
+        rays.push_back(ray);
+        pixels.push_back(pixel);
+        weights.push_back(weight);
+        seeds.push_back(seed);
+    }
+
+    // Октант направления: знаки трех компонент
+    static int octant(const Vector3T<Real>& d) {
+        return (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+    }
+
+    // Устойчивая сортировка подсчетом по октанту направления в out: лучи одного октанта
+    // обходят BVH в одном порядке и идут подряд
+    void sortByOctant(RayWaveT& out) const {
+        int offsets[9] = {};
+        for (const auto& ray : rays) offsets[octant(ray.direction) + 1]++;
+        for (int i = 1; i < 9; ++i) offsets[i] += offsets[i - 1];
+
+        std::vector<int> order(rays.size());
+        for (int i = 0; i < size(); ++i) order[offsets[octant(rays[i].direction)]++] = i;
+        out.clear();
+        for (int i : order) out.push(rays[i], pixels[i], weights[i], seeds[i]);
+    }
+};
+
+// Очереди волнового (wavefront) рендеринга тайла: каждый этап обрабатывает всю волну
+// перед следующим. Массивы переиспользуются между тайлами, по одному набору на поток.
+template <typename Real>
+struct WavefrontQueuesT {
+    RayWaveT<Real> wave;                            // Лучи текущей глубины (первичные - по строкам тайла)
+    RayWaveT<Real> next;                            // Вторичные лучи следующей глубины
+    RayWaveT<Real> sorted;
+    std::vector<ColorT<Real>> colors;               // Накопленные цвета пикселей тайла
+    // Попадания после уплотнения: только лучи, нашедшие объект
+    std::vector<HitRecordT<Real>> hits;
+    std::vector<int> hitRays;                       // Индекс луча волны для попадания
+    std::vector<Vector3T<Real>> points, normals, viewDirs;
+    std::vector<const MaterialT<Real>*> materials;
+    // Теневые лучи по источникам: элемент light * hitCount + hit
+    std::vector<Vector3T<Real>> lightDirs;
+    std::vector<Real> lightDistances;
+    std::vector<unsigned char> visible;
+    // При отборе источников элементы идут по попаданиям: для попадания k - [hitLights[k], hitLights[k + 1])
+    std::vector<int> hitLights;
+    std::vector<int> lightIndices;
+    std::vector<Real> lightScales;
+    // Быстрое затенение: квадраты косинусов и показатели видимых пар, возводимые в степень пакетом
+    std::vector<Real> specularBases, specularExponents, speculars;
+    char padding[64];                               // Заголовки массивов соседних потоков в разных строках кэша
+};
+
+// Класс для рендеринга с использованием OpenMP
+template <typename Real>
+class ParallelRaycasterT {
+private:
+    typedef Vector3T<Real> Vec;
+    typedef ColorT<Real> Col;
+
+    SceneT<Real> scene;
+    CameraT<Real> camera;
+    int width, height;
+    int lensSamples = 8;                           // Точек линзы на пиксель при aperture > 0
+    // Таблицы первичных лучей: направление через центр пикселя (x, y) - это
+    // columnDirections[x] + rowDirections[y]; пересчитываются при смене камеры или размера
+    std::vector<Vec> columnDirections;             // right * screenX(x + 0.5)
+    std::vector<Vec> rowDirections;                // up * screenY(y + 0.5) + forward
+    Real halfWidth = 1, halfHeight = 1;            // Половины плоскости изображения на расстоянии 1
+    Real pixelScaleX = 1, pixelScaleY = 1;         // 2 / width, 2 / height
+    bool lightCulling = false;                     // Списки источников по тайлам из радиусов влияния
+    LightList sceneLights;                         // Все источники: для вторичных лучей и выборки без отсечения
+    int tileSize = 16;
+    std::vector<Col> imageBuffer;                  // Кадр в формате Full
+    FramebufferFormat framebufferFormat = FramebufferFormat::Full;
+    CompactFramebuffer compactBuffer;              // Кадр в компактных форматах
+    FramebufferLayout framebufferLayout = FramebufferLayout::Linear;
+    FramebufferTiling tiling;                      // Раскладка текущего буфера кадра
+    std::vector<std::vector<Col>> tileColors;      // Тайл потока перед записью в буфер не по прямому адресу
+    mutable std::vector<ThreadContext> threadContexts;     // По одному на поток; время вывода пишется и из const-методов
+    std::vector<WavefrontQueuesT<Real>> wavefrontQueues;
+    bool wavefrontEnabled = false;
+    int maxDepth = 4;                              // Наибольшая глубина вторичных лучей
+    int rouletteDepth = 2;                         // Глубина, с которой работает русская рулетка
+    double loadTime = 0.0;                         // Время преобразования описания сцены
+    bool heatmapEnabled = false;
+    std::vector<float> pixelCost;                  // Наносекунды на пиксель для карты стоимости
+
+public:
+    // Буфер выделяется при рендеринге: целиком в renderParallel или на полосу в renderStreaming
+    ParallelRaycasterT(int w, int h, const SceneDescription& description) : width(w), height(h) {
+        double startTime = omp_get_wtime();
+        scene.load(description);
+        loadTime = omp_get_wtime() - startTime;
+        scene.buildAcceleration();
+        updateRayTables();
+        for (int i = 0; i < scene.getLightCount(); ++i) {
+            sceneLights.add(i, scene.getLightIntensity(i));
+        }
+    }
+
+    void printSceneStats() const {
+        double buildTime = scene.getBVH().getBuildTime() + scene.getInstanceBVH().getBuildTime();
+        for (int m = 0; m < scene.getMeshCount(); ++m) {
+            buildTime += scene.getMesh(m).getBVH().getBuildTime();
+        }
+        std::cout << "Scene: " << scene.getObjectCount() << " spheres, " << scene.getTriangleCount() << " triangles in "
+            << scene.getMeshCount() << " meshes, " << scene.getInstanceCount() << " instances ("
+            << scene.getInstancedTriangleCount() << " triangles placed), " << scene.getLightCount() << " lights; "
+            << "converted in " << loadTime * 1000.0 << " ms, BVH built in " << buildTime * 1000.0 << " ms" << std::endl;
+    }
+
+    // Размер стороны тайла для планировщика
+    void setTileSize(int size) {
+        tileSize = std::max(1, size);
+    }
+
+    // Выбор ядра пересечения (по умолчанию - лучшее из доступных процессору)
+    void setSimdLevel(SimdLevel level) {
+        scene.setSimdLevel(level);
+    }
+
+    // Волновой рендеринг тайлов вместо трассировки каждого пикселя до конца
+    void setWavefrontEnabled(bool enabled) {
+        wavefrontEnabled = enabled;
+    }
+
+    bool isWavefrontEnabled() const {
+        return wavefrontEnabled;
+    }
+
+    // Камера в точке position, направленная на target (объектив не меняется)
+    void setCamera(const Vector3& position, const Vector3& target) {
+        camera.setPose(Vec(position), Vec(target));
+        updateRayTables();
+    }
+
+    // Камера в начале координат со взглядом вдоль -z (объектив не меняется)
+    void resetCamera() {
+        CameraT<Real> pose;
+        camera.position = pose.position;
+        camera.right = pose.right;
+        camera.up = pose.up;
+        camera.forward = pose.forward;
+        updateRayTables();
+    }
+
+    // Объектив: вертикальный угол обзора в градусах, радиус линзы (0 - точечная камера),
+    // расстояние до плоскости резкости и число точек линзы на пиксель
+    void setLens(double verticalFov, double aperture, double focusDistance, int samples) {
+        camera.verticalFov = static_cast<Real>(verticalFov);
+        camera.aperture = static_cast<Real>(aperture);
+        camera.focusDistance = static_cast<Real>(focusDistance);
+        lensSamples = std::max(1, samples);
+        updateRayTables();
+    }
+
+    // Отбор источников: culling - списки по тайлам (первичные попадания освещают только
+    // источники, чья сфера влияния пересекает пирамиду видимости тайла), samples > 0 -
+    // стохастическая выборка samples источников на точку по интенсивности
+    void setLightSelection(bool culling, int samples) {
+        lightCulling = culling;
+        scene.setLightSamples(samples);
+    }
+
+    // Модель зеркальной составляющей (по умолчанию - точная)
+    void setShadingModel(ShadingModel model) {
+        scene.setShadingModel(model);
+    }
+
+    // Размер следующих кадров; буфер перевыделяется при рендеринге
+    void setSize(int w, int h) {
+        width = w;
+        height = h;
+        updateRayTables();
+    }
+
+    // Кадр анимации: позиции сфер, источников и камеры из ключей, затем обновление BVH
+    BVHUpdate applyAnimationFrame(const AnimationDescription& animation, int frame) {
+        bool spheresMoved = false;
+        for (const auto& track : animation.tracks) {
+            AnimationDescription::Key key = AnimationDescription::sample(track, frame);
+            switch (track.target) {
+            case AnimationDescription::Target::Sphere:
+                scene.setSpherePosition(static_cast<int>(track.index), Vec(key.position));
+                spheresMoved = true;
+                break;
+            case AnimationDescription::Target::Light:
+                scene.setLightPosition(static_cast<int>(track.index), Vec(key.position));
+                break;
+            case AnimationDescription::Target::Camera:
+                setCamera(key.position, key.lookAt);
+                break;
+            }
+        }
+        if (!spheresMoved) return BVHUpdate::None;
+        return scene.updateAcceleration() ? BVHUpdate::Rebuild : BVHUpdate::Refit;
+    }
+
+    const BVHT<Real>& getBVH() const {
+        return scene.getBVH();
+    }
+
+    // Ограничение вторичных лучей: не глубже depth, с глубины roulette - русская рулетка
+    void setTraceDepth(int depth, int roulette) {
+        maxDepth = std::max(0, std::min(depth, MAX_TRACE_DEPTH));
+        rouletteDepth = std::max(1, roulette);
+    }
+
+    // Сбор карты стоимости пикселей при полном рендеринге (в потоковом режиме недоступна)
+    void setHeatmapEnabled(bool enabled) {
+        heatmapEnabled = enabled;
+    }
+
+    // Формат хранения кадра (Full - в точности рендеринга)
+    void setFramebufferFormat(FramebufferFormat format) {
+        framebufferFormat = format;
+    }
+
+    // Раскладка буфера кадра (Linear - строками изображения)
+    void setFramebufferLayout(FramebufferLayout layout) {
+        framebufferLayout = layout;
+    }
+
+    // Копия кадра в точности рендеринга в порядке строк (для компактных форматов - распакованная)
+    std::vector<Col> getImage() const {
+        if (framebufferFormat == FramebufferFormat::Full && tiling.getLayout() == FramebufferLayout::Linear) return imageBuffer;
+        std::vector<Col> image(static_cast<size_t>(width) * height);
+        loadRows(0, height, image.data());
+        return image;
+    }
+
+    // Вывод статистики построения BVH
+    void printBVHStats() const {
+        printBVHStats("spheres", scene.getBVH(), scene.getObjectCount());
+        for (int m = 0; m < scene.getMeshCount(); ++m) {
+            const TriangleMeshT<Real>& mesh = scene.getMesh(m);
+            printBVHStats("mesh " + std::to_string(m), mesh.getBVH(), mesh.getTriangleCount());
+        }
+        if (scene.getInstanceCount() > 0) {
+            printBVHStats("instances", scene.getInstanceBVH(), scene.getInstanceCount());
+        }
+    }
+
+    void printBVHStats(const std::string& name, const BVHT<Real>& bvh, int primitives) const {
+        std::cout << "BVH (" << name << "): " << primitives << " primitives, "
+            << bvh.getNodeCount() << " nodes (" << bvh.getLeafCount() << " leaves), "
+            << "depth " << bvh.getMaxDepth() << ", "
+            << "built in " << bvh.getBuildTime() * 1000.0 << " ms" << std::endl;
+    }
+
+    // Трассировка пикселя: луч через его центр, с линзой - lensSamples лучей из разных
+    // точек линзы, усредненных до ограничения [0, 1]
+    Col traceRay(int x, int y, ThreadContext& context) {
+        int samples = getLensSamples();
+        Col pixel(0, 0, 0);
+        for (int s = 0; s < samples; ++s) {
+            uint32_t seed = pixelSeed(x, y, static_cast<uint32_t>(s));
+            Col sample(0, 0, 0);
+            FONGA_COUNT(context.counters.primaryRays++);
+            tracePath(pixelRay(x, y, seed), 0, 1, seed, sample, context);
+            pixel = s == 0 ? sample : pixel + sample;
+        }
+        return averageSamples(pixel, samples);
+    }
+
+    // Среднее samples вкладов (sum - их сумма), ограниченное [0, 1]
+    static Col averageSamples(const Col& sum, int samples) {
+        return (samples == 1 ? sum : sum * (Real(1) / samples)).clamp();
+    }
+
+    int getLensSamples() const {
+        return camera.aperture > 0 ? lensSamples : 1;
+    }
+
+    // Зерно случайных чисел пикселя; sample различает подвыборки сглаживания
+    uint32_t pixelSeed(int x, int y, uint32_t sample = 0) const {
+        return hashSeed(static_cast<uint32_t>(y) * static_cast<uint32_t>(width) + static_cast<uint32_t>(x), sample);
+    }
+
+    // Координаты точки плоскости изображения (на расстоянии 1 от камеры) для пиксельных
+    // координат: по вертикали [-halfHeight, halfHeight], по горизонтали - с учетом сторон кадра
+    Real screenX(Real px) const {
+        return (px * pixelScaleX - 1) * halfWidth;
+    }
+
+    Real screenY(Real py) const {
+        return (1 - py * pixelScaleY) * halfHeight;
+    }
+
+    // Пересчет таблиц первичных лучей для текущих камеры и размера кадра
+    void updateRayTables() {
+        halfHeight = camera.getHalfHeight();
+        halfWidth = halfHeight * static_cast<Real>(width) / static_cast<Real>(height);
+        pixelScaleX = Real(2) / static_cast<Real>(width);
+        pixelScaleY = Real(2) / static_cast<Real>(height);
+        columnDirections.resize(width);
+        rowDirections.resize(height);
+        for (int x = 0; x < width; ++x) {
+            columnDirections[x] = camera.right * screenX(x + Real(0.5));
+        }
+        for (int y = 0; y < height; ++y) {
+            rowDirections[y] = camera.up * screenY(y + Real(0.5)) + camera.forward;
+        }
+    }
+
+    // Первичный луч через центр пикселя (x, y) по таблицам; seed выбирает точку линзы
+    RayT<Real> pixelRay(int x, int y, uint32_t seed) const {
+        return camera.generateRay(columnDirections[x] + rowDirections[y], seed);
+    }
+
+    // Первичный луч через произвольную точку (px, py) в пиксельных координатах (подвыборки
+    // сглаживания); через центр пикселя дает то же направление, что и pixelRay
+    RayT<Real> primaryRay(Real px, Real py, uint32_t seed) const {
+        Vec direction = camera.right * screenX(px) + (camera.up * screenY(py) + camera.forward);
+        return camera.generateRay(direction, seed);
+    }
+
+    // Цвет фона, если пересечений нет
+    static Col backgroundColor() {
+        return Col(Color(0.1, 0.1, 0.3));
+    }
+
+    // Вклад с весом пути; для единичного веса цвет не умножается, чтобы изображения
+    // без вторичных лучей не менялись
+    static Col weighted(const Col& color, Real weight) {
+        return weight == 1 ? color : color * weight;
+    }
+
+    // Русская рулетка для вторичного луча глубины depth: с rouletteDepth луч с весом меньше
+    // ROULETTE_WEIGHT продолжается с вероятностью weight / ROULETTE_WEIGHT и получает вес
+    // ROULETTE_WEIGHT. Среднее не меняется, а шум остается только у слабых вкладов.
+    bool survivesRoulette(int depth, uint32_t seed, Real& weight, RayCounters& counters) const {
+        const Real ROULETTE_WEIGHT = Real(0.1);
+        if (depth < rouletteDepth || weight >= ROULETTE_WEIGHT) return true;
+        if (randomUnit<Real>(seed) * ROULETTE_WEIGHT >= weight) {
+            FONGA_COUNT(counters.rouletteTerminated++);
+            (void)counters;
+            return false;
+        }
+        weight = ROULETTE_WEIGHT;
+        return true;
+    }
+
+    // Трассировка луча через точку (px, py) в пиксельных координатах
+    Col traceSample(Real px, Real py, uint32_t seed, ThreadContext& context) {
+        Col pixel(0, 0, 0);
+        FONGA_COUNT(context.counters.primaryRays++);
+        tracePath(primaryRay(px, py, seed), 0, 1, seed, pixel, context);
+        return pixel.clamp();
+    }
+
+    // Добавление к pixel вклада луча глубины depth с весом weight, затем (в глубину)
+    // вкладов его отраженного и преломленного лучей
+    void tracePath(const RayT<Real>& ray, int depth, Real weight, uint32_t seed, Col& pixel, ThreadContext& context) {
+        RayCounters& counters = context.counters;
+        HitRecordT<Real> hit;
+        if (!scene.findClosestIntersection(ray, hit, counters)) {
+            pixel = pixel + weighted(backgroundColor(), weight);
+            return;
+        }
+        FONGA_COUNT(if (depth == 0) counters.hits++);
+
+        Vec origins[2], directions[2];
+        Real weights[2], localWeight;
+        int count;
+        {
+            StatsTimer timer(counters.shadingNs);
+            Vec hitPoint, normal;
+            scene.resolveHit(ray, hit, hitPoint, normal);
+            Vec viewDir = (ray.origin - hitPoint).normalize();
+            const MaterialT<Real>& material = scene.getMaterial(hit);
+            Col local = scene.calculateColor(hitPoint, normal, viewDir, material, context, lightListFor(depth, context), seed);
+            count = scene.scatter(ray, hitPoint, normal, material, origins, directions, weights, localWeight);
+            pixel = pixel + weighted(local, count == 0 ? weight : weight * localWeight);
+        }
+
+        if (depth >= maxDepth) return;
+        for (int i = 0; i < count; ++i) {
+            Real childWeight = weight * weights[i];
+            uint32_t childSeed = hashSeed(seed, static_cast<uint32_t>(i + 1));
+            if (!survivesRoulette(depth + 1, childSeed, childWeight, counters)) continue;
+            FONGA_COUNT(counters.secondaryRays++);
+            FONGA_COUNT(counters.depthRays[depth + 1]++);
+            tracePath(RayT<Real>::withUnitDirection(origins[i], directions[i]), depth + 1, childWeight, childSeed, pixel, context);
+        }
+    }
+
+    // Волновой рендеринг тайла: все первичные лучи, их пересечения, уплотнение попаданий,
+    // все теневые лучи (по источникам, чтобы кэш заслонителя видел лучи одного источника
+    // подряд) и отдельный проход освещения, порождающий волну вторичных лучей следующей
+    // глубины; она сортируется по октантам направления и проходит те же этапы. Вклады
+    // складываются как в tracePath; без вторичных лучей изображение совпадает побитово,
+    // с ними вклады глубже первого отражения суммируются в другом порядке.
+    // pixels - левый верхний пиксель тайла, строки через stride
+    void renderTileWavefront(const Tile& tile, Col* pixels, size_t stride, ThreadContext& context, WavefrontQueuesT<Real>& queues) {
+        RayCounters& counters = context.counters;
+        int tileWidth = tile.x1 - tile.x0;
+        RayWaveT<Real>& wave = queues.wave;
+        RayWaveT<Real>& next = queues.next;
+
+        // 1. Первичные лучи: samples подряд идущих элементов на пиксель (точки линзы)
+        int samples = getLensSamples();
+        wave.clear();
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                for (int s = 0; s < samples; ++s) {
+                    uint32_t seed = pixelSeed(x, y, static_cast<uint32_t>(s));
+                    wave.push(pixelRay(x, y, seed), wave.size(), 1, seed);
+                }
+            }
+        }
+        FONGA_COUNT(counters.primaryRays += wave.size());
+        queues.colors.assign(wave.size(), Col(0, 0, 0));
+
+        for (int depth = 0; wave.size() > 0; ++depth) {
+            if (depth > 0) {
+                FONGA_COUNT(counters.secondaryRays += wave.size());
+                FONGA_COUNT(counters.depthRays[depth] += wave.size());
+                wave.sortByOctant(queues.sorted);
+                std::swap(wave, queues.sorted);
+            }
+
+            // 2. Пересечения; промахи сразу получают цвет фона, попадания уплотняются
+            queues.hits.clear();
+            queues.hitRays.clear();
+            HitRecordT<Real> hit;
+            for (int i = 0; i < wave.size(); ++i) {
+                if (scene.findClosestIntersection(wave.rays[i], hit, counters)) {
+                    queues.hits.push_back(hit);
+                    queues.hitRays.push_back(i);
+                }
+                else {
+                    Col& pixel = queues.colors[wave.pixels[i]];
+                    pixel = pixel + weighted(backgroundColor(), wave.weights[i]);
+                }
+            }
+            int hitCount = static_cast<int>(queues.hits.size());
+            FONGA_COUNT(if (depth == 0) counters.hits += hitCount);
+
+            StatsTimer timer(counters.shadingNs);
+
+            // 3. Точки, нормали и материалы попаданий
+            queues.points.resize(hitCount);
+            queues.normals.resize(hitCount);
+            queues.viewDirs.resize(hitCount);
+            queues.materials.resize(hitCount);
+            for (int k = 0; k < hitCount; ++k) {
+                const RayT<Real>& ray = wave.rays[queues.hitRays[k]];
+                scene.resolveHit(ray, queues.hits[k], queues.points[k], queues.normals[k]);
+                queues.viewDirs[k] = (ray.origin - queues.points[k]).normalize();
+                queues.materials[k] = &scene.getMaterial(queues.hits[k]);
+            }
+
+            // 4. Теневые лучи всех попаданий: без отбора источников - сгруппированные по источникам,
+            // с отбором - по попаданиям в том же порядке, что и в calculateColor
+            const LightList* lightList = lightListFor(depth, context);
+            int lightCount = scene.getLightCount();
+            if (lightList) {
+                queues.hitLights.assign(1, 0);
+                queues.lightIndices.clear();
+                queues.lightDirs.clear();
+                queues.lightDistances.clear();
+                queues.lightScales.clear();
+                queues.visible.clear();
+                for (int k = 0; k < hitCount; ++k) {
+                    const Vec& point = queues.points[k];
+                    scene.forEachSelectedLight(point, *lightList, wave.seeds[queues.hitRays[k]],
+                        [&](int lightIndex, const Vec& lightDir, Real distanceToLight, Real scale) {
+                        queues.lightIndices.push_back(lightIndex);
+                        queues.lightDirs.push_back(lightDir);
+                        queues.lightDistances.push_back(distanceToLight);
+                        queues.lightScales.push_back(scale);
+                        queues.visible.push_back(!scene.isInShadow(point, lightDir, distanceToLight, lightIndex, context));
+                    });
+                    queues.hitLights.push_back(static_cast<int>(queues.lightIndices.size()));
+                }
+            }
+            else {
+                size_t shadowCount = static_cast<size_t>(lightCount) * hitCount;
+                queues.lightDirs.resize(shadowCount);
+                queues.lightDistances.resize(shadowCount);
+                queues.visible.resize(shadowCount);
+                for (int lightIndex = 0; lightIndex < lightCount; ++lightIndex) {
+                    size_t base = static_cast<size_t>(lightIndex) * hitCount;
+                    const LightT<Real>& light = scene.getLight(lightIndex);
+                    for (int k = 0; k < hitCount; ++k) {
+                        scene.getLightDirection(queues.points[k], lightIndex, queues.lightDirs[base + k], queues.lightDistances[base + k]);
+                    }
+                    for (int k = 0; k < hitCount; ++k) {
+                        queues.visible[base + k] = light.reaches(queues.lightDistances[base + k])
+                            && !scene.isInShadow(queues.points[k], queues.lightDirs[base + k], queues.lightDistances[base + k], lightIndex, context);
+                    }
+                }
+            }
+
+            // При быстром затенении степени зеркальных множителей видимых пар считаются одним
+            // векторным пакетом; пары лежат в пакете в том порядке, в каком их обходит этап 5.
+            // Степень с дробным показателем считается сразу и кладется в пакет с показателем 1.
+            bool fastShading = scene.getShadingModel() != ShadingModel::Exact;
+            bool blinn = scene.getShadingModel() == ShadingModel::Blinn;
+            if (fastShading) {
+                queues.specularBases.clear();
+                queues.specularExponents.clear();
+                for (int k = 0; k < hitCount; ++k) {
+                    const MaterialT<Real>& material = *queues.materials[k];
+                    int exponent = material.getFastExponent(blinn);
+                    int first = lightList ? queues.hitLights[k] : 0;
+                    int last = lightList ? queues.hitLights[k + 1] : lightCount;
+                    for (int j = first; j < last; ++j) {
+                        size_t e = lightList ? static_cast<size_t>(j) : static_cast<size_t>(j) * hitCount + k;
+                        if (!queues.visible[e]) continue;
+                        Real base = scene.specularBase(queues.normals[k], queues.viewDirs[k], queues.lightDirs[e]);
+                        queues.specularBases.push_back(exponent >= 0 ? base : scene.specularPower(base, material));
+                        queues.specularExponents.push_back(static_cast<Real>(exponent >= 0 ? exponent : 1));
+                    }
+                }
+                int pairs = static_cast<int>(queues.specularBases.size());
+                queues.speculars.resize(pairs);
+                powIntegerBatch(scene.getSimdLevel(), queues.specularBases.data(), queues.specularExponents.data(), pairs,
+                    scene.getSpecularBits(), queues.speculars.data());
+            }
+            int specularIndex = 0;
+            auto specular = [&](int k, size_t e, const MaterialT<Real>& material) {
+                return fastShading ? queues.speculars[specularIndex++]
+                    : scene.specularFactor(queues.normals[k], queues.viewDirs[k], queues.lightDirs[e], material);
+            };
+
+            // 5. Освещение и вторичные лучи следующей глубины
+            next.clear();
+            for (int k = 0; k < hitCount; ++k) {
+                int i = queues.hitRays[k];
+                const MaterialT<Real>& material = *queues.materials[k];
+                Col result(0, 0, 0);
+                if (lightList) {
+                    scene.addTotalAmbient(result, material);
+                    for (int e = queues.hitLights[k]; e < queues.hitLights[k + 1]; ++e) {
+                        if (queues.visible[e]) {
+                            scene.addDirectSpecular(result, queues.normals[k], queues.lightDirs[e], material,
+                                queues.lightIndices[e], specular(k, e, material), queues.lightScales[e]);
+                        }
+                    }
+                }
+                else {
+                    for (int lightIndex = 0; lightIndex < lightCount; ++lightIndex) {
+                        size_t e = static_cast<size_t>(lightIndex) * hitCount + k;
+                        scene.addAmbient(result, material, lightIndex);
+                        if (queues.visible[e]) {
+                            scene.addDirectSpecular(result, queues.normals[k], queues.lightDirs[e], material, lightIndex,
+                                specular(k, e, material), scene.getLight(lightIndex).attenuation(queues.lightDistances[e]));
+                        }
+                    }
+                }
+
+                Vec origins[2], directions[2];
+                Real weights[2], localWeight;
+                int count = scene.scatter(wave.rays[i], queues.points[k], queues.normals[k], material,
+                    origins, directions, weights, localWeight);
+                Col& pixel = queues.colors[wave.pixels[i]];
+                pixel = pixel + weighted(result.clamp(), count == 0 ? wave.weights[i] : wave.weights[i] * localWeight);
+
+                if (depth >= maxDepth) continue;
+                for (int c = 0; c < count; ++c) {
+                    Real childWeight = wave.weights[i] * weights[c];
+                    uint32_t childSeed = hashSeed(wave.seeds[i], static_cast<uint32_t>(c + 1));
+                    if (survivesRoulette(depth + 1, childSeed, childWeight, counters)) {
+                        next.push(RayT<Real>::withUnitDirection(origins[c], directions[c]), wave.pixels[i], childWeight, childSeed);
+                    }
+                }
+            }
+            std::swap(wave, next);
+        }
+
+        for (int row = 0; row < tile.y1 - tile.y0; ++row) {
+            const Col* src = &queues.colors[static_cast<size_t>(row) * tileWidth * samples];
+            Col* dst = pixels + static_cast<size_t>(row) * stride;
+            for (int x = 0; x < tileWidth; ++x, src += samples) {
+                Col sum = src[0];
+                for (int s = 1; s < samples; ++s) sum = sum + src[s];
+                dst[x] = averageSamples(sum, samples);
+            }
+        }
+    }
+
+    // Параллельный обход тайлов строк [y0, y1): renderTile(tile, thread) заполняет тайл
+    // в буфере, начинающемся со строки y0
+    template <typename TileRenderer>
+    void scheduleTiles(int y0, int y1, bool showProgress, TileStats& stats, TileRenderer renderTile) {
+        int threadCount = omp_get_max_threads();
+        TileScheduler scheduler(width, y0, y1, tileSize, threadCount);
+        int tileCount = scheduler.getTileCount();
+        if (static_cast<int>(threadContexts.size()) < threadCount) {
+            resetThreadContexts(threadCount);
+        }
+
+#pragma omp parallel num_threads(threadCount)
+        {
+            int thread = omp_get_thread_num();
+            Tile tile;
+            while (scheduler.next(thread, tile)) {
+                double tileStart = omp_get_wtime();
+                renderTile(tile, thread);
+
+                // Карта стоимости: время тайла поровну делится между его пикселями
+                // и накапливается по проходам (первый проход и сглаживание)
+                if (!pixelCost.empty()) {
+                    float cost = static_cast<float>((omp_get_wtime() - tileStart) * 1e9
+                        / ((tile.x1 - tile.x0) * (tile.y1 - tile.y0)));
+                    for (int y = tile.y0; y < tile.y1; ++y) {
+                        for (int x = tile.x0; x < tile.x1; ++x) {
+                            pixelCost[static_cast<size_t>(y) * width + x] += cost;
+                        }
+                    }
+                }
+
+                // Вывод прогресса: каждую границу в 10% пересекает ровно один поток
+                int done = scheduler.complete();
+                if (showProgress && done * 10 / tileCount != (done - 1) * 10 / tileCount) {
+                    double progress = (done * 100.0) / tileCount;
+                    std::cout << "Progress: " << progress << "%\n" << std::flush;
+                }
+            }
+        }
+
+        stats.tiles += tileCount;
+        stats.steals += scheduler.getStealCount();
+    }
+
+    // Список источников для попаданий лучей глубины depth; nullptr - все источники без отбора
+    const LightList* lightListFor(int depth, const ThreadContext& context) const {
+        if (!lightCulling && scene.getLightSamples() == 0) return nullptr;
+        return lightCulling && depth == 0 ? &context.tileLights : &sceneLights;
+    }
+
+    // Источники тайла: без радиуса влияния - всегда, с радиусом - если сфера влияния
+    // пересекает пирамиду из камеры через углы тайла. Для тонкой линзы лучи отходят от
+    // пирамиды не дальше aperture * |1 - z / focusDistance| на глубине z, и сферы
+    // расширяются на эту величину.
+    void buildTileLights(const Tile& tile, LightList& list) const {
+        Vec corners[4] = {
+            camera.right * screenX(Real(tile.x0)) + (camera.up * screenY(Real(tile.y0)) + camera.forward),
+            camera.right * screenX(Real(tile.x1)) + (camera.up * screenY(Real(tile.y0)) + camera.forward),
+            camera.right * screenX(Real(tile.x1)) + (camera.up * screenY(Real(tile.y1)) + camera.forward),
+            camera.right * screenX(Real(tile.x0)) + (camera.up * screenY(Real(tile.y1)) + camera.forward)
+        };
+        Vec center = (corners[0] + corners[2]) * Real(0.5);
+        Vec normals[4];
+        for (int i = 0; i < 4; ++i) {
+            normals[i] = corners[i].cross(corners[(i + 1) % 4]).normalize();
+            if (normals[i].dot(center) < 0) normals[i] = normals[i] * Real(-1);
+        }
+
+        list.clear();
+        for (int i = 0; i < scene.getLightCount(); ++i) {
+            const LightT<Real>& light = scene.getLight(i);
+            if (light.range > 0) {
+                Vec offset = light.position - camera.position;
+                Real depth = offset.dot(camera.forward);
+                Real margin = light.range;
+                if (camera.aperture > 0) {
+                    margin += camera.aperture * (1 + std::max(Real(0), depth + light.range) / camera.focusDistance);
+                }
+                bool inside = depth > -margin;
+                for (int p = 0; inside && p < 4; ++p) {
+                    inside = offset.dot(normals[p]) > -margin;
+                }
+                if (!inside) continue;
+            }
+            list.add(i, scene.getLightIntensity(i));
+        }
+        FONGA_COUNT(list.builds++);
+        FONGA_COUNT(list.totalLength += list.size());
+    }
+
+    // Тайл в буфере, начинающемся со строки y0: shade(pixels, stride) заполняет пиксели
+    // тайла (строки через stride). В формате Full пишет прямо в кадр, в компактных (и если
+    // тайл не совпадает с блоком раскладки Tiled) - в тайл потока, который затем
+    // записывается построчно; readCurrent загружает в него текущие цвета.
+    template <typename TileShader>
+    void shadeTile(const Tile& tile, int y0, int thread, bool readCurrent, TileShader shade) {
+        if (lightCulling) buildTileLights(tile, threadContexts[thread].tileLights);
+        size_t stride = tiling.tileStride(tile.y0 - y0);
+        if (framebufferFormat == FramebufferFormat::Full && stride > 0) {
+            shade(&imageBuffer[tiling.index(tile.x0, tile.y0 - y0)], stride);
+            return;
+        }
+        int tileWidth = tile.x1 - tile.x0;
+        Col* pixels = tileColors[thread].data();
+        for (int row = 0; readCurrent && row < tile.y1 - tile.y0; ++row) {
+            loadPixels(tiling.index(tile.x0, tile.y0 - y0 + row), pixels + row * tileWidth, tileWidth);
+        }
+        shade(pixels, static_cast<size_t>(tileWidth));
+        StatsTimer timer(threadContexts[thread].counters.outputNs);
+        for (int row = 0; row < tile.y1 - tile.y0; ++row) {
+            storePixels(tiling.index(tile.x0, tile.y0 - y0 + row), pixels + row * tileWidth, tileWidth);
+        }
+    }
+
+    // Попиксельный обход тайлов строк [y0, y1) в буфере, начинающемся со строки bufferY0:
+    // shadePixel(x, y, current, context) возвращает цвет пикселя
+    template <typename PixelShader>
+    void forEachTile(int y0, int y1, int bufferY0, bool showProgress, TileStats& stats, PixelShader shadePixel) {
+        scheduleTiles(y0, y1, showProgress, stats, [&](const Tile& tile, int thread) {
+            ThreadContext& context = threadContexts[thread];
+            shadeTile(tile, bufferY0, thread, true, [&](Col* pixels, size_t stride) {
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    Col* row = pixels + static_cast<size_t>(y - tile.y0) * stride;
+                    for (int x = tile.x0; x < tile.x1; ++x) {
+                        row[x - tile.x0] = shadePixel(x, y, row[x - tile.x0], context);
+                    }
+                }
+            });
+        });
+    }
+
+    // Параллельный рендеринг строк [y0, y1) в буфер, начинающийся со строки bufferY0
+    // (0 - буфер всего кадра, y0 - буфер полосы)
+    void renderRows(int y0, int y1, int bufferY0, bool showProgress, TileStats& stats) {
+        if (wavefrontEnabled) {
+            scheduleTiles(y0, y1, showProgress, stats, [this, bufferY0](const Tile& tile, int thread) {
+                shadeTile(tile, bufferY0, thread, false, [&](Col* pixels, size_t stride) {
+                    renderTileWavefront(tile, pixels, stride, threadContexts[thread], wavefrontQueues[thread]);
+                });
+            });
+            return;
+        }
+        forEachTile(y0, y1, bufferY0, showProgress, stats, [this](int x, int y, const Col&, ThreadContext& context) {
+            return traceRay(x, y, context);
+        });
+    }
+
+    // Адаптивное сглаживание готового изображения: пиксели, у которых суммарная по каналам
+    // дисперсия цвета в окрестности 3x3 больше threshold, пересчитываются сеткой
+    // gridSize x gridSize лучей. Возвращает количество уточненных пикселей.
+    long long refineAdaptive(int gridSize, double threshold) {
+        double startTime = omp_get_wtime();
+
+        // Окрестности 3x3 читаются из линейной копии кадра: перевод из раскладки и формата
+        // хранения - один раз на пиксель, а не девять
+        std::vector<Col> image = getImage();
+        std::vector<unsigned char> refine(static_cast<size_t>(width) * height, 0);
+        long long refinedCount = 0;
+
+#pragma omp parallel for schedule(static) reduction(+:refinedCount)
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                double sum[3] = { 0, 0, 0 }, sumSq[3] = { 0, 0, 0 };
+                int n = 0;
+                for (int ny = std::max(0, y - 1); ny <= std::min(height - 1, y + 1); ++ny) {
+                    for (int nx = std::max(0, x - 1); nx <= std::min(width - 1, x + 1); ++nx) {
+                        const Col& c = image[static_cast<size_t>(ny) * width + nx];
+                        double channels[3] = { static_cast<double>(c.r), static_cast<double>(c.g), static_cast<double>(c.b) };
+                        for (int k = 0; k < 3; ++k) {
+                            sum[k] += channels[k];
+                            sumSq[k] += channels[k] * channels[k];
+                        }
+                        n++;
+                    }
+                }
+                double variance = 0;
+                for (int k = 0; k < 3; ++k) {
+                    double mean = sum[k] / n;
+                    variance += sumSq[k] / n - mean * mean;
+                }
+                if (variance > threshold) {
+                    refine[static_cast<size_t>(y) * width + x] = 1;
+                    refinedCount++;
+                }
+            }
+        }
+        std::vector<Col>().swap(image);
+
+        // Стратифицированная сетка подвыборок внутри пикселя
+        Real step = Real(1) / gridSize;
+        Real weight = Real(1) / (gridSize * gridSize);
+        TileStats stats;
+        forEachTile(0, height, 0, false, stats, [&](int x, int y, const Col& current, ThreadContext& context) {
+            if (!refine[static_cast<size_t>(y) * width + x]) return current;
+            Col sum(0, 0, 0);
+            for (int sy = 0; sy < gridSize; ++sy) {
+                for (int sx = 0; sx < gridSize; ++sx) {
+                    uint32_t seed = pixelSeed(x, y, static_cast<uint32_t>(sy * gridSize + sx + 1));
+                    sum = sum + traceSample(x + (sx + Real(0.5)) * step, y + (sy + Real(0.5)) * step, seed, context);
+                }
+            }
+            return sum * weight;
+        });
+
+        long long pixels = static_cast<long long>(width) * height;
+        long long adaptiveRays = pixels + refinedCount * gridSize * gridSize;
+        long long uniformRays = pixels * gridSize * gridSize;
+        std::cout << "Adaptive antialiasing: refined " << refinedCount << " of " << pixels << " pixels ("
+            << refinedCount * 100.0 / pixels << "%) with " << gridSize << "x" << gridSize << " samples in "
+            << (omp_get_wtime() - startTime) << " seconds; " << adaptiveRays << " primary rays vs "
+            << uniformRays << " uniform (" << static_cast<double>(uniformRays) / adaptiveRays << "x fewer)" << std::endl;
+        return refinedCount;
+    }
+
+    // Чтение и запись count пикселей, лежащих подряд начиная с индекса хранения index
+    void loadPixels(size_t index, Col* dst, int count) const {
+        if (framebufferFormat == FramebufferFormat::Full) std::copy(imageBuffer.begin() + index, imageBuffer.begin() + index + count, dst);
+        else compactBuffer.load(index, dst, count);
+    }
+
+    void storePixels(size_t index, const Col* src, int count) {
+        if (framebufferFormat == FramebufferFormat::Full) std::copy(src, src + count, imageBuffer.begin() + index);
+        else compactBuffer.store(index, src, count);
+    }
+
+    // Счетчик времени вывода вызывающего потока; если контекстов потоков еще нет
+    // (координатор только собирает полосы), время идет в untimed
+    long long& outputCounter(long long& untimed) const {
+        size_t thread = static_cast<size_t>(omp_get_thread_num());
+        return thread < threadContexts.size() ? threadContexts[thread].counters.outputNs : untimed;
+    }
+
+    // Строки [y0, y1) буфера в порядке изображения (width пикселей на строку);
+    // полосы рядов блоков переводятся параллельно
+    void loadRows(int y0, int y1, Col* dst) const {
+        int bandRows = tiling.getBandRows();
+        int bands = (y1 - y0 + bandRows - 1) / bandRows;
+#pragma omp parallel for schedule(static)
+        for (int band = 0; band < bands; ++band) {
+            int first = y0 + band * bandRows;
+            tiling.forEachSegment(first, std::min(y1, first + bandRows), [&](int y, int x0, int x1, size_t index) {
+                loadPixels(index, dst + static_cast<size_t>(y - y0) * width + x0, x1 - x0);
+            });
+        }
+    }
+
+    // Буфер кадра на rows строк в выбранных формате и раскладке; другой формат освобождается
+    void allocateFramebuffer(int rows) {
+        tiling.configure(framebufferLayout, width, rows, tileSize);
+        size_t pixels = tiling.getPixelCount();
+        if (framebufferFormat == FramebufferFormat::Full) {
+            imageBuffer.assign(pixels, Col());
+            compactBuffer.release();
+        }
+        else {
+            std::vector<Col>().swap(imageBuffer);
+            compactBuffer.assign(framebufferFormat, pixels);
+        }
+    }
+
+    // Полоса строк [y0, y1) для другого процесса: рендеринг в буфер полосы (кадр не сохраняется)
+    // и копия ее пикселей в точности рендеринга
+    void renderBand(int y0, int y1, std::vector<Col>& pixels, TileStats& stats) {
+        allocateFramebuffer(y1 - y0);
+        renderRows(y0, y1, y0, false, stats);
+        pixels.resize(static_cast<size_t>(width) * (y1 - y0));
+        loadRows(0, y1 - y0, pixels.data());
+    }
+
+    // Запись полосы, отрендеренной другим процессом, в кадр со строки y0
+    void storeBand(int y0, int rows, const Col* pixels) {
+        long long untimed = 0;
+        StatsTimer timer(outputCounter(untimed));
+        tiling.forEachSegment(y0, y0 + rows, [&](int y, int x0, int x1, size_t index) {
+            storePixels(index, pixels + static_cast<size_t>(y - y0) * width + x0, x1 - x0);
+        });
+    }
+
+    int getWidth() const {
+        return width;
+    }
+
+    int getHeight() const {
+        return height;
+    }
+
+    size_t getFramebufferBytes() const {
+        return imageBuffer.size() * sizeof(Col) + compactBuffer.getBytes();
+    }
+
+    void resetThreadContexts(int threadCount) {
+        threadContexts.resize(threadCount);
+        wavefrontQueues.resize(threadCount);
+        tileColors.resize(threadCount);
+        for (auto& colors : tileColors) {
+            bool staged = framebufferFormat != FramebufferFormat::Full || framebufferLayout != FramebufferLayout::Linear;
+            if (staged) colors.resize(static_cast<size_t>(tileSize) * tileSize);
+        }
+        for (auto& context : threadContexts) {
+            context.reset(scene.getLightCount());
+        }
+    }
+
+    // Сумма счетчиков всех потоков с последнего сброса
+    RayCounters getCounters() const {
+        RayCounters total;
+        for (const auto& context : threadContexts) {
+            total.add(context.counters);
+        }
+        return total;
+    }
+
+    // Сводка счетчиков всех потоков за последний рендеринг
+    void printRayStats(double elapsed) const {
+#if FONGA_STATS
+        RayCounters total = getCounters();
+        long long rays = total.primaryRays + total.secondaryRays + total.shadowRays;
+        std::cout << "Rays: " << total.primaryRays << " primary (" << total.hits << " hits), " << total.secondaryRays
+            << " secondary, " << total.shadowRays << " shadow; " << total.sphereTests << " sphere and "
+            << total.triangleTests << " triangle tests";
+        if (rays > 0) std::cout << " (" << static_cast<double>(total.sphereTests + total.triangleTests) / rays << " per ray)";
+        if (elapsed > 0) std::cout << ", " << rays / elapsed / 1e6 << " Mrays/s";
+        std::cout << std::endl;
+
+        // Отраженные и преломленные лучи по глубине (0 - первичные)
+        if (total.secondaryRays > 0) {
+            std::cout << "Rays by depth: 0: " << total.primaryRays;
+            for (int depth = 1; depth <= MAX_TRACE_DEPTH && total.depthRays[depth] > 0; ++depth) {
+                std::cout << ", " << depth << ": " << total.depthRays[depth];
+            }
+            std::cout << "; " << total.rouletteTerminated << " terminated by Russian roulette" << std::endl;
+        }
+
+        // Баланс нагрузки между потоками
+        long long minRays = std::numeric_limits<long long>::max(), maxRays = 0;
+        for (const auto& context : threadContexts) {
+            long long threadRays = context.counters.primaryRays + context.counters.secondaryRays + context.counters.shadowRays;
+            minRays = std::min(minRays, threadRays);
+            maxRays = std::max(maxRays, threadRays);
+        }
+        std::cout << "Rays per thread: min " << minRays << ", max " << maxRays << std::endl;
+#if FONGA_STATS >= 2
+        // Время суммируется по потокам
+        double intersection = total.intersectionNs * 1e-6;
+        double shadow = total.shadowNs * 1e-6;
+        double shading = (total.shadingNs - total.shadowNs) * 1e-6;
+        double output = total.outputNs * 1e-6;
+        double sum = intersection + shadow + shading + output;
+        if (sum > 0) {
+            std::cout << "Thread time: primary intersection " << intersection << " ms (" << intersection * 100.0 / sum
+                << "%), shadow rays " << shadow << " ms (" << shadow * 100.0 / sum << "%), shading "
+                << shading << " ms (" << shading * 100.0 / sum << "%), output "
+                << output << " ms (" << output * 100.0 / sum << "%)" << std::endl;
+        }
+#endif
+#else
+        (void)elapsed;
+#endif
+    }
+
+    // Доля теневых запросов, решенных кэшем заслоняющих объектов без обхода BVH
+    void printShadowStats() const {
+#if FONGA_STATS
+        long long queries = 0, hits = 0;
+        for (const auto& context : threadContexts) {
+            queries += context.counters.shadowRays;
+            hits += context.shadowCache.cacheHits;
+        }
+        std::cout << "Shadow rays: " << queries << ", occluder cache hits: " << hits;
+        if (queries > 0) std::cout << " (" << hits * 100.0 / queries << "%)";
+        std::cout << std::endl;
+
+        long long builds = 0, length = 0;
+        for (const auto& context : threadContexts) {
+            builds += context.tileLights.builds;
+            length += context.tileLights.totalLength;
+        }
+        if (builds > 0) {
+            std::cout << "Light culling: " << static_cast<double>(length) / builds << " of " << scene.getLightCount()
+                << " lights per tile on average" << std::endl;
+        }
+#endif
+    }
+
+    void printRenderHeader() const {
+        std::cout << "Starting parallel render with " << omp_get_max_threads() << " threads ("
+            << simdLevelName(scene.getSimdLevel()) << " intersection kernel, "
+            << (wavefrontEnabled ? "wavefront, " : "")
+            << (sizeof(Real) == sizeof(float) ? "float" : "double") << " precision";
+        if (framebufferFormat != FramebufferFormat::Full) std::cout << ", " << framebufferFormatName(framebufferFormat) << " framebuffer";
+        if (framebufferLayout != FramebufferLayout::Linear) std::cout << ", " << framebufferLayoutName(framebufferLayout) << " layout";
+        if (lightCulling) std::cout << ", tile light culling";
+        if (scene.getLightSamples() > 0) std::cout << ", " << scene.getLightSamples() << " light samples";
+        if (scene.getShadingModel() != ShadingModel::Exact) std::cout << ", " << shadingModelName(scene.getShadingModel()) << " shading";
+        std::cout << ")..." << std::endl;
+    }
+
+    // Параллельный рендеринг сцены с использованием OpenMP
+    void renderParallel() {
+        double startTime = omp_get_wtime();
+        printRenderHeader();
+
+        allocateFramebuffer(height);
+        if (heatmapEnabled && FONGA_STATS) pixelCost.assign(static_cast<size_t>(width) * height, 0.0f);
+        resetThreadContexts(omp_get_max_threads());
+        TileStats stats;
+        renderRows(0, height, 0, true, stats);
+
+        double endTime = omp_get_wtime();
+        std::cout << "Render completed in " << (endTime - startTime) << " seconds ("
+            << stats.tiles << " tiles of " << tileSize << "x" << tileSize << ", "
+            << stats.steals << " steals)" << std::endl;
+        if (framebufferFormat != FramebufferFormat::Full) {
+            std::cout << "Framebuffer: " << framebufferFormatName(framebufferFormat) << ", "
+                << getFramebufferBytes() / (1024.0 * 1024.0) << " MB ("
+                << static_cast<double>(width) * height * sizeof(Col) / getFramebufferBytes() << "x smaller than full)" << std::endl;
+        }
+        printRayStats(endTime - startTime);
+        printShadowStats();
+    }
+
+    // Рендеринг кадра без вывода в консоль; возвращает время в секундах
+    double renderQuiet(TileStats& stats) {
+        double startTime = omp_get_wtime();
+        allocateFramebuffer(height);
+        resetThreadContexts(omp_get_max_threads());
+        renderRows(0, height, 0, false, stats);
+        return omp_get_wtime() - startTime;
+    }
+
+    // Проход по тайлам кадра с простым цветом пикселя вместо трассировки: время определяют
+    // чтение и запись буфера, а не лучи (замеры раскладок кадра). Буфер выделяется до замера;
+    // возвращает время прохода в секундах.
+    double fillQuiet(TileStats& stats) {
+        allocateFramebuffer(height);
+        resetThreadContexts(omp_get_max_threads());
+        Real scaleX = Real(1) / width, scaleY = Real(1) / height;
+        double startTime = omp_get_wtime();
+        forEachTile(0, height, 0, false, stats, [scaleX, scaleY](int x, int y, const Col& current, ThreadContext&) {
+            return Col(x * scaleX, y * scaleY, current.b * Real(0.5) + Real(0.25));
+        });
+        return omp_get_wtime() - startTime;
+    }
+
+    // Потоковый рендеринг для изображений, не помещающихся в память: полосы по bandHeight строк
+    // рендерятся по очереди и сразу записываются в файлы. Пиковая память - одна полоса
+    // (плюс ее 8-битная копия на каждый файл), а не все изображение.
+    void renderStreaming(int bandHeight, const std::string& ppmName, const std::string& bmpName) {
+        double startTime = omp_get_wtime();
+        printRenderHeader();
+
+        BandImageFile files[2];
+        bool opened = files[0].open(ppmName, ImageFormat::PPM, width, height);
+        opened = files[1].open(bmpName, ImageFormat::BMP, width, height) || opened;
+        if (!opened) return;
+
+        bandHeight = std::max(1, std::min(bandHeight, height));
+        pixelCost.clear();
+        allocateFramebuffer(bandHeight);
+        resetThreadContexts(omp_get_max_threads());
+        std::vector<unsigned char> bytes;
+
+        size_t bandBytes = getFramebufferBytes();
+        std::cout << "Streaming " << (height + bandHeight - 1) / bandHeight << " bands of " << bandHeight
+            << " rows, band buffer " << bandBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+
+        TileStats stats;
+        double writeTime = 0.0;
+        for (int y0 = 0; y0 < height; y0 += bandHeight) {
+            int rows = std::min(bandHeight, height - y0);
+            renderRows(y0, y0 + rows, y0, false, stats);
+
+            double writeStart = omp_get_wtime();
+            for (auto& file : files) {
+                if (!file.isOpen()) continue;
+                bool bmp = file.getFormat() == ImageFormat::BMP;
+                bytes.assign(file.getRowStride() * rows, 0);
+                quantizeRows(rows, file.getRowStride(), bmp, bmp, bytes.data());
+                file.writeBand(y0, rows, bytes.data());
+            }
+            writeTime += omp_get_wtime() - writeStart;
+
+            std::cout << "Progress: " << (y0 + rows) * 100.0 / height << "%\n" << std::flush;
+        }
+
+        for (auto& file : files) {
+            if (!file.isOpen()) continue;
+            file.close();
+            std::cout << "Image saved to: " << file.getName() << std::endl;
+        }
+        std::vector<Col>().swap(imageBuffer);
+        compactBuffer.release();
+
+        double endTime = omp_get_wtime();
+        std::cout << "Streaming render completed in " << (endTime - startTime) << " seconds ("
+            << writeTime << " s writing, " << stats.tiles << " tiles, " << stats.steals << " steals)" << std::endl;
+        printRayStats(endTime - startTime);
+        printShadowStats();
+    }
+
+    // Квантование первых rows строк буфера в 8 бит на канал. Строки (в раскладке Tiled - ряды
+    // блоков) обрабатываются параллельно и кладутся с шагом rowStride байт; bgr - порядок каналов
+    // BMP, bottomUp - нижняя строка первой. Компактные форматы квантуются векторно (SSE2),
+    // если не выбрано скалярное ядро.
+    void quantizeRows(int rows, size_t rowStride, bool bgr, bool bottomUp, unsigned char* bytes) const {
+        bool simd = scene.getSimdLevel() != SimdLevel::Scalar;
+        int bandRows = tiling.getBandRows();
+        int bands = (rows + bandRows - 1) / bandRows;
+#pragma omp parallel for schedule(static)
+        for (int band = 0; band < bands; ++band) {
+            long long untimed = 0;
+            StatsTimer timer(outputCounter(untimed));
+            int first = band * bandRows;
+            tiling.forEachSegment(first, std::min(rows, first + bandRows), [&](int y, int x0, int x1, size_t index) {
+                unsigned char* dst = bytes + rowStride * (bottomUp ? rows - 1 - y : y);
+                if (framebufferFormat != FramebufferFormat::Full) {
+                    compactBuffer.quantize(index, x1 - x0, bgr, simd, dst + 3 * x0);
+                    return;
+                }
+                const Col* src = &imageBuffer[index] - x0;
+                for (int x = x0; x < x1; ++x) {
+                    unsigned char r = static_cast<unsigned char>(src[x].r * 255);
+                    unsigned char g = static_cast<unsigned char>(src[x].g * 255);
+                    unsigned char b = static_cast<unsigned char>(src[x].b * 255);
+                    dst[3 * x + 0] = bgr ? b : r;
+                    dst[3 * x + 1] = g;
+                    dst[3 * x + 2] = bgr ? r : b;
+                }
+            });
+        }
+    }
+
+    // Файл изображения целиком в памяти: заголовок и квантованные пиксели.
+    // PPM - двоичный P6 (RGB, сверху вниз), BMP - 24 бита (BGR, снизу вверх, строки
+    // выровнены до 4 байт нулями)
+    std::vector<unsigned char> encode(ImageFormat format) const {
+        std::vector<unsigned char> bytes;
+        if (format == ImageFormat::PPM) {
+            std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+            size_t rowStride = 3 * static_cast<size_t>(width);
+            bytes.resize(header.size() + rowStride * height);
+            std::memcpy(bytes.data(), header.data(), header.size());
+            quantizeRows(height, rowStride, false, false, bytes.data() + header.size());
+        }
+        else {
+            const size_t headerSize = 54;
+            size_t rowStride = (3 * static_cast<size_t>(width) + 3) & ~static_cast<size_t>(3);
+            bytes.assign(headerSize + rowStride * height, 0);
+            writeBMPHeader(bytes.data(), width, height, rowStride);
+            quantizeRows(height, rowStride, true, true, bytes.data() + headerSize);
+        }
+        return bytes;
+    }
+
+    // Сохранение изображения в формате PPM (одна запись на все изображение)
+    void saveToPPM(const std::string& filename) const {
+        double startTime = omp_get_wtime();
+        std::ofstream file(filename, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open file: " << filename << std::endl;
+            return;
+        }
+
+        std::vector<unsigned char> bytes = encode(ImageFormat::PPM);
+        file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+
+        file.close();
+        std::cout << "Image saved to: " << filename << " (" << (omp_get_wtime() - startTime) * 1000.0 << " ms)" << std::endl;
+    }
+
+    // Сохранение изображения в формате BMP
+    void saveToBMP(const std::string& filename) const {
+        double startTime = omp_get_wtime();
+        std::ofstream file(filename, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open file: " << filename << std::endl;
+            return;
+        }
+
+        std::vector<unsigned char> bytes = encode(ImageFormat::BMP);
+        file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+
+        file.close();
+        std::cout << "BMP image saved to: " << filename << " (" << (omp_get_wtime() - startTime) * 1000.0 << " ms)" << std::endl;
+    }
+
+    // Сохранение карты стоимости пикселей (PPM): черный - самые дешевые, через синий,
+    // красный и желтый к белому - самые дорогие пиксели кадра
+    void saveHeatmap(const std::string& filename) const {
+        if (pixelCost.empty()) {
+            std::cerr << "Heatmap was not collected" << std::endl;
+            return;
+        }
+        std::ofstream file(filename, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open file: " << filename << std::endl;
+            return;
+        }
+
+        float maxCost = *std::max_element(pixelCost.begin(), pixelCost.end());
+        double totalCost = 0.0;
+        for (float cost : pixelCost) totalCost += cost;
+
+        // Опорные цвета шкалы
+        const float palette[5][3] = { { 0, 0, 0 }, { 0, 0, 1 }, { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 } };
+        std::vector<unsigned char> bytes(3 * pixelCost.size());
+        for (size_t i = 0; i < pixelCost.size(); ++i) {
+            float v = maxCost > 0 ? pixelCost[i] / maxCost * 4 : 0.0f;
+            int k = std::min(3, static_cast<int>(v));
+            float f = v - k;
+            for (int c = 0; c < 3; ++c) {
+                float value = palette[k][c] + (palette[k + 1][c] - palette[k][c]) * f;
+                bytes[3 * i + c] = static_cast<unsigned char>(value * 255);
+            }
+        }
+
+        file << "P6\n" << width << " " << height << "\n255\n";
+        file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        file.close();
+        std::cout << "Heatmap saved to: " << filename << " (max " << maxCost << " ns/pixel, mean "
+            << totalCost / pixelCost.size() << " ns/pixel)" << std::endl;
+    }
+
+    // Сохранение изображения в формате PFM (float RGB без квантования, строки снизу вверх)
+    void saveToPFM(const std::string& filename) const {
+        double startTime = omp_get_wtime();
+        std::ofstream file(filename, std::ios::binary);
+        if (!file) {
+            std::cerr << "Cannot open file: " << filename << std::endl;
+            return;
+        }
+
+        // Отрицательный масштаб означает little-endian
+        file << "PF\n" << width << " " << height << "\n-1.0\n";
+
+        std::vector<Col> image = getImage();
+        std::vector<float> data(3 * static_cast<size_t>(width) * height);
+#pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            const Col* src = &image[static_cast<size_t>(width) * y];
+            float* dst = &data[3 * static_cast<size_t>(width) * (height - 1 - y)];
+            for (int x = 0; x < width; ++x) {
+                const Col& c = src[x];
+                dst[3 * x + 0] = static_cast<float>(c.r);
+                dst[3 * x + 1] = static_cast<float>(c.g);
+                dst[3 * x + 2] = static_cast<float>(c.b);
+            }
+        }
+        file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size() * sizeof(float)));
+
+        file.close();
+        std::cout << "PFM image saved to: " << filename << " (" << (omp_get_wtime() - startTime) * 1000.0 << " ms)" << std::endl;
+    }
+};
+
+// Параметры запуска из командной строки
+struct RenderOptions {
+    int width = 800;
+    int height = 600;
+    int tileSize = 16;
+    SimdLevel simdLevel = detectSimdLevel();
+    bool showBVHStats = false;
+    bool useFloat = false;              // Рендер в одинарной точности
+    bool comparePrecision = false;      // Рендер в обеих точностях с отчетом о расхождении
+    bool savePFM = false;               // Дополнительно сохранить output.pfm без квантования
+    bool wavefront = false;             // Волновой рендеринг тайлов (очереди лучей по этапам)
+    bool compareWavefront = false;      // Рендер обоими способами со сравнением скорости и изображений
+    int maxDepth = 4;                   // Наибольшая глубина отраженных и преломленных лучей
+    int rouletteDepth = 2;              // Глубина, с которой лучи отбрасываются русской рулеткой
+    std::string animationPath;          // Ключевые кадры анимации; пусто - один кадр
+    int turntableFrames = 0;            // Облет камеры вокруг (0, 0, -6) за N кадров (0 - выключен)
+    std::string framePrefix = "frame";  // Кадры анимации пишутся в <prefix>_0000.ppm, ...
+    FramebufferFormat framebuffer = FramebufferFormat::Full;   // Хранение кадра (превью - компактные форматы)
+    FramebufferLayout framebufferLayout = FramebufferLayout::Linear;
+    bool hasCamera = false;             // Камера задана явно (--camera), иначе - по умолчанию
+    Vector3 cameraPosition, cameraTarget;
+    double fov = 90.0;                  // Вертикальный угол обзора, в градусах
+    double aperture = 0.0;              // Радиус тонкой линзы; 0 - без глубины резкости
+    double focusDistance = 0.0;         // 0 - расстояние до точки, на которую смотрит камера
+    int lensSamples = 8;
+    bool lightCulling = false;          // Списки источников по тайлам из радиусов влияния
+    int lightSamples = 0;               // Источников на точку при стохастической выборке; 0 - все
+    ShadingModel shading = ShadingModel::Exact;
+    bool compareShading = false;        // Рендер с точным и выбранным быстрым затенением со сравнением
+    std::string serverSocket;           // Режим сервера на Unix-сокете по этому пути
+    int serverCacheSize = 8;            // Сцены с готовыми BVH, хранимые сервером
+    int workers = 0;                    // Рабочие процессы распределенного рендеринга (0 - в этом процессе)
+    int workerBandRows = 0;             // Строк в задании рабочего (0 - четыре ряда тайлов)
+    int workerFd = -1;                  // Сокет координатора; задается только рабочим процессам
+    int streamBandHeight = 0;           // Потоковый рендеринг полосами по N строк (0 - выключен)
+    bool antialias = false;             // Адаптивное сглаживание после первого прохода
+    bool progressive = false;           // Сохранять превью после первого прохода, затем уточнять
+    int aaGridSize = 4;                 // Сетка подвыборок уточняемого пикселя (N x N)
+    double aaThreshold = 0.001;         // Порог дисперсии цвета в окрестности 3x3
+    int tolerance = 2;                  // Допустимое расхождение канала, в единицах из 255
+    std::string scenePath;              // Файл сцены (текстовый или двоичный); пусто - встроенная сцена
+    std::string saveScenePath;          // Сохранить сцену: *.txt - текстом, иначе в двоичном формате
+    std::string heatmapPath;            // Карта стоимости пикселей (PPM); пусто - не собирать
+    std::vector<std::string> surfaces;  // Параметрические поверхности, добавляемые к сцене: вид[:сегменты[:копии]]
+
+    // Серия замеров (--benchmark): все сочетания перечисленных значений
+    bool benchmark = false;
+    std::vector<int> benchSpheres = { 100, 1000, 10000 };
+    std::vector<int> benchLights = { 1, 4 };
+    std::vector<double> benchOcclusion = { 0.0, 0.5 };     // Доля сфер в слое, отбрасывающем тени
+    std::vector<std::pair<int, int>> benchSizes = { std::make_pair(640, 480) };
+    std::vector<int> benchThreads;      // Пусто - степени двойки до числа процессоров
+    int benchRepeat = 3;
+    std::string benchOutput = "benchmark.csv";     // *.json - JSON, иначе CSV
+    std::string benchBaseline;          // CSV предыдущей версии для поиска регрессий
+    double benchTolerance = 10.0;       // Допустимое замедление, в процентах
+    bool benchFramebuffer = false;      // Замеры раскладок кадра (--bench-framebuffer) вместо рендеринга сцен
+    std::vector<int> benchTileSizes = { 4, 8, 16, 32 };
+
+    // Регрессионный прогон (--regression [каталог]): встроенные сцены против эталонных изображений
+    std::string regressionDir;          // Каталог эталонов <случай>.ppm; пусто - режим выключен
+    bool updateGolden = false;          // Перезаписать эталоны текущими изображениями
+    std::string regressionOutput = "regression.csv";
+};
+
+// Размер изображения вида WxH
+bool parseSize(const std::string& value, int& width, int& height) {
+    size_t separator = value.find('x');
+    width = std::atoi(value.c_str());
+    height = separator == std::string::npos ? 0 : std::atoi(value.c_str() + separator + 1);
+    if (width <= 0 || height <= 0) {
+        std::cerr << "Invalid image size: " << value << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Список положительных чисел через запятую
+template <typename T>
+bool parseList(const std::string& value, std::vector<T>& list) {
+    list.clear();
+    std::istringstream in(value);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        std::istringstream itemStream(item);
+        T number;
+        if (!(itemStream >> number) || number < 0) {
+            std::cerr << "Invalid list: " << value << std::endl;
+            return false;
+        }
+        list.push_back(number);
+    }
+    return !list.empty();
+}
+
+bool parseOptions(int argc, char* argv[], RenderOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--bvh-stats") {
+            options.showBVHStats = true;
+        }
+        else if (arg == "--tile-size" && i + 1 < argc) {
+            options.tileSize = std::atoi(argv[++i]);
+            if (options.tileSize <= 0) {
+                std::cerr << "Invalid tile size: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--simd" && i + 1 < argc) {
+            std::string value = argv[++i];
+            SimdLevel best = detectSimdLevel();
+            if (value == "scalar") options.simdLevel = SimdLevel::Scalar;
+            else if (value == "sse2" && best != SimdLevel::Scalar) options.simdLevel = SimdLevel::SSE2;
+            else if (value == "avx" && best == SimdLevel::AVX) options.simdLevel = SimdLevel::AVX;
+            else if (value != "auto") {
+                std::cerr << "SIMD level not supported: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--precision" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (value == "float") options.useFloat = true;
+            else if (value == "double") options.useFloat = false;
+            else {
+                std::cerr << "Unknown precision: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--size" && i + 1 < argc) {
+            if (!parseSize(argv[++i], options.width, options.height)) return false;
+        }
+        else if (arg == "--stream" && i + 1 < argc) {
+            options.streamBandHeight = std::atoi(argv[++i]);
+            if (options.streamBandHeight <= 0) {
+                std::cerr << "Invalid band height: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--aa") {
+            options.antialias = true;
+        }
+        else if (arg == "--progressive") {
+            options.antialias = true;
+            options.progressive = true;
+        }
+        else if (arg == "--aa-samples" && i + 1 < argc) {
+            options.aaGridSize = std::atoi(argv[++i]);
+            if (options.aaGridSize <= 0) {
+                std::cerr << "Invalid sample grid: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--aa-threshold" && i + 1 < argc) {
+            options.aaThreshold = std::atof(argv[++i]);
+        }
+        else if (arg == "--scene" && i + 1 < argc) {
+            options.scenePath = argv[++i];
+        }
+        else if (arg == "--save-scene" && i + 1 < argc) {
+            options.saveScenePath = argv[++i];
+        }
+        else if (arg == "--surface" && i + 1 < argc) {
+            options.surfaces.push_back(argv[++i]);
+        }
+        else if (arg == "--heatmap" && i + 1 < argc) {
+            options.heatmapPath = argv[++i];
+        }
+        else if (arg == "--benchmark") {
+            options.benchmark = true;
+        }
+        else if (arg == "--bench-spheres" && i + 1 < argc) {
+            if (!parseList(argv[++i], options.benchSpheres)) return false;
+        }
+        else if (arg == "--bench-lights" && i + 1 < argc) {
+            if (!parseList(argv[++i], options.benchLights)) return false;
+        }
+        else if (arg == "--bench-occlusion" && i + 1 < argc) {
+            if (!parseList(argv[++i], options.benchOcclusion)) return false;
+        }
+        else if (arg == "--bench-sizes" && i + 1 < argc) {
+            std::istringstream in(argv[++i]);
+            std::string item;
+            options.benchSizes.clear();
+            while (std::getline(in, item, ',')) {
+                int w, h;
+                if (!parseSize(item, w, h)) return false;
+                options.benchSizes.push_back(std::make_pair(w, h));
+            }
+        }
+        else if (arg == "--bench-threads" && i + 1 < argc) {
+            if (!parseList(argv[++i], options.benchThreads)) return false;
+            if (std::find(options.benchThreads.begin(), options.benchThreads.end(), 0) != options.benchThreads.end()) {
+                std::cerr << "Thread count must be positive" << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--bench-repeat" && i + 1 < argc) {
+            options.benchRepeat = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bench-output" && i + 1 < argc) {
+            options.benchOutput = argv[++i];
+        }
+        else if (arg == "--bench-baseline" && i + 1 < argc) {
+            options.benchBaseline = argv[++i];
+        }
+        else if (arg == "--bench-tolerance" && i + 1 < argc) {
+            options.benchTolerance = std::atof(argv[++i]);
+        }
+        else if (arg == "--bench-framebuffer") {
+            options.benchFramebuffer = true;
+        }
+        else if (arg == "--bench-tile-sizes" && i + 1 < argc) {
+            if (!parseList(argv[++i], options.benchTileSizes)) return false;
+            if (std::find_if(options.benchTileSizes.begin(), options.benchTileSizes.end(), [](int size) { return size <= 0; })
+                != options.benchTileSizes.end()) {
+                std::cerr << "Tile size must be positive" << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--regression") {
+            // Без каталога - эталоны из репозитория (Fonga/regression рядом с каталогом проекта)
+            options.regressionDir = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "../regression";
+        }
+        else if (arg == "--update-golden") {
+            options.updateGolden = true;
+        }
+        else if (arg == "--regression-output" && i + 1 < argc) {
+            options.regressionOutput = argv[++i];
+        }
+        else if (arg == "--pfm") {
+            options.savePFM = true;
+        }
+        else if (arg == "--wavefront") {
+            options.wavefront = true;
+        }
+        else if (arg == "--compare-wavefront") {
+            options.compareWavefront = true;
+        }
+        else if (arg == "--max-depth" && i + 1 < argc) {
+            options.maxDepth = std::atoi(argv[++i]);
+            if (options.maxDepth < 0 || options.maxDepth > MAX_TRACE_DEPTH) {
+                std::cerr << "Max depth must be between 0 and " << MAX_TRACE_DEPTH << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--roulette-depth" && i + 1 < argc) {
+            options.rouletteDepth = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--animation" && i + 1 < argc) {
+            options.animationPath = argv[++i];
+        }
+        else if (arg == "--turntable" && i + 1 < argc) {
+            options.turntableFrames = std::atoi(argv[++i]);
+            if (options.turntableFrames <= 0) {
+                std::cerr << "Turntable needs a positive frame count" << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--frame-output" && i + 1 < argc) {
+            options.framePrefix = argv[++i];
+        }
+        else if (arg == "--camera" && i + 1 < argc) {
+            // Положение и точка, на которую смотрит камера: x,y,z,tx,ty,tz
+            std::istringstream list(argv[++i]);
+            std::vector<double> v;
+            std::string item;
+            while (std::getline(list, item, ',')) v.push_back(std::atof(item.c_str()));
+            if (v.size() != 6) {
+                std::cerr << "Invalid camera: expected x,y,z,tx,ty,tz" << std::endl;
+                return false;
+            }
+            options.hasCamera = true;
+            options.cameraPosition = Vector3(v[0], v[1], v[2]);
+            options.cameraTarget = Vector3(v[3], v[4], v[5]);
+        }
+        else if (arg == "--fov" && i + 1 < argc) {
+            options.fov = std::atof(argv[++i]);
+            if (options.fov <= 0 || options.fov >= 180) {
+                std::cerr << "Field of view must be between 0 and 180 degrees" << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--aperture" && i + 1 < argc) {
+            options.aperture = std::max(0.0, std::atof(argv[++i]));
+        }
+        else if (arg == "--focus-distance" && i + 1 < argc) {
+            options.focusDistance = std::max(0.0, std::atof(argv[++i]));
+        }
+        else if (arg == "--lens-samples" && i + 1 < argc) {
+            options.lensSamples = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--light-culling") {
+            options.lightCulling = true;
+        }
+        else if (arg == "--light-samples" && i + 1 < argc) {
+            options.lightSamples = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--shading" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (value == "exact") options.shading = ShadingModel::Exact;
+            else if (value == "fast") options.shading = ShadingModel::Fast;
+            else if (value == "blinn") options.shading = ShadingModel::Blinn;
+            else {
+                std::cerr << "Unknown shading model: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--compare-shading") {
+            options.compareShading = true;
+        }
+        else if (arg == "--framebuffer" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (value == "full") options.framebuffer = FramebufferFormat::Full;
+            else if (value == "float") options.framebuffer = FramebufferFormat::Float;
+            else if (value == "half") options.framebuffer = FramebufferFormat::Half;
+            else if (value == "rgba8") options.framebuffer = FramebufferFormat::RGBA8;
+            else {
+                std::cerr << "Unknown framebuffer format: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--framebuffer-layout" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (value == "linear") options.framebufferLayout = FramebufferLayout::Linear;
+            else if (value == "tiled") options.framebufferLayout = FramebufferLayout::Tiled;
+            else {
+                std::cerr << "Unknown framebuffer layout: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--server" && i + 1 < argc) {
+            options.serverSocket = argv[++i];
+        }
+        else if (arg == "--workers" && i + 1 < argc) {
+            options.workers = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--worker-band" && i + 1 < argc) {
+            options.workerBandRows = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--worker" && i + 1 < argc) {
+            options.workerFd = std::atoi(argv[++i]);
+        }
+        else if (arg == "--server-cache" && i + 1 < argc) {
+            options.serverCacheSize = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--compare-precision") {
+            options.comparePrecision = true;
+        }
+        else if (arg == "--tolerance" && i + 1 < argc) {
+            options.tolerance = std::atoi(argv[++i]);
+        }
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Добавление параметрической поверхности по описанию вида[:сегменты[:копии]]. Одна копия
+// размещается перед камерой, несколько - сеткой над полом с поворотом вокруг вертикали;
+// все копии ссылаются на одну сетку.
+bool addSurface(SceneDescription& description, const std::string& spec) {
+    size_t separator = spec.find(':');
+    std::string kind = spec.substr(0, separator);
+    int segments = 64, copies = 1;
+    if (separator != std::string::npos) {
+        segments = std::atoi(spec.c_str() + separator + 1);
+        size_t second = spec.find(':', separator + 1);
+        if (second != std::string::npos) copies = std::atoi(spec.c_str() + second + 1);
+    }
+    if (!ParametricSurface::isKnown(kind) || segments <= 0 || copies <= 0) {
+        std::cerr << "Unknown surface: " << spec << " (expected mobius, paraboloid or torus[:segments[:copies]])" << std::endl;
+        return false;
+    }
+
+    InstanceDescription instance;
+    instance.material = static_cast<uint32_t>(description.materials.size());
+    instance.mesh = static_cast<uint32_t>(description.meshes.size());
+    description.materials.push_back(Material(Color(0.9, 0.7, 0.2), Color(1.0, 1.0, 1.0), Color(0.1, 0.08, 0.02), 48.0));
+    description.meshes.push_back(ParametricSurface(kind).tessellate(segments, segments, instance.material));
+
+    // Высота параболоида в несколько раз больше его ширины, поэтому он уменьшается сильнее
+    double scale = kind == "paraboloid" ? 0.2 : 0.6;
+    if (copies == 1) {
+        instance.transform = Affine::placement(Vector3(0, 1.2, -4), scale, 0);
+        description.instances.push_back(instance);
+        return true;
+    }
+
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(copies))));
+    double step = 8.0 / side;
+    for (int i = 0; i < copies; ++i) {
+        Vector3 offset(-4 + step * (i % side + 0.5), -1.4, -4 - step * (i / side + 0.5));
+        instance.transform = Affine::placement(offset, scale * 0.5, 0.7 * i);
+        description.instances.push_back(instance);
+    }
+    return true;
+}
+
+template <typename Real>
+void configureRaycaster(ParallelRaycasterT<Real>& raycaster, const RenderOptions& options) {
+    raycaster.setSimdLevel(options.simdLevel);
+    raycaster.setTileSize(options.tileSize);
+    raycaster.setHeatmapEnabled(!options.heatmapPath.empty());
+    raycaster.setWavefrontEnabled(options.wavefront);
+    raycaster.setTraceDepth(options.maxDepth, options.rouletteDepth);
+    raycaster.setFramebufferFormat(options.framebuffer);
+    raycaster.setFramebufferLayout(options.framebufferLayout);
+    raycaster.setLightSelection(options.lightCulling, options.lightSamples);
+    raycaster.setShadingModel(options.shading);
+    Vector3 position = options.hasCamera ? options.cameraPosition : Vector3(0, 0, 0);
+    Vector3 target = options.hasCamera ? options.cameraTarget : Vector3(0, 0, -1);
+    double focusDistance = options.focusDistance > 0 ? options.focusDistance : (target - position).length();
+    raycaster.setLens(options.fov, options.aperture, focusDistance, options.lensSamples);
+    if (options.hasCamera) raycaster.setCamera(position, target);
+    raycaster.printSceneStats();
+    if (options.showBVHStats) {
+        raycaster.printBVHStats();
+    }
+}
+
+// Расхождение двух изображений после квантования в 8 бит (как при сохранении)
+struct ImageDiff {
+    int maxDiff = 0;                    // Максимальное расхождение канала
+    double meanDiff = 0.0;              // Среднее расхождение канала
+    long long pixelsOverTolerance = 0;  // Пиксели, у которых хоть один канал вышел за допуск
+    long long pixelCount = 0;
+};
+
+template <typename RealA, typename RealB>
+ImageDiff compareImages(const std::vector<ColorT<RealA>>& reference, const std::vector<ColorT<RealB>>& test, int tolerance) {
+    ImageDiff diff;
+    diff.pixelCount = static_cast<long long>(reference.size());
+    double total = 0.0;
+    for (size_t i = 0; i < reference.size(); ++i) {
+        const ColorT<RealA>& a = reference[i];
+        const ColorT<RealB>& b = test[i];
+        int dr = std::abs(static_cast<int>(a.r * 255) - static_cast<int>(b.r * 255));
+        int dg = std::abs(static_cast<int>(a.g * 255) - static_cast<int>(b.g * 255));
+        int db = std::abs(static_cast<int>(a.b * 255) - static_cast<int>(b.b * 255));
+        int worst = std::max(dr, std::max(dg, db));
+        diff.maxDiff = std::max(diff.maxDiff, worst);
+        total += dr + dg + db;
+        if (worst > tolerance) diff.pixelsOverTolerance++;
+    }
+    if (diff.pixelCount > 0) diff.meanDiff = total / (3.0 * diff.pixelCount);
+    return diff;
+}
+
+// Сглаживание готового кадра (с превью при --progressive) и запись файлов результата
+template <typename Real>
+void refineAndSave(ParallelRaycasterT<Real>& raycaster, const RenderOptions& options) {
+    if (options.antialias) {
+        if (options.progressive) {
+            // Превью после первого прохода, затем файлы перезаписываются уточненным изображением
+            raycaster.saveToPPM("output.ppm");
+            raycaster.saveToBMP("output.bmp");
+            std::cout << "Preview written, refining..." << std::endl;
+        }
+        raycaster.refineAdaptive(options.aaGridSize, options.aaThreshold);
+    }
+
+    raycaster.saveToPPM("output.ppm");
+    raycaster.saveToBMP("output.bmp");
+    if (options.savePFM) raycaster.saveToPFM("output.pfm");
+    if (!options.heatmapPath.empty()) raycaster.saveHeatmap(options.heatmapPath);
+}
+
+// Обычный запуск: рендеринг в выбранной точности и сохранение результата
+template <typename Real>
+void renderAndSave(const RenderOptions& options, const SceneDescription& description) {
+    ParallelRaycasterT<Real> raycaster(options.width, options.height, description);
+    configureRaycaster(raycaster, options);
+
+    if (options.streamBandHeight > 0) {
+        // Полосы пишутся в файлы сразу после рендеринга; сглаживанию нужны соседние строки,
+        // поэтому в этом режиме оно недоступно
+        if (options.antialias) {
+            std::cerr << "Antialiasing is not supported in streaming mode" << std::endl;
+        }
+        raycaster.renderStreaming(options.streamBandHeight, "output.ppm", "output.bmp");
+        return;
+    }
+
+    raycaster.renderParallel();
+    refineAndSave(raycaster, options);
+}
+
+// Рендеринг одной сцены попиксельно и волнами: пропускная способность рядом и проверка,
+// что изображения совпадают побитово (со вторичными лучами - до единицы после квантования:
+// вклады глубоких лучей суммируются в другом порядке). Возвращает код завершения.
+template <typename Real>
+int compareWavefront(const RenderOptions& options, const SceneDescription& description) {
+    ParallelRaycasterT<Real> raycaster(options.width, options.height, description);
+    configureRaycaster(raycaster, options);
+
+    const char* names[2] = { "depth-first", "wavefront" };
+    double elapsed[2];
+    long long rays[2], secondary = 0;
+    std::vector<ColorT<Real>> images[2];
+    for (int mode = 0; mode < 2; ++mode) {
+        raycaster.setWavefrontEnabled(mode == 1);
+        // Лучший из трех запусков: первый прогревает кэши и страницы буфера
+        elapsed[mode] = std::numeric_limits<double>::max();
+        for (int run = 0; run < 3; ++run) {
+            TileStats stats;
+            elapsed[mode] = std::min(elapsed[mode], raycaster.renderQuiet(stats));
+        }
+        RayCounters counters = raycaster.getCounters();
+        rays[mode] = counters.primaryRays + counters.secondaryRays + counters.shadowRays;
+        secondary = counters.secondaryRays;
+        images[mode] = raycaster.getImage();
+    }
+
+    raycaster.saveToPPM("output.ppm");
+    for (int mode = 0; mode < 2; ++mode) {
+        std::cout << names[mode] << ": " << elapsed[mode] * 1000.0 << " ms";
+#if FONGA_STATS
+        std::cout << ", " << rays[mode] << " rays, " << rays[mode] / elapsed[mode] / 1e6 << " Mrays/s";
+#else
+        (void)rays;
+#endif
+        std::cout << std::endl;
+    }
+    std::cout << "Wavefront speedup: " << elapsed[0] / elapsed[1] << "x" << std::endl;
+
+    long long mismatches = 0;
+    for (size_t i = 0; i < images[0].size(); ++i) {
+        const ColorT<Real>& a = images[0][i];
+        const ColorT<Real>& b = images[1][i];
+        if (a.r != b.r || a.g != b.g || a.b != b.b) mismatches++;
+    }
+    ImageDiff diff = compareImages(images[0], images[1], 0);
+    bool passed = secondary == 0 ? mismatches == 0 : diff.maxDiff <= 1;
+    std::cout << "Wavefront image: " << mismatches << " of " << images[0].size() << " pixels differ, max "
+        << diff.maxDiff << "/255 - " << (passed ? "PASS" : "FAIL") << std::endl;
+    return passed ? 0 : 2;
+}
+
+// Рендеринг одной сцены с точным и быстрым затенением (--shading, по умолчанию fast): время
+// рядом и расхождение изображений после квантования с тем же допуском, что у --compare-precision.
+// Блинн-Фонг - другая форма блика, поэтому его расхождение только выводится и не проверяется.
+// Быстрое изображение сохраняется в output_fast.ppm. Возвращает код завершения.
+template <typename Real>
+int compareShading(const RenderOptions& options, const SceneDescription& description) {
+    ParallelRaycasterT<Real> raycaster(options.width, options.height, description);
+    configureRaycaster(raycaster, options);
+
+    ShadingModel models[2] = { ShadingModel::Exact, options.shading == ShadingModel::Exact ? ShadingModel::Fast : options.shading };
+    double elapsed[2];
+    std::vector<ColorT<Real>> images[2];
+    for (int mode = 0; mode < 2; ++mode) {
+        raycaster.setShadingModel(models[mode]);
+        elapsed[mode] = std::numeric_limits<double>::max();
+        for (int run = 0; run < 3; ++run) {
+            TileStats stats;
+            elapsed[mode] = std::min(elapsed[mode], raycaster.renderQuiet(stats));
+        }
+        images[mode] = raycaster.getImage();
+        std::cout << shadingModelName(models[mode]) << " shading: " << elapsed[mode] * 1000.0 << " ms" << std::endl;
+    }
+    raycaster.saveToPPM("output_fast.ppm");
+    std::cout << "Shading speedup: " << elapsed[0] / elapsed[1] << "x" << std::endl;
+
+    ImageDiff diff = compareImages(images[0], images[1], options.tolerance);
+    bool checked = models[1] == ShadingModel::Fast;
+    bool passed = diff.pixelsOverTolerance * 1000 <= diff.pixelCount;
+    std::cout << "Shading diff (" << shadingModelName(models[1]) << " vs exact): max " << diff.maxDiff << "/255, mean " << diff.meanDiff
+        << ", " << diff.pixelsOverTolerance << " of " << diff.pixelCount << " pixels over tolerance "
+        << options.tolerance << " - " << (!checked ? "REPORT ONLY" : passed ? "PASS" : "FAIL") << std::endl;
+    return !checked || passed ? 0 : 2;
+}
+
+// Рендеринг анимации в одном процессе: сцена и BVH строятся один раз, между кадрами
+// двигаются только позиции и BVH сфер пересчитывается (refit). Команда потоков OpenMP
+// создается при первом кадре и живет до конца, поэтому запуск потоков тоже оплачивается
+// один раз. Кадры пишутся в нумерованные файлы сразу после рендеринга.
+template <typename Real>
+int renderAnimation(const RenderOptions& options, const SceneDescription& description, const AnimationDescription& animation) {
+    if (!animation.validate(description)) {
+        return 1;
+    }
+    double startTime = omp_get_wtime();
+    ParallelRaycasterT<Real> raycaster(options.width, options.height, description);
+    configureRaycaster(raycaster, options);
+    double setupTime = omp_get_wtime() - startTime;
+    double buildTime = raycaster.getBVH().getBuildTime();
+    std::cout << "Rendering " << animation.frameCount << " frames with " << omp_get_max_threads() << " threads"
+        << (options.wavefront ? " (wavefront)" : "") << "..." << std::endl;
+
+    int refits = 0, rebuilds = 0;
+    double updateTime = 0.0, renderTime = 0.0;
+    for (int frame = 0; frame < animation.frameCount; ++frame) {
+        double frameStart = omp_get_wtime();
+        BVHUpdate update = raycaster.applyAnimationFrame(animation, frame);
+        double updated = omp_get_wtime();
+        refits += update == BVHUpdate::Refit ? 1 : 0;
+        rebuilds += update == BVHUpdate::Rebuild ? 1 : 0;
+
+        TileStats stats;
+        raycaster.renderQuiet(stats);
+        if (options.antialias) raycaster.refineAdaptive(options.aaGridSize, options.aaThreshold);
+        double rendered = omp_get_wtime();
+        updateTime += updated - frameStart;
+        renderTime += rendered - updated;
+
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%04d.ppm", frame);
+        std::cout << "Frame " << frame + 1 << "/" << animation.frameCount << ": update "
+            << (updated - frameStart) * 1000.0 << " ms" << (update == BVHUpdate::Refit ? " (BVH refit)"
+                : update == BVHUpdate::Rebuild ? " (BVH rebuilt)" : "") << ", render "
+            << (rendered - updated) * 1000.0 << " ms" << std::endl;
+        raycaster.saveToPPM(options.framePrefix + number);
+    }
+
+    int frames = animation.frameCount;
+    std::cout << "Animation: " << frames << " frames in " << (omp_get_wtime() - startTime) << " seconds; "
+        << "scene setup " << setupTime * 1000.0 << " ms once (sphere BVH built in "
+        << buildTime * 1000.0 << " ms), per frame: update "
+        << updateTime * 1000.0 / frames << " ms (" << refits << " refits, " << rebuilds << " rebuilds), render "
+        << renderTime * 1000.0 / frames << " ms" << std::endl;
+    return 0;
+}
+
+// Хэш FNV-1a: ключ кэша сцен сервера
+uint64_t hashBytes(const unsigned char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string hashToHex(uint64_t hash) {
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash));
+    return text;
+}
+
+#ifndef _WIN32
+// Соединение на сокете: чтение строк и блоков через общий буфер, запись целиком
+class SocketConnection {
+private:
+    int fd;
+    std::vector<char> buffer;
+    size_t begin = 0, end = 0;
+
+    bool fill() {
+        begin = end = 0;
+        ssize_t received;
+        do {
+            received = ::recv(fd, buffer.data(), buffer.size(), 0);
+        } while (received < 0 && errno == EINTR);
+        if (received <= 0) return false;
+        end = static_cast<size_t>(received);
+        return true;
+    }
+
+public:
+    explicit SocketConnection(int descriptor) : fd(descriptor), buffer(1 << 16) {}
+
+    ~SocketConnection() {
+        ::close(fd);
+    }
+
+    // Строка до '\n' (без него); false при закрытии соединения или слишком длинной строке
+    bool readLine(std::string& line, size_t maxLength) {
+        line.clear();
+        for (;;) {
+            if (begin == end && !fill()) return false;
+            const char* start = buffer.data() + begin;
+            const char* newline = static_cast<const char*>(std::memchr(start, '\n', end - begin));
+            size_t length = newline ? static_cast<size_t>(newline - start) : end - begin;
+            line.append(start, length);
+            begin += length;
+            if (newline) {
+                begin++;
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+            if (line.size() > maxLength) return false;
+        }
+    }
+
+    bool readBytes(unsigned char* data, size_t size) {
+        while (size > 0) {
+            if (begin == end && !fill()) return false;
+            size_t chunk = std::min(size, end - begin);
+            std::memcpy(data, buffer.data() + begin, chunk);
+            begin += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+        return true;
+    }
+
+    bool writeAll(const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t sent = ::send(fd, bytes, size, 0);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            bytes += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    bool writeLine(const std::string& line) {
+        std::string text = line + "\n";
+        return writeAll(text.data(), text.size());
+    }
+
+    int getDescriptor() const {
+        return fd;
+    }
+
+    // Данные, уже прочитанные из сокета, но еще не разобранные (poll о них не сообщит)
+    bool hasBufferedData() const {
+        return begin != end;
+    }
+};
+
+// Задание сервера: параметры из строки запроса, сцена и результат
+struct RenderJob {
+    std::string client;                 // Очередь справедливого планировщика
+    int width = 800, height = 600;
+    uint64_t sceneHash = 0;
+    std::vector<unsigned char> sceneData;   // Пусто - сцена из кэша по sceneHash
+    bool hasCamera = false;
+    Vector3 cameraPosition, cameraTarget;
+    ImageFormat format = ImageFormat::PPM;
+    bool sharedMemory = false;          // Изображение в разделяемую память, а не в сокет
+    bool wavefront = false;
+    int maxDepth = 4;
+
+    std::string response;               // Строка ответа ("OK ..." или "ERROR ...")
+    std::vector<unsigned char> image;   // Закодированное изображение для отправки в сокет
+    bool done = false;
+};
+
+// Сервер рендеринга на Unix-сокете. Протокол строковый, по соединению - последовательность
+// запросов, каждый получает ответ в порядке поступления:
+//   RENDER size=WxH scene-bytes=N [scene=<хэш>] [camera=x,y,z,tx,ty,tz] [format=ppm|bmp]
+//          [output=socket|shm] [client=<имя>] [wavefront=0|1] [max-depth=N]
+//     затем N байт файла сцены (текст или двоичный формат). При N = 0 сцена берется
+//     из кэша по хэшу, который сервер вернул в прошлом ответе (ошибка, если в кэше
+//     несколько сцен разного размера с этим хэшем).
+//     Ответ: "OK bytes=<n> format=<ppm|bmp> scene=<хэш> cached=<0|1> render-ms=<t>" и n байт
+//     изображения, либо с output=shm - "OK shm=<имя> bytes=<n> ..." без данных: изображение
+//     лежит в объекте POSIX shm, который клиент отображает и удаляет (shm_unlink).
+//     Ошибка: "ERROR <сообщение>".
+//   STATS - "OK scenes=<n> jobs=<n> hits=<n> misses=<n>"
+//   QUIT - закрыть соединение; SHUTDOWN - остановить сервер.
+// Соединения обслуживаются своими потоками, а рендерит один исполнитель всеми потоками
+// OpenMP: задания разных клиентов (параметр client, по умолчанию - соединение) берутся
+// по кругу, по одному за раз, так что клиент с длинной очередью не задерживает остальных.
+// Сцены с построенными BVH хранятся в кэше по хэшу и размеру содержимого (вытесняется давно
+// не использованная).
+class RenderServer {
+private:
+    struct CachedScene {
+        uint64_t hash;
+        size_t bytes;                   // Размер файла сцены: различает сцены с совпавшим хэшем
+        std::unique_ptr<ParallelRaycasterT<double>> raycaster;
+    };
+
+    RenderOptions options;
+    int listenFd = -1;
+
+    std::mutex mutex;
+    std::condition_variable jobReady, jobDone;
+    std::map<std::string, std::deque<RenderJob*>> queues;  // Очередь заданий клиента
+    std::deque<std::string> rotation;   // Клиенты с заданиями в порядке обслуживания
+    bool stopping = false;
+    long long jobCount = 0, cacheHits = 0, cacheMisses = 0;
+    size_t cachedScenes = 0;
+
+    std::list<CachedScene> cache;       // Только поток исполнителя; в начале - недавние
+    // Потоки соединений по номеру: завершившиеся присоединяет поток приема, остальные - run()
+    // при остановке, предварительно закрыв их сокеты (openSockets и finishedConnections - под mutex)
+    std::map<int, std::thread> connectionThreads;
+    std::map<int, int> openSockets;
+    std::vector<int> finishedConnections;
+    int sharedMemoryCount = 0;
+
+    static const size_t MAX_LINE = 4096;
+    static const uint64_t MAX_SCENE_BYTES = 1ull << 32;
+
+    // Разбор строки RENDER; sceneBytes - размер следующей за ней сцены
+    static bool parseRequest(std::istringstream& in, RenderJob& job, uint64_t& sceneBytes, std::string& error) {
+        sceneBytes = 0;
+        std::string field;
+        while (in >> field) {
+            size_t separator = field.find('=');
+            std::string key = field.substr(0, separator);
+            std::string value = separator == std::string::npos ? "" : field.substr(separator + 1);
+            bool ok = true;
+            if (key == "size") {
+                ok = parseSize(value, job.width, job.height) && job.width <= 16384 && job.height <= 16384;
+            }
+            else if (key == "scene-bytes") {
+                sceneBytes = std::strtoull(value.c_str(), nullptr, 10);
+                ok = sceneBytes <= MAX_SCENE_BYTES;
+            }
+            else if (key == "scene") {
+                job.sceneHash = std::strtoull(value.c_str(), nullptr, 16);
+            }
+            else if (key == "camera") {
+                // Координаты камеры могут быть отрицательными - parseList здесь не подходит
+                std::istringstream list(value);
+                std::vector<double> v;
+                std::string item;
+                while (ok && std::getline(list, item, ',')) {
+                    char* itemEnd = nullptr;
+                    v.push_back(std::strtod(item.c_str(), &itemEnd));
+                    ok = !item.empty() && *itemEnd == '\0';
+                }
+                ok = ok && v.size() == 6;
+                if (ok) {
+                    job.hasCamera = true;
+                    job.cameraPosition = Vector3(v[0], v[1], v[2]);
+                    job.cameraTarget = Vector3(v[3], v[4], v[5]);
+                }
+            }
+            else if (key == "format") {
+                ok = value == "ppm" || value == "bmp";
+                job.format = value == "bmp" ? ImageFormat::BMP : ImageFormat::PPM;
+            }
+            else if (key == "output") {
+                ok = value == "socket" || value == "shm";
+                job.sharedMemory = value == "shm";
+            }
+            else if (key == "client") {
+                ok = !value.empty();
+                job.client = value;
+            }
+            else if (key == "wavefront") {
+                job.wavefront = value == "1";
+            }
+            else if (key == "max-depth") {
+                job.maxDepth = std::atoi(value.c_str());
+                ok = job.maxDepth >= 0 && job.maxDepth <= MAX_TRACE_DEPTH;
+            }
+            else {
+                ok = false;
+            }
+            if (!ok) {
+                error = "invalid field " + field;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Постановка задания в очередь клиента и ожидание результата
+    void submit(RenderJob& job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stopping) {
+            job.response = "ERROR server is shutting down";
+            return;
+        }
+        std::deque<RenderJob*>& queue = queues[job.client];
+        if (queue.empty()) rotation.push_back(job.client);
+        queue.push_back(&job);
+        jobReady.notify_one();
+        jobDone.wait(lock, [&job] { return job.done; });
+    }
+
+    // Следующее задание по кругу клиентов; nullptr после остановки
+    RenderJob* takeJob() {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobReady.wait(lock, [this] { return stopping || !rotation.empty(); });
+        if (stopping) return nullptr;
+
+        std::string client = rotation.front();
+        rotation.pop_front();
+        std::deque<RenderJob*>& queue = queues[client];
+        RenderJob* job = queue.front();
+        queue.pop_front();
+        if (queue.empty()) queues.erase(client);
+        else rotation.push_back(client);
+        return job;
+    }
+
+    void finishJob(RenderJob& job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        job.done = true;
+        jobCount++;
+        cachedScenes = cache.size();
+        jobDone.notify_all();
+    }
+
+    // Рейкастер сцены из кэша или построенный заново; nullptr с сообщением при ошибке.
+    // Присланная сцена совпадает с кэшированной по хэшу и размеру; запрос только по хэшу
+    // отклоняется, если в кэше несколько сцен с этим хэшем
+    ParallelRaycasterT<double>* findScene(RenderJob& job, bool& cached, std::string& error) {
+        bool uploaded = !job.sceneData.empty();
+        if (uploaded) {
+            job.sceneHash = hashBytes(job.sceneData.data(), job.sceneData.size());
+        }
+        auto found = cache.end();
+        int matches = 0;
+        for (auto it = cache.begin(); it != cache.end(); ++it) {
+            if (it->hash == job.sceneHash && (!uploaded || it->bytes == job.sceneData.size())) {
+                if (found == cache.end()) found = it;
+                matches++;
+            }
+        }
+        cached = false;
+        if (!uploaded && matches > 1) {
+            error = "scene " + hashToHex(job.sceneHash) + " is ambiguous, send the scene again";
+            return nullptr;
+        }
+        if (found != cache.end()) {
+            cache.splice(cache.begin(), cache, found);
+            cached = true;
+            return cache.front().raycaster.get();
+        }
+        if (!uploaded) {
+            error = "scene " + hashToHex(job.sceneHash) + " is not cached";
+            return nullptr;
+        }
+
+        // Двоичная сцена читается прямо из буфера задания, который живет до конца построения
+        SceneDescription description;
+        if (!description.loadFromMemory(job.sceneData.data(), job.sceneData.size(), "scene " + hashToHex(job.sceneHash))) {
+            error = "invalid scene (see server log)";
+            return nullptr;
+        }
+        CachedScene entry;
+        entry.hash = job.sceneHash;
+        entry.bytes = job.sceneData.size();
+        entry.raycaster.reset(new ParallelRaycasterT<double>(job.width, job.height, description));
+        configureRaycaster(*entry.raycaster, options);
+        cache.push_front(std::move(entry));
+        while (cache.size() > static_cast<size_t>(options.serverCacheSize)) {
+            cache.pop_back();
+        }
+        return cache.front().raycaster.get();
+    }
+
+    // Изображение в новый объект POSIX shm; возвращает его имя или пустую строку
+    std::string writeSharedMemory(const std::vector<unsigned char>& image) {
+        std::string name = "/fonga-" + std::to_string(getpid()) + "-" + std::to_string(++sharedMemoryCount);
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) return std::string();
+        bool ok = ftruncate(fd, static_cast<off_t>(image.size())) == 0;
+        if (ok) {
+            void* view = mmap(nullptr, image.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+            ok = view != MAP_FAILED;
+            if (ok) {
+                std::memcpy(view, image.data(), image.size());
+                munmap(view, image.size());
+            }
+        }
+        ::close(fd);
+        if (!ok) {
+            shm_unlink(name.c_str());
+            return std::string();
+        }
+        return name;
+    }
+
+    // Нехватка памяти на разбор сцены или кадр отклоняет задание, а не завершает сервер
+    void execute(RenderJob& job) {
+        try {
+            executeJob(job);
+        }
+        catch (const std::bad_alloc&) {
+            job.sceneData.clear();
+            job.image.clear();
+            job.response = "ERROR out of memory";
+            std::cerr << "Job from " << job.client << ": out of memory" << std::endl;
+        }
+    }
+
+    void executeJob(RenderJob& job) {
+        bool cached = false;
+        std::string error;
+        ParallelRaycasterT<double>* raycaster = findScene(job, cached, error);
+        job.sceneData.clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            (cached ? cacheHits : cacheMisses)++;
+        }
+        if (!raycaster) {
+            job.response = "ERROR " + error;
+            return;
+        }
+
+        raycaster->setSize(job.width, job.height);
+        raycaster->setWavefrontEnabled(job.wavefront);
+        raycaster->setTraceDepth(job.maxDepth, options.rouletteDepth);
+        if (job.hasCamera) raycaster->setCamera(job.cameraPosition, job.cameraTarget);
+        else raycaster->resetCamera();
+
+        TileStats stats;
+        double seconds = raycaster->renderQuiet(stats);
+        job.image = raycaster->encode(job.format);
+
+        std::ostringstream response;
+        response << "OK ";
+        if (job.sharedMemory) {
+            std::string name = writeSharedMemory(job.image);
+            if (name.empty()) {
+                job.response = "ERROR cannot create shared memory";
+                job.image.clear();
+                return;
+            }
+            response << "shm=" << name << " ";
+        }
+        response << "bytes=" << job.image.size() << " format=" << (job.format == ImageFormat::BMP ? "bmp" : "ppm")
+            << " scene=" << hashToHex(job.sceneHash) << " cached=" << (cached ? 1 : 0) << " render-ms=" << seconds * 1000.0;
+        job.response = response.str();
+        if (job.sharedMemory) job.image.clear();
+
+        std::cout << "Job from " << job.client << ": " << job.width << "x" << job.height << ", scene "
+            << hashToHex(job.sceneHash) << (cached ? " (cached)" : "") << ", " << seconds * 1000.0 << " ms" << std::endl;
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        jobReady.notify_all();
+        // Прерывает accept в потоке приема соединений
+        ::shutdown(listenFd, SHUT_RDWR);
+    }
+
+    void serveConnection(int fd, int connectionId) {
+        SocketConnection connection(fd);
+        serveRequests(connection, connectionId);
+        // Сокет снимается с учета до закрытия: run() не закроет чужой дескриптор с тем же номером
+        std::lock_guard<std::mutex> lock(mutex);
+        openSockets.erase(connectionId);
+        finishedConnections.push_back(connectionId);
+    }
+
+    void serveRequests(SocketConnection& connection, int connectionId) {
+        std::string line;
+        while (connection.readLine(line, MAX_LINE)) {
+            std::istringstream in(line);
+            std::string command;
+            in >> command;
+            if (command == "RENDER") {
+                RenderJob job;
+                job.client = "connection-" + std::to_string(connectionId);
+                uint64_t sceneBytes = 0;
+                std::string error;
+                if (!parseRequest(in, job, sceneBytes, error)) {
+                    // Без размера сцены дальнейший поток не разобрать - соединение закрывается
+                    connection.writeLine("ERROR " + error);
+                    return;
+                }
+                try {
+                    job.sceneData.resize(static_cast<size_t>(sceneBytes));
+                }
+                catch (const std::bad_alloc&) {
+                    connection.writeLine("ERROR out of memory");
+                    return;
+                }
+                if (!connection.readBytes(job.sceneData.data(), job.sceneData.size())) return;
+
+                submit(job);
+                if (!connection.writeLine(job.response)) return;
+                if (!job.image.empty() && !connection.writeAll(job.image.data(), job.image.size())) return;
+            }
+            else if (command == "STATS") {
+                std::ostringstream response;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    response << "OK scenes=" << cachedScenes << " jobs=" << jobCount << " hits=" << cacheHits
+                        << " misses=" << cacheMisses;
+                }
+                if (!connection.writeLine(response.str())) return;
+            }
+            else if (command == "QUIT") {
+                return;
+            }
+            else if (command == "SHUTDOWN") {
+                connection.writeLine("OK");
+                stop();
+                return;
+            }
+            else if (!connection.writeLine("ERROR unknown command " + command)) {
+                return;
+            }
+        }
+    }
+
+    void acceptLoop() {
+        int connectionId = 0;
+        for (;;) {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            std::vector<int> finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) {
+                    ::close(fd);
+                    break;
+                }
+                openSockets[++connectionId] = fd;
+                finished.swap(finishedConnections);
+            }
+            for (int id : finished) {
+                connectionThreads[id].join();
+                connectionThreads.erase(id);
+            }
+            // Поток соединения живет, пока клиент не закроет сокет или сервер не остановится
+            connectionThreads[connectionId] = std::thread(&RenderServer::serveConnection, this, fd, connectionId);
+        }
+    }
+
+public:
+    explicit RenderServer(const RenderOptions& renderOptions) : options(renderOptions) {}
+
+    // Прием соединений и исполнение заданий до команды SHUTDOWN; возвращает код завершения
+    int run() {
+        const std::string& path = options.serverSocket;
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "Socket path is too long: " << path << std::endl;
+            return 1;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        // Запись в закрытый клиентом сокет должна давать ошибку, а не завершать процесс
+        signal(SIGPIPE, SIG_IGN);
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        ::unlink(path.c_str());
+        if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listenFd, 64) != 0) {
+            std::cerr << "Cannot listen on socket " << path << ": " << std::strerror(errno) << std::endl;
+            if (listenFd >= 0) ::close(listenFd);
+            return 1;
+        }
+        std::cout << "Render server listening on " << path << " (" << omp_get_max_threads() << " threads, "
+            << options.serverCacheSize << " cached scenes)" << std::endl;
+
+        std::thread acceptor(&RenderServer::acceptLoop, this);
+        while (RenderJob* job = takeJob()) {
+            execute(*job);
+            finishJob(*job);
+        }
+
+        // Задания, оставшиеся в очередях, получают отказ
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& entry : queues) {
+                for (RenderJob* job : entry.second) {
+                    job->response = "ERROR server is shutting down";
+                    job->done = true;
+                }
+            }
+            queues.clear();
+            rotation.clear();
+            jobDone.notify_all();
+        }
+        acceptor.join();
+
+        // Открытые соединения прерываются; потоки используют сервер, поэтому дожидаемся всех
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& entry : openSockets) ::shutdown(entry.second, SHUT_RDWR);
+        }
+        for (auto& entry : connectionThreads) entry.second.join();
+        connectionThreads.clear();
+        ::close(listenFd);
+        ::unlink(path.c_str());
+        std::cout << "Render server stopped after " << jobCount << " jobs" << std::endl;
+        return 0;
+    }
+};
+
+int runServer(const RenderOptions& options) {
+    RenderServer server(options);
+    return server.run();
+}
+#else
+int runServer(const RenderOptions& options) {
+    std::cerr << "Server mode needs Unix domain sockets and is not available on this platform: "
+        << options.serverSocket << std::endl;
+    return 1;
+}
+#endif
+
+#ifndef _WIN32
+// Распределенный рендеринг одного кадра: координатор запускает рабочие процессы (эта же
+// программа с теми же параметрами и --worker <сокет>), раздает им полосы из целых рядов
+// тайлов и собирает пиксели в свой кадр. Разбиение на тайлы то же, что в одном процессе,
+// поэтому изображение совпадает побитово. Полосы потерянного рабочего отдаются остальным;
+// если не осталось ни одного, координатор дорисовывает их сам.
+//
+// Протокол на паре сокетов (строки; пиксели - в точности рендеринга):
+//   координатор -> рабочий: BAND <y0> <y1>
+//   рабочий -> координатор: DONE <y0> <y1> <байт>, затем пиксели строк [y0, y1)
+template <typename Real>
+int runWorker(const RenderOptions& options, const SceneDescription& description) {
+    // Процессор делится между рабочими поровну
+    if (options.workers > 0) omp_set_num_threads(std::max(1, omp_get_max_threads() / options.workers));
+    ParallelRaycasterT<Real> raycaster(options.width, options.height, description);
+    configureRaycaster(raycaster, options);
+
+    // Запись в сокет завершившегося координатора должна давать ошибку, а не завершать процесс
+    signal(SIGPIPE, SIG_IGN);
+    SocketConnection connection(options.workerFd);
+    std::vector<ColorT<Real>> pixels;
+    std::string line;
+    while (connection.readLine(line, 256)) {
+        std::istringstream in(line);
+        std::string command;
+        int y0 = 0, y1 = 0;
+        if (!(in >> command >> y0 >> y1) || command != "BAND" || y0 < 0 || y1 <= y0 || y1 > options.height) {
+            std::cerr << "Worker: invalid request: " << line << std::endl;
+            return 1;
+        }
+        TileStats stats;
+        raycaster.renderBand(y0, y1, pixels, stats);
+        size_t bytes = pixels.size() * sizeof(ColorT<Real>);
+        if (!connection.writeLine("DONE " + std::to_string(y0) + " " + std::to_string(y1) + " " + std::to_string(bytes))
+            || !connection.writeAll(pixels.data(), bytes)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Рабочий процесс со стороны координатора
+struct WorkerProcess {
+    pid_t pid = -1;
+    std::unique_ptr<SocketConnection> connection;   // Пусто - рабочий потерян
+    std::deque<int> bands;              // Выданные полосы (первые строки) в порядке выдачи
+    int completed = 0;
+};
+
+// Запуск копии программы с теми же аргументами в режиме рабочего
+bool spawnWorker(int argc, char* argv[], WorkerProcess& worker) {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        std::cerr << "Cannot create socket pair: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // Конец координатора не должен наследоваться следующими рабочими
+    ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    std::string fdText = std::to_string(fds[1]);
+    std::string workerFlag = "--worker";
+    std::vector<char*> args(argv, argv + argc);
+    args.push_back(&workerFlag[0]);
+    args.push_back(&fdText[0]);
+    args.push_back(nullptr);
+
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        std::cerr << "Cannot start worker: " << std::strerror(errno) << std::endl;
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // Вывод рабочего не смешивается с выводом координатора; ошибки остаются в stderr
+        int devNull = ::open("/dev/null", O_WRONLY);
+        if (devNull >= 0) ::dup2(devNull, STDOUT_FILENO);
+        ::execv("/proc/self/exe", args.data());
+        ::execvp(argv[0], args.data());
+        _exit(127);
+    }
+    ::close(fds[1]);
+    worker.pid = pid;
+    worker.connection.reset(new SocketConnection(fds[0]));
+    return true;
+}
+
+// Потеря рабочего (закрыл сокет, прислал неверный ответ): его полосы возвращаются в начало очереди
+void dropWorker(WorkerProcess& worker, std::deque<int>& pending, int& reassigned) {
+    std::cerr << "Worker " << worker.pid << " lost, reassigning " << worker.bands.size() << " bands" << std::endl;
+    pending.insert(pending.begin(), worker.bands.begin(), worker.bands.end());
+    reassigned += static_cast<int>(worker.bands.size());
+    worker.bands.clear();
+    worker.connection.reset();
+    ::kill(worker.pid, SIGKILL);
+    ::waitpid(worker.pid, nullptr, 0);
+}
+
+template <typename Real>
+int renderDistributed(const RenderOptions& options, const SceneDescription& description, int argc, char* argv[]) {
+    if (options.streamBandHeight > 0 || !options.heatmapPath.empty()) {
+        std::cerr << "Streaming and heatmap are not supported with --workers" << std::endl;
+        return 1;
+    }
+    ParallelRaycasterT<Real> raycaster(options.width, options.height, description);
+    configureRaycaster(raycaster, options);
+
+    double startTime = omp_get_wtime();
+    int width = options.width, height = options.height;
+    int tileSize = std::max(1, options.tileSize);
+    int bandRows = options.workerBandRows > 0 ? options.workerBandRows : 4 * tileSize;
+    bandRows = (bandRows + tileSize - 1) / tileSize * tileSize;
+    std::deque<int> pending;
+    for (int y0 = 0; y0 < height; y0 += bandRows) pending.push_back(y0);
+    int bandCount = static_cast<int>(pending.size());
+
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<WorkerProcess> workers(options.workers);
+    int alive = 0;
+    for (auto& worker : workers) {
+        if (spawnWorker(argc, argv, worker)) alive++;
+    }
+    std::cout << "Starting distributed render with " << alive << " worker processes (" << bandCount << " bands of "
+        << bandRows << " rows)..." << std::endl;
+
+    raycaster.allocateFramebuffer(height);
+    std::vector<ColorT<Real>> pixels;
+    int completed = 0, reassigned = 0;
+    while (completed < bandCount && alive > 0) {
+        // Не больше двух полос на рабочего: следующая ждет в сокете, пока рендерится текущая
+        for (auto& worker : workers) {
+            while (worker.connection && worker.bands.size() < 2 && !pending.empty()) {
+                int y0 = pending.front();
+                int y1 = std::min(height, y0 + bandRows);
+                if (!worker.connection->writeLine("BAND " + std::to_string(y0) + " " + std::to_string(y1))) {
+                    dropWorker(worker, pending, reassigned);
+                    alive--;
+                    break;
+                }
+                worker.bands.push_back(y0);
+                pending.pop_front();
+            }
+        }
+
+        // Ожидание ответов; данные, уже лежащие в буфере соединения, разбираются без poll
+        std::vector<pollfd> fds;
+        std::vector<WorkerProcess*> polled;
+        bool buffered = false;
+        for (auto& worker : workers) {
+            if (!worker.connection || worker.bands.empty()) continue;
+            pollfd entry;
+            entry.fd = worker.connection->getDescriptor();
+            entry.events = POLLIN;
+            entry.revents = worker.connection->hasBufferedData() ? POLLIN : 0;
+            buffered = buffered || entry.revents != 0;
+            fds.push_back(entry);
+            polled.push_back(&worker);
+        }
+        if (fds.empty()) continue;
+        if (!buffered && ::poll(fds.data(), static_cast<nfds_t>(fds.size()), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+            WorkerProcess& worker = *polled[i];
+            int y0 = worker.bands.front();
+            int y1 = std::min(height, y0 + bandRows);
+            size_t expected = static_cast<size_t>(width) * (y1 - y0) * sizeof(ColorT<Real>);
+
+            std::string line, command;
+            int doneY0 = -1, doneY1 = -1;
+            size_t bytes = 0;
+            bool received = worker.connection->readLine(line, 256);
+            if (received) {
+                std::istringstream in(line);
+                received = (in >> command >> doneY0 >> doneY1 >> bytes) && command == "DONE"
+                    && doneY0 == y0 && doneY1 == y1 && bytes == expected;
+            }
+            if (received) {
+                pixels.resize(expected / sizeof(ColorT<Real>));
+                received = worker.connection->readBytes(reinterpret_cast<unsigned char*>(pixels.data()), bytes);
+            }
+            if (!received) {
+                dropWorker(worker, pending, reassigned);
+                alive--;
+                continue;
+            }
+
+            raycaster.storeBand(y0, y1 - y0, pixels.data());
+            worker.bands.pop_front();
+            worker.completed++;
+            completed++;
+            if (completed * 10 / bandCount != (completed - 1) * 10 / bandCount) {
+                std::cout << "Progress: " << completed * 100 / bandCount << "%\n" << std::flush;
+            }
+        }
+    }
+
+    if (completed < bandCount) {
+        std::cerr << "No workers left, rendering " << pending.size() << " bands in the coordinator" << std::endl;
+        TileStats stats;
+        for (int y0 : pending) {
+            raycaster.renderRows(y0, std::min(height, y0 + bandRows), 0, false, stats);
+        }
+    }
+
+    // Рабочие завершаются, прочитав конец потока
+    for (auto& worker : workers) {
+        if (!worker.connection) continue;
+        worker.connection.reset();
+        ::waitpid(worker.pid, nullptr, 0);
+    }
+
+    std::cout << "Distributed render completed in " << (omp_get_wtime() - startTime) << " seconds (bands per worker:";
+    for (size_t i = 0; i < workers.size(); ++i) {
+        std::cout << (i == 0 ? " " : ", ") << workers[i].completed;
+    }
+    std::cout << "; " << reassigned << " reassigned)" << std::endl;
+
+    refineAndSave(raycaster, options);
+    return 0;
+}
+#else
+template <typename Real>
+int runWorker(const RenderOptions&, const SceneDescription&) {
+    std::cerr << "Worker mode is not available on this platform" << std::endl;
+    return 1;
+}
+
+template <typename Real>
+int renderDistributed(const RenderOptions&, const SceneDescription&, int, char*[]) {
+    std::cerr << "Distributed rendering needs fork and Unix domain sockets and is not available on this platform" << std::endl;
+    return 1;
+}
+#endif
+
+// Результат одного замера серии
+struct BenchmarkResult {
+    int spheres, lights, width, height;
+    double occlusion;
+    int threads;
+    double seconds;                     // Лучшее время из повторов
+    RayCounters counters;
+    double raysPerSecond;               // Первичные и теневые лучи в секунду
+    double testsPerRay;                 // Проверок луч-примитив на луч
+    double speedup;                     // Ускорение относительно первого числа потоков серии
+    double efficiency;                  // Ускорение, отнесенное к приросту числа потоков
+};
+
+// Ключ конфигурации для сравнения с базовым прогоном: те же поля и форматирование, что в CSV
+std::string benchmarkKey(const std::string& precision, int spheres, int lights, int width, int height, double occlusion, int threads) {
+    std::ostringstream key;
+    key << precision << "," << spheres << "," << lights << "," << width << "," << height << "," << occlusion << "," << threads;
+    return key.str();
+}
+
+bool writeBenchmarkReport(const std::string& filename, const std::string& precision, SimdLevel level,
+    const std::vector<BenchmarkResult>& results) {
+    std::ofstream file(filename);
+    if (!file) {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+
+    bool json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+    if (json) {
+        file << "[\n";
+    }
+    else {
+        file << "precision,spheres,lights,width,height,occlusion,threads,simd,seconds,primary_rays,shadow_rays,"
+            << "sphere_tests,triangle_tests,rays_per_second,tests_per_ray,speedup,efficiency\n";
+    }
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& r = results[i];
+        if (json) {
+            file << "  {\"precision\": \"" << precision << "\", \"spheres\": " << r.spheres << ", \"lights\": " << r.lights
+                << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"occlusion\": " << r.occlusion
+                << ", \"threads\": " << r.threads << ", \"simd\": \"" << simdLevelName(level) << "\", \"seconds\": " << r.seconds
+                << ", \"primary_rays\": " << r.counters.primaryRays << ", \"shadow_rays\": " << r.counters.shadowRays
+                << ", \"sphere_tests\": " << r.counters.sphereTests << ", \"triangle_tests\": " << r.counters.triangleTests
+                << ", \"rays_per_second\": " << r.raysPerSecond
+                << ", \"tests_per_ray\": " << r.testsPerRay << ", \"speedup\": " << r.speedup
+                << ", \"efficiency\": " << r.efficiency << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        else {
+            file << benchmarkKey(precision, r.spheres, r.lights, r.width, r.height, r.occlusion, r.threads) << ","
+                << simdLevelName(level) << "," << r.seconds << "," << r.counters.primaryRays << "," << r.counters.shadowRays << ","
+                << r.counters.sphereTests << "," << r.counters.triangleTests << "," << r.raysPerSecond << "," << r.testsPerRay << ","
+                << r.speedup << "," << r.efficiency << "\n";
+        }
+    }
+    if (json) file << "]\n";
+    return static_cast<bool>(file);
+}
+
+// Сравнение с CSV предыдущей версии: конфигурации, у которых лучей в секунду стало меньше
+// более чем на tolerance процентов, считаются регрессией. Возвращает число регрессий или -1.
+int compareBenchmarkBaseline(const std::string& filename, const std::string& precision,
+    const std::vector<BenchmarkResult>& results, double tolerance) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Cannot open baseline: " << filename << std::endl;
+        return -1;
+    }
+
+    // Столбцы ищутся по заголовку, чтобы базовый файл мог содержать и другие поля
+    auto split = [](const std::string& line) {
+        std::vector<std::string> fields;
+        std::istringstream in(line);
+        std::string field;
+        while (std::getline(in, field, ',')) fields.push_back(field);
+        return fields;
+    };
+    std::string line;
+    std::getline(file, line);
+    std::vector<std::string> header = split(line);
+    const char* keyColumns[] = { "precision", "spheres", "lights", "width", "height", "occlusion", "threads", "rays_per_second" };
+    std::vector<size_t> columns;
+    for (const char* name : keyColumns) {
+        size_t column = std::find(header.begin(), header.end(), name) - header.begin();
+        if (column == header.size()) {
+            std::cerr << "Baseline has no column " << name << ": " << filename << std::endl;
+            return -1;
+        }
+        columns.push_back(column);
+    }
+
+    std::vector<std::pair<std::string, double>> baseline;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields = split(line);
+        if (fields.size() < header.size()) continue;
+        std::string key = fields[columns[0]];
+        for (size_t i = 1; i + 1 < columns.size(); ++i) {
+            key += "," + fields[columns[i]];
+        }
+        baseline.push_back(std::make_pair(key, std::atof(fields[columns.back()].c_str())));
+    }
+
+    int regressions = 0, matched = 0;
+    for (const auto& r : results) {
+        std::string key = benchmarkKey(precision, r.spheres, r.lights, r.width, r.height, r.occlusion, r.threads);
+        for (const auto& entry : baseline) {
+            if (entry.first != key || entry.second <= 0) continue;
+            matched++;
+            double change = (r.raysPerSecond / entry.second - 1) * 100.0;
+            if (change < -tolerance) {
+                regressions++;
+                std::cout << "REGRESSION " << key << ": " << entry.second << " -> " << r.raysPerSecond
+                    << " rays/s (" << change << "%)" << std::endl;
+            }
+        }
+    }
+    std::cout << "Baseline " << filename << ": " << matched << " configurations compared, " << regressions
+        << " slower by more than " << tolerance << "%" << std::endl;
+    return regressions;
+}
+
+// Серия замеров по всем сочетаниям параметров сцены, разрешения и числа потоков.
+// Возвращает код завершения: 0, 1 при ошибке, 3 при регрессии относительно базового прогона.
+template <typename Real>
+int runBenchmark(const RenderOptions& options) {
+    std::string precision = sizeof(Real) == sizeof(float) ? "float" : "double";
+    std::vector<int> threadCounts = options.benchThreads;
+    if (threadCounts.empty()) {
+        int processors = omp_get_num_procs();
+        for (int n = 1; n < processors; n *= 2) threadCounts.push_back(n);
+        threadCounts.push_back(processors);
+    }
+
+#if FONGA_STATS == 0
+    std::cerr << "Ray counters are disabled (FONGA_STATS=0): rays/s and tests/ray will be zero" << std::endl;
+#endif
+    std::cout << "Benchmark: " << precision << " precision, " << simdLevelName(options.simdLevel) << " kernel, best of "
+        << options.benchRepeat << " runs" << std::endl;
+    std::cout << "spheres lights size occlusion threads: seconds, Mrays/s, tests/ray, efficiency" << std::endl;
+
+    std::vector<BenchmarkResult> results;
+    int savedThreads = omp_get_max_threads();
+    omp_set_dynamic(0);
+    for (int spheres : options.benchSpheres) {
+        for (int lights : options.benchLights) {
+            for (double occlusion : options.benchOcclusion) {
+                SceneDescription description = SceneDescription::createRandom(spheres, lights, occlusion, 12345u);
+                for (const auto& surface : options.surfaces) {
+                    if (!addSurface(description, surface)) return 1;
+                }
+                for (const auto& size : options.benchSizes) {
+                    ParallelRaycasterT<Real> raycaster(size.first, size.second, description);
+                    raycaster.setSimdLevel(options.simdLevel);
+                    raycaster.setTileSize(options.tileSize);
+
+                    double baseSeconds = 0.0;
+                    for (size_t t = 0; t < threadCounts.size(); ++t) {
+                        BenchmarkResult r;
+                        r.spheres = spheres;
+                        r.lights = lights;
+                        r.width = size.first;
+                        r.height = size.second;
+                        r.occlusion = occlusion;
+                        r.threads = threadCounts[t];
+
+                        omp_set_num_threads(r.threads);
+                        r.seconds = std::numeric_limits<double>::max();
+                        for (int run = 0; run < options.benchRepeat; ++run) {
+                            TileStats stats;
+                            r.seconds = std::min(r.seconds, raycaster.renderQuiet(stats));
+                        }
+                        r.counters = raycaster.getCounters();
+
+                        long long rays = r.counters.primaryRays + r.counters.shadowRays;
+                        r.raysPerSecond = rays / r.seconds;
+                        r.testsPerRay = rays > 0 ? static_cast<double>(r.counters.sphereTests + r.counters.triangleTests) / rays : 0.0;
+                        if (t == 0) baseSeconds = r.seconds;
+                        r.speedup = baseSeconds / r.seconds;
+                        r.efficiency = r.speedup * threadCounts[0] / r.threads;
+                        results.push_back(r);
+
+                        std::cout << spheres << " " << lights << " " << r.width << "x" << r.height << " " << occlusion << " "
+                            << r.threads << ": " << r.seconds << " s, " << r.raysPerSecond / 1e6 << " Mrays/s, "
+                            << r.testsPerRay << " tests/ray, " << r.efficiency * 100.0 << "%" << std::endl;
+                    }
+                }
+            }
+        }
+    }
+    omp_set_num_threads(savedThreads);
+
+    if (!writeBenchmarkReport(options.benchOutput, precision, options.simdLevel, results)) {
+        return 1;
+    }
+    std::cout << "Benchmark report saved to: " << options.benchOutput << std::endl;
+
+    if (!options.benchBaseline.empty()) {
+        int regressions = compareBenchmarkBaseline(options.benchBaseline, precision, results, options.benchTolerance);
+        if (regressions < 0) return 1;
+        if (regressions > 0) return 3;
+    }
+    return 0;
+}
+
+// След тайлов в буфере кадра: сколько в среднем страниц памяти (4 КБ) затрагивает тайл - записей
+// TLB, нужных потоку на тайл, и сколько строк кэша (64 байта) тайла делит с другими тайлами -
+// кандидатов на ложное разделение, когда соседние тайлы достаются разным потокам.
+// Считается от начала буфера, выровненного по строке кэша.
+struct FramebufferFootprint {
+    double pagesPerTile = 0.0;
+    double sharedLinesPerTile = 0.0;
+};
+
+FramebufferFootprint measureFramebufferFootprint(FramebufferLayout layout, int width, int height, int tileSize, size_t pixelBytes) {
+    const size_t lineBytes = 64, pageBytes = 4096;
+    FramebufferTiling tiling;
+    tiling.configure(layout, width, height, tileSize);
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+
+    // Владелец строки кэша: первый писавший в нее тайл, -2 - несколько тайлов
+    std::vector<int> owners((tiling.getPixelCount() * pixelBytes + lineBytes - 1) / lineBytes, -1);
+    long long pages = 0, sharedLines = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int ty = 0; ty < tilesY; ++ty) {
+            for (int tx = 0; tx < tilesX; ++tx) {
+                int tile = ty * tilesX + tx;
+                int x0 = tx * tileSize, x1 = std::min(width, x0 + tileSize);
+                // Строки тайла лежат в памяти по возрастанию адресов в обеих раскладках
+                size_t lastPage = std::numeric_limits<size_t>::max(), lastLine = lastPage;
+                for (int y = ty * tileSize; y < std::min(height, (ty + 1) * tileSize); ++y) {
+                    size_t begin = tiling.index(x0, y) * pixelBytes;
+                    size_t end = begin + (x1 - x0) * pixelBytes;
+                    for (size_t line = begin / lineBytes; line <= (end - 1) / lineBytes; ++line) {
+                        if (pass == 0) {
+                            if (owners[line] == -1) owners[line] = tile;
+                            else if (owners[line] != tile) owners[line] = -2;
+                        }
+                        else if (line != lastLine && owners[line] == -2) {
+                            sharedLines++;
+                        }
+                        lastLine = line;
+                    }
+                    for (size_t page = begin / pageBytes; pass == 0 && page <= (end - 1) / pageBytes; ++page) {
+                        if (page != lastPage) pages++;
+                        lastPage = page;
+                    }
+                }
+            }
+        }
+    }
+
+    FramebufferFootprint footprint;
+    double tiles = static_cast<double>(tilesX) * tilesY;
+    footprint.pagesPerTile = pages / tiles;
+    footprint.sharedLinesPerTile = sharedLines / tiles;
+    return footprint;
+}
+
+// Замеры раскладок кадра (--benchmark --bench-framebuffer): для каждого размера из --bench-sizes
+// и тайла из --bench-tile-sizes - проход записи без трассировки (ложное разделение и TLB видны
+// на мелких тайлах и больших кадрах), полный рендеринг встроенной сцены и вывод в PPM
+// (перевод в линейный порядок). Все потоки, лучшее из benchRepeat.
+template <typename Real>
+int runFramebufferBenchmark(const RenderOptions& options) {
+    std::cout << "Framebuffer layout benchmark: " << (sizeof(Real) == sizeof(float) ? "float" : "double") << " precision, "
+        << framebufferFormatName(options.framebuffer) << " format, " << omp_get_max_threads() << " threads, best of "
+        << options.benchRepeat << " runs" << std::endl;
+    std::cout << "size tile layout: fill ms (Mpixels/s), render ms, export ms; pages/tile, shared cache lines/tile" << std::endl;
+
+    SceneDescription description = SceneDescription::createDefault();
+    const FramebufferLayout layouts[2] = { FramebufferLayout::Linear, FramebufferLayout::Tiled };
+    for (const auto& size : options.benchSizes) {
+        ParallelRaycasterT<Real> raycaster(size.first, size.second, description);
+        raycaster.setSimdLevel(options.simdLevel);
+        raycaster.setFramebufferFormat(options.framebuffer);
+        for (int tileSize : options.benchTileSizes) {
+            raycaster.setTileSize(tileSize);
+            double seconds[2][3];
+            for (int l = 0; l < 2; ++l) {
+                raycaster.setFramebufferLayout(layouts[l]);
+                double* best = seconds[l];
+                std::fill(best, best + 3, std::numeric_limits<double>::max());
+                for (int run = 0; run < options.benchRepeat; ++run) {
+                    TileStats stats;
+                    best[0] = std::min(best[0], raycaster.fillQuiet(stats));
+                }
+                for (int run = 0; run < options.benchRepeat; ++run) {
+                    TileStats stats;
+                    best[1] = std::min(best[1], raycaster.renderQuiet(stats));
+                    double exportStart = omp_get_wtime();
+                    std::vector<unsigned char> bytes = raycaster.encode(ImageFormat::PPM);
+                    best[2] = std::min(best[2], omp_get_wtime() - exportStart);
+                }
+
+                FramebufferTiling tiling;
+                tiling.configure(layouts[l], size.first, size.second, tileSize);
+                size_t pixelBytes = raycaster.getFramebufferBytes() / tiling.getPixelCount();
+                FramebufferFootprint footprint = measureFramebufferFootprint(layouts[l], size.first, size.second, tileSize, pixelBytes);
+                std::cout << size.first << "x" << size.second << " " << tileSize << " " << framebufferLayoutName(layouts[l]) << ": "
+                    << best[0] * 1000.0 << " ms (" << static_cast<double>(size.first) * size.second / best[0] / 1e6 << "), "
+                    << best[1] * 1000.0 << " ms, " << best[2] * 1000.0 << " ms; " << footprint.pagesPerTile << ", "
+                    << footprint.sharedLinesPerTile << std::endl;
+            }
+            std::cout << "  tiled speedup: fill " << seconds[0][0] / seconds[1][0] << "x, render " << seconds[0][1] / seconds[1][1]
+                << "x, export " << seconds[0][2] / seconds[1][2] << "x" << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Регрессионный прогон: фиксированный набор сцен в малом разрешении сравнивается с эталонными
+// изображениями, рядом с расхождением записывается время рендеринга. Каждый случай включает свою
+// часть рейкастера (точность, волновой рендеринг, отбор источников, линза, компактный буфер,
+// модель затенения), поэтому оптимизация любой из них проверяется одним запуском.
+//
+// Эталоны 160x120 хранятся в репозитории (Лабораторная 8/Fonga/regression). Запуск из каталога
+// проекта: "Fonga --regression" (или "--regression <каталог>"); код возврата 0 - все случаи
+// прошли, 2 - есть расхождения или нет эталона (изображение случая пишется в regression_<случай>.ppm).
+// После намеренного изменения изображения эталоны обновляются: "Fonga --regression --update-golden".
+struct RegressionCase {
+    std::string name;
+    std::string scene;                  // Сцена из createRegressionScene
+    RenderOptions options;
+    bool binaryScene = false;           // Сцена передается как серверу: двоичный буфер через loadFromMemory
+};
+
+struct RegressionResult {
+    std::string name;
+    double seconds = 0.0;
+    std::string checksum;
+    std::string goldenChecksum;
+    ImageDiff diff;
+    std::string status;                 // EXACT, PASS, FAIL, NEW или MISSING
+};
+
+SceneDescription createRegressionScene(const std::string& name) {
+    if (name == "random") {
+        return SceneDescription::createRandom(300, 4, 0.3, 12345u);
+    }
+    if (name == "lights") {
+        // Сетка слабых источников с ограниченным радиусом над полом
+        SceneDescription scene = SceneDescription::createRandom(200, 0, 0.0, 777u);
+        for (int i = 0; i < 24; ++i) {
+            Light light(Vector3(-6 + 2.4 * (i % 6), 0.5, -6 - 3.5 * (i / 6)), Color(0.5, 0.5, 0.5),
+                Color(0.5, 0.5, 0.5), Color(0.01, 0.01, 0.01));
+            light.range = 4.0;
+            scene.lights.push_back(light);
+        }
+        return scene;
+    }
+
+    SceneDescription scene = SceneDescription::createDefault();
+    if (name == "surfaces") {
+        addSurface(scene, "torus:32");
+        addSurface(scene, "mobius:32:4");
+    }
+    else if (name == "glass") {
+        // Зеркальная и стеклянная сферы: вторичные лучи и русская рулетка
+        scene.materials[0].reflectivity = 0.5;
+        scene.materials[2].transparency = 0.8;
+        scene.materials[2].refractiveIndex = 1.5;
+    }
+    return scene;
+}
+
+std::vector<RegressionCase> createRegressionCases(const RenderOptions& base) {
+    // Из параметров командной строки берется только ядро (--simd): изображение от него не зависит.
+    // Размер тайла фиксирован - стохастическая выборка идет из списков источников по тайлам
+    RenderOptions options;
+    options.width = 160;
+    options.height = 120;
+    options.simdLevel = base.simdLevel;
+
+    std::vector<RegressionCase> cases;
+    auto add = [&cases](const std::string& name, const std::string& scene, const RenderOptions& caseOptions) {
+        RegressionCase c;
+        c.name = name;
+        c.scene = scene;
+        c.options = caseOptions;
+        cases.push_back(c);
+    };
+
+    add("default", "default", options);
+
+    RenderOptions single = options;
+    single.useFloat = true;
+    add("default-float", "default", single);
+
+    add("random", "random", options);
+    add("surfaces", "surfaces", options);
+    add("glass", "glass", options);
+
+    RenderOptions wavefront = options;
+    wavefront.wavefront = true;
+    add("glass-wavefront", "glass", wavefront);
+
+    RenderOptions culling = options;
+    culling.lightCulling = true;
+    add("lights-culling", "lights", culling);
+
+    RenderOptions sampling = culling;
+    sampling.lightSamples = 4;
+    add("lights-samples", "lights", sampling);
+
+    RenderOptions lens = options;
+    lens.hasCamera = true;
+    lens.cameraPosition = Vector3(0.5, 0.5, 0);
+    lens.cameraTarget = Vector3(0, 0, -5);
+    lens.fov = 60.0;
+    lens.aperture = 0.15;
+    lens.lensSamples = 4;
+    add("depth-of-field", "default", lens);
+
+    RenderOptions compact = options;
+    compact.framebuffer = FramebufferFormat::Half;
+    add("framebuffer-half", "glass", compact);
+
+    RenderOptions tiled = compact;
+    tiled.framebufferLayout = FramebufferLayout::Tiled;
+    add("framebuffer-half-tiled", "glass", tiled);
+
+    RenderOptions fast = options;
+    fast.shading = ShadingModel::Fast;
+    add("shading-fast", "random", fast);
+
+    RenderOptions blinn = wavefront;
+    blinn.shading = ShadingModel::Blinn;
+    add("shading-blinn-wavefront", "glass", blinn);
+
+    // Сцена, полученная сервером в двоичном виде, должна совпадать с эталоном surfaces
+    add("surfaces-server-binary", "surfaces", options);
+    cases.back().binaryScene = true;
+    return cases;
+}
+
+// Лучшее время из repeat запусков; изображение - в виде файла PPM
+template <typename Real>
+double renderRegressionCase(const RegressionCase& c, int repeat, std::vector<unsigned char>& ppm) {
+    SceneDescription description = createRegressionScene(c.scene);
+    // Сферы двоичного описания читаются из буфера, поэтому он живет до построения рейкастера
+    std::vector<unsigned char> sceneBytes;
+    if (c.binaryScene) {
+        std::ostringstream out(std::ios::binary);
+        description.writeBinary(out);
+        std::string bytes = out.str();
+        sceneBytes.assign(bytes.begin(), bytes.end());
+        if (!description.loadFromMemory(sceneBytes.data(), sceneBytes.size(), c.name)) {
+            ppm.clear();
+            return 0.0;
+        }
+    }
+    ParallelRaycasterT<Real> raycaster(c.options.width, c.options.height, description);
+    configureRaycaster(raycaster, c.options);
+    double seconds = std::numeric_limits<double>::max();
+    for (int run = 0; run < repeat; ++run) {
+        TileStats stats;
+        seconds = std::min(seconds, raycaster.renderQuiet(stats));
+    }
+    ppm = raycaster.encode(ImageFormat::PPM);
+    return seconds;
+}
+
+// Двоичный PPM (P6, 255): размер и смещение пикселей внутри файла
+bool parsePPM(const std::vector<unsigned char>& bytes, int& width, int& height, size_t& offset) {
+    std::string header(bytes.begin(), bytes.begin() + std::min<size_t>(bytes.size(), 64));
+    std::istringstream in(header);
+    std::string magic;
+    int maxValue = 0;
+    if (!(in >> magic >> width >> height >> maxValue) || magic != "P6" || maxValue != 255 || width <= 0 || height <= 0) {
+        return false;
+    }
+    offset = static_cast<size_t>(in.tellg()) + 1;
+    return bytes.size() >= offset + 3 * static_cast<size_t>(width) * height;
+}
+
+bool readBinaryFile(const std::string& filename, std::vector<unsigned char>& bytes) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+    bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+bool writeBinaryFile(const std::string& filename, const std::vector<unsigned char>& bytes) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(file);
+}
+
+// То же, что compareImages, но для уже квантованных пикселей RGB
+ImageDiff compareQuantized(const unsigned char* reference, const unsigned char* test, long long pixelCount, int tolerance) {
+    ImageDiff diff;
+    diff.pixelCount = pixelCount;
+    double total = 0.0;
+    for (long long i = 0; i < pixelCount; ++i) {
+        int worst = 0;
+        for (int c = 0; c < 3; ++c) {
+            int d = std::abs(static_cast<int>(reference[3 * i + c]) - static_cast<int>(test[3 * i + c]));
+            worst = std::max(worst, d);
+            total += d;
+        }
+        diff.maxDiff = std::max(diff.maxDiff, worst);
+        if (worst > tolerance) diff.pixelsOverTolerance++;
+    }
+    if (pixelCount > 0) diff.meanDiff = total / (3.0 * pixelCount);
+    return diff;
+}
+
+bool writeRegressionReport(const std::string& filename, int tolerance, const std::vector<RegressionResult>& results) {
+    std::ofstream file(filename);
+    if (!file) {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return false;
+    }
+    file << "case,milliseconds,checksum,golden_checksum,max_diff,mean_diff,pixels_over_tolerance,pixels,tolerance,status\n";
+    for (const RegressionResult& r : results) {
+        file << r.name << "," << r.seconds * 1000.0 << "," << r.checksum << "," << r.goldenChecksum << ","
+            << r.diff.maxDiff << "," << r.diff.meanDiff << "," << r.diff.pixelsOverTolerance << "," << r.diff.pixelCount << ","
+            << tolerance << "," << r.status << "\n";
+    }
+    return true;
+}
+
+// Возвращает код завершения: 0, 1 при ошибке, 2 при расхождении с эталоном или его отсутствии.
+// Изображение, не совпавшее с эталоном, сохраняется в regression_<случай>.ppm для просмотра.
+int runRegression(const RenderOptions& options) {
+    std::vector<RegressionCase> cases = createRegressionCases(options);
+    std::vector<RegressionResult> results;
+    int failures = 0;
+    for (const RegressionCase& c : cases) {
+        RegressionResult r;
+        r.name = c.name;
+        std::vector<unsigned char> ppm;
+        r.seconds = c.options.useFloat ? renderRegressionCase<float>(c, options.benchRepeat, ppm)
+            : renderRegressionCase<double>(c, options.benchRepeat, ppm);
+        r.checksum = hashToHex(hashBytes(ppm.data(), ppm.size()));
+
+        int width = 0, height = 0;
+        size_t offset = 0, goldenOffset = 0;
+        parsePPM(ppm, width, height, offset);
+        long long pixelCount = static_cast<long long>(width) * height;
+
+        std::string goldenPath = options.regressionDir + "/" + c.name + ".ppm";
+        std::vector<unsigned char> golden;
+        if (options.updateGolden) {
+            if (!writeBinaryFile(goldenPath, ppm)) return 1;
+            r.status = "NEW";
+            r.goldenChecksum = r.checksum;
+            r.diff.pixelCount = pixelCount;
+        }
+        else if (!readBinaryFile(goldenPath, golden)) {
+            r.status = "MISSING";
+        }
+        else {
+            int goldenWidth = 0, goldenHeight = 0;
+            if (!parsePPM(golden, goldenWidth, goldenHeight, goldenOffset) || goldenWidth != width || goldenHeight != height) {
+                std::cerr << goldenPath << ": expected a " << width << "x" << height << " binary PPM" << std::endl;
+                r.status = "FAIL";
+            }
+            else {
+                r.goldenChecksum = hashToHex(hashBytes(golden.data(), golden.size()));
+                r.diff = compareQuantized(golden.data() + goldenOffset, ppm.data() + offset, pixelCount, options.tolerance);
+                // Допуск тот же, что у --compare-precision: не более 0.1% пикселей за его пределами
+                bool passed = r.diff.pixelsOverTolerance * 1000 <= r.diff.pixelCount;
+                r.status = r.checksum == r.goldenChecksum ? "EXACT" : passed ? "PASS" : "FAIL";
+            }
+        }
+
+        if (r.status == "FAIL" || r.status == "MISSING") {
+            failures++;
+            writeBinaryFile("regression_" + c.name + ".ppm", ppm);
+        }
+        std::cout << c.name << ": " << r.seconds * 1000.0 << " ms, checksum " << r.checksum << ", max " << r.diff.maxDiff
+            << "/255, mean " << r.diff.meanDiff << ", " << r.diff.pixelsOverTolerance << " of " << r.diff.pixelCount
+            << " pixels over tolerance " << options.tolerance << " - " << r.status << std::endl;
+        results.push_back(r);
+    }
+
+    if (!writeRegressionReport(options.regressionOutput, options.tolerance, results)) {
+        return 1;
+    }
+    std::cout << "Regression report saved to: " << options.regressionOutput << std::endl;
+    std::cout << cases.size() - failures << " of " << cases.size() << " cases passed" << std::endl;
+    return failures > 0 ? 2 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << "Raycaster with Phong Lighting and Shadows" << std::endl;
+    std::cout << "=========================================" << std::endl;
+
+    // Разбор параметров командной строки
+    RenderOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    if (options.benchmark && options.benchFramebuffer) {
+        return options.useFloat ? runFramebufferBenchmark<float>(options) : runFramebufferBenchmark<double>(options);
+    }
+
+    if (options.benchmark) {
+        return options.useFloat ? runBenchmark<float>(options) : runBenchmark<double>(options);
+    }
+
+    if (!options.serverSocket.empty()) {
+        return runServer(options);
+    }
+
+    if (!options.regressionDir.empty()) {
+        return runRegression(options);
+    }
+
+    // Загрузка описания сцены; время чтения файла выводится отдельно от построения BVH и рендеринга
+    SceneDescription description;
+    if (options.scenePath.empty()) {
+        description = SceneDescription::createDefault();
+    }
+    else {
+        double startTime = omp_get_wtime();
+        if (!description.load(options.scenePath)) {
+            return 1;
+        }
+        std::cout << "Scene loaded from " << options.scenePath << " in "
+            << (omp_get_wtime() - startTime) * 1000.0 << " ms" << std::endl;
+    }
+
+    for (const auto& surface : options.surfaces) {
+        if (!addSurface(description, surface)) {
+            return 1;
+        }
+    }
+
+    if (options.workerFd >= 0) {
+        return options.useFloat ? runWorker<float>(options, description) : runWorker<double>(options, description);
+    }
+
+    if (!options.saveScenePath.empty()) {
+        if (!description.save(options.saveScenePath)) {
+            return 1;
+        }
+        std::cout << "Scene saved to " << options.saveScenePath << std::endl;
+    }
+
+    if (options.comparePrecision) {
+        // Эталон в double и быстрый путь во float на одной и той же сцене. Эталон всегда
+        // хранится в полном буфере, быстрый путь - в выбранном (--framebuffer)
+        ParallelRaycasterT<double> reference(options.width, options.height, description);
+        configureRaycaster(reference, options);
+        reference.setFramebufferFormat(FramebufferFormat::Full);
+        reference.renderParallel();
+
+        ParallelRaycasterT<float> fast(options.width, options.height, description);
+        configureRaycaster(fast, options);
+        fast.renderParallel();
+
+        reference.saveToPPM("output.ppm");
+        fast.saveToPPM("output_float.ppm");
+
+        // Допускается не более 0.1% пикселей за пределами допуска (границы теней и силуэтов)
+        ImageDiff diff = compareImages(reference.getImage(), fast.getImage(), options.tolerance);
+        bool passed = diff.pixelsOverTolerance * 1000 <= diff.pixelCount;
+        std::cout << "Precision diff (float vs double): max " << diff.maxDiff << "/255, mean " << diff.meanDiff
+            << ", " << diff.pixelsOverTolerance << " of " << diff.pixelCount << " pixels over tolerance "
+            << options.tolerance << " - " << (passed ? "PASS" : "FAIL") << std::endl;
+        return passed ? 0 : 2;
+    }
+
+    if (!options.animationPath.empty() || options.turntableFrames > 0) {
+        AnimationDescription animation;
+        if (options.turntableFrames > 0) {
+            animation = AnimationDescription::createTurntable(options.turntableFrames, Vector3(0, 0, -6), 6.0, 1.5);
+        }
+        else if (!animation.load(options.animationPath)) {
+            return 1;
+        }
+        return options.useFloat ? renderAnimation<float>(options, description, animation)
+            : renderAnimation<double>(options, description, animation);
+    }
+
+    if (options.compareWavefront) {
+        return options.useFloat ? compareWavefront<float>(options, description) : compareWavefront<double>(options, description);
+    }
+
+    if (options.compareShading) {
+        return options.useFloat ? compareShading<float>(options, description) : compareShading<double>(options, description);
+    }
+
+    if (options.workers > 0) {
+        int status = options.useFloat ? renderDistributed<float>(options, description, argc, argv)
+            : renderDistributed<double>(options, description, argc, argv);
+        if (status == 0) std::cout << "Done!" << std::endl;
+        return status;
+    }
+
+    // Создаем рейкастер, рендерим сцену и сохраняем результат
+    if (options.useFloat) {
+        renderAndSave<float>(options, description);
+    }
+    else {
+        renderAndSave<double>(options, description);
+    }
 
     std::cout << "Done!" << std::endl;
 